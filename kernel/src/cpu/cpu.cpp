@@ -3,14 +3,15 @@
 #include <cpu/interrupts/idt.hpp>
 #include <mem/vmm.hpp>
 #include <mem/pmm.hpp>
+#include <mem/slab.hpp>
+#include <mem/uaccess.hpp>
 #include <klib/cstdio.hpp>
 #include <sched/sched.hpp>
 
 namespace cpu {
     extern "C" void __syscall_entry();
 
-    // const usize stack_size = 0x10000; // 64 KiB
-    const usize stack_size = 0x1000; // FIXME: too small but i cant allocate contigous physical memory 
+    const usize stack_size = 0x10000; // 64 KiB
 
     static CPU bsp_cpu;
 
@@ -38,6 +39,8 @@ namespace cpu {
         asm volatile("fxrstor (%0)" : : "r" (storage) : "memory");
     }
 
+    static u32 num_aps_parked = 0;
+
     void smp_init(limine_mp_response *smp_res) {
         klib::printf("CPU: SMP | x2APIC: %s\n", (smp_res->flags & 1) ? "yes" : "no");
         for (u32 i = 0; i < smp_res->cpu_count; i++) {
@@ -51,6 +54,9 @@ namespace cpu {
             else
                 cpu = new CPU();
             cpu->cpu_number = i;
+            cpu->slab_cache = mem::slab::create_cpu_cache();
+            cpu->page_cache = pmm::create_cpu_page_cache();
+            cpu->kernel_stack_pool = sched::create_kernel_stack_pool();
             cpu_info->extra_argument = u64(cpu);
 
             if (!is_bsp) {
@@ -60,6 +66,10 @@ namespace cpu {
                 init(cpu_info);
             }
         }
+
+        // no ap may still be on its limine stack once bootloader memory is reclaimed
+        while (__atomic_load_n(&num_aps_parked, __ATOMIC_ACQUIRE) != smp_res->cpu_count - 1)
+            asm volatile("pause");
     }
 
     void early_init() {
@@ -90,6 +100,9 @@ namespace cpu {
         uptr sched_stack_phy = pmm::alloc_pages(stack_size / 0x1000);
         cpu->tss.ist1 = sched_stack_phy + stack_size + mem::hhdm;
 
+        uptr double_fault_stack_phy = pmm::alloc_pages(stack_size / 0x1000);
+        cpu->tss.ist2 = double_fault_stack_phy + stack_size + mem::hhdm;
+
         // hardcode PAT
         // 0: WB  1: WT  2: UC-  3: UC  4: WB  5: WT  6: WC  7: WP
         MSR::write(MSR::IA32_PAT, 0x501040600070406);
@@ -98,6 +111,7 @@ namespace cpu {
         u64 cr0 = read_cr0();
         cr0 &= ~(u64(1) << 2);
         cr0 |= u64(1) << 1;
+        cr0 |= u64(1) << 16; // write protect, the kernel must fault on copy on write pages too
         write_cr0(cr0);
 
         u64 cr4 = read_cr4();
@@ -110,7 +124,18 @@ namespace cpu {
                 cr4 |= u64(1) << 11; // enable UMIP
             if (ebx & (1 << 7))
                 cr4 |= u64(1) << 20; // enable SMEP
+            if (ebx & (1 << 20))
+                mem::smap_supported = true; // for stac and clac, SMAP itself stays off while syscalls still dereference user pointers
+            write_cr4(cr4);
+            if (ebx & (1 << 10))
+                mem::vmm->invpcid_supported = true;
+        }
+
+        // the kernel pagemap was just activated so cr3 has pcid 0, which enabling pcids requires
+        if (cpuid(1, 0, &eax, &ebx, &ecx, &edx) && (ecx & (1 << 17))) {
+            cr4 |= u64(1) << 17; // enable PCID
             write_cr4(cr4);
+            mem::vmm->pcid_enabled = true;
         }
     
         if (cpuid(1, 0, &eax, &ebx, &ecx, &edx)) {
@@ -170,9 +195,11 @@ namespace cpu {
 
         write_gs_base((uptr)cpu);
 
+        // the stack limine started this cpu on is bootloader reclaimable memory, which is freed after boot
+        // so the cpu is parked on its own interrupt stack, which nothing else uses as it never runs user code
         if (!cpu->is_bsp) {
-            asm volatile("cli");
-            while (true) asm volatile("hlt");
+            asm volatile("cli; mov %0, %%rsp; lock incl (%1); 1: hlt; jmp 1b" : : "r" (cpu->tss.rsp0), "r" (&num_aps_parked) : "memory");
+            __builtin_unreachable();
         }
     }
 }
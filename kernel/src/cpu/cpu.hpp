@@ -4,7 +4,9 @@
 #include <limine.hpp>
 #include <panic.hpp>
 
-namespace sched { struct Thread; }
+namespace sched { struct Thread; struct KernelStackPool; }
+namespace mem::slab { struct CpuCache; }
+namespace pmm { struct CpuPageCache; }
 
 namespace mmio {
     template<klib::Integral T>
@@ -51,6 +53,9 @@ namespace cpu {
         TSS tss;
         u64 lapic_id;
         u64 lapic_timer_freq;
+        mem::slab::CpuCache *slab_cache = nullptr;
+        pmm::CpuPageCache *page_cache = nullptr;
+        sched::KernelStackPool *kernel_stack_pool = nullptr;
     };
     
     struct [[gnu::packed]] InterruptState {
@@ -183,6 +188,20 @@ namespace cpu {
         asm volatile("invlpg (%0)" : : "r" (m) : "memory");
     }
 
+    namespace INVPCID {
+        enum Type : u64 {
+            ADDRESS = 0, // one address in one pcid
+            SINGLE_CONTEXT = 1, // every non global entry of one pcid
+            ALL_CONTEXTS_GLOBAL = 2,
+            ALL_CONTEXTS = 3 // every non global entry of every pcid
+        };
+    };
+
+    static inline void invpcid(INVPCID::Type type, u64 pcid, uptr addr) {
+        struct { u64 pcid; u64 addr; } descriptor = { pcid, addr };
+        asm volatile("invpcid %0, %1" : : "m" (descriptor), "r" ((u64)type) : "memory");
+    }
+
     template<klib::Integral T>
     inline void out(const u16 port, const T val) {
         static_assert(false, "T must be one of u8, u16, u32, u64");
@@ -2,6 +2,8 @@
 #include <cpu/gdt/gdt.hpp>
 #include <cpu/cpu.hpp>
 #include <mem/vmm.hpp>
+#include <mem/reclaim.hpp>
+#include <mem/uaccess.hpp>
 #include <klib/cstdio.hpp>
 #include <klib/bitmap.hpp>
 #include <sched/sched.hpp>
@@ -25,13 +27,13 @@ namespace cpu::interrupts {
         panic("Failed to allocate interrupt");
     }
 
-    static void load_idt_entry(u8 index, void (*wrapper)(), IDTType type) {
+    static void load_idt_entry(u8 index, void (*wrapper)(), IDTType type, u8 ist = 0) {
         auto *entry = &idt[index];
         entry->offset1 = (u64)wrapper & 0xFFFF;
         entry->offset2 = ((u64)wrapper & 0xFFFF0000) >> 16;
         entry->offset3 = ((u64)wrapper & 0xFFFFFFFF00000000) >> 32;
         entry->selector = u16(GDTSegment::KERNEL_CODE_64);
-        entry->attributes = (1 << 15) | (int(type) << 8); // set present bit and type
+        entry->attributes = (1 << 15) | (int(type) << 8) | ist; // set present bit and type
         entry->reserved = 0;
     }
 
@@ -131,8 +133,23 @@ namespace cpu::interrupts {
         auto *pagemap = mem::vmm->active_pagemap;
         if (cr2 >= 0xFFFF800000000000)
             pagemap = &mem::vmm->kernel_pagemap;
-        if (pagemap->handle_page_fault(cr2) < 0)
+        bool write = state->err & (1 << 1);
+        // code that ran with interrupts enabled holds no spinlock, that is user mode and the user access primitives of syscalls
+        if (state->rflags & (1 << 9)) {
+            cpu::toggle_interrupts(true);
+            mem::reclaim::direct_reclaim_if_low();
+            cpu::toggle_interrupts(false);
+        }
+        if (pagemap->handle_page_fault(cr2, write) < 0) {
+            // a user access primitive was given a bad pointer, it returns -EFAULT instead
+            if (!(state->err & (1 << 2))) {
+                if (uptr fixup = mem::find_exception_fixup(state->rip)) {
+                    state->rip = fixup;
+                    return;
+                }
+            }
             exception_handler(priv, state);
+        }
     }
 
     extern "C" void __idt_handler_common(u64 vec, InterruptState *state) {
@@ -141,8 +158,9 @@ namespace cpu::interrupts {
     }
 
     void load_idt() {
+        // a kernel stack overflow faults on the guard page and the page fault cannot be pushed either, the double fault needs a stack of its own
         for (usize i = 0; i < 256; i++)
-            load_idt_entry(i, __idt_wrappers[i], IDTType::INTERRUPT);
+            load_idt_entry(i, __idt_wrappers[i], IDTType::INTERRUPT, i == 8 ? 2 : 0);
         
         for (usize i = 0; i < 32; i++) {
             set_isr(i, i == 0xE ? page_fault_handler : exception_handler, (void*)i);
@@ -3,6 +3,7 @@
 #include <sched/sched.hpp>
 #include <sched/time.hpp>
 #include <mem/vmm.hpp>
+#include <mem/swap_disk.hpp>
 #include <fs/vfs.hpp>
 #include <userland/socket/socket.hpp>
 #include <userland/pipe.hpp>
@@ -9,7 +9,7 @@ namespace dev {
     klib::Awaitable<isize> BlockInterface::read_write_blocks(uptr buffer, usize block_count, usize first_block, Direction direction) {
         auto *pagemap = mem::vmm->active_pagemap;
         for (usize i = 0; i < block_count; i++) {
-            isize phy = pagemap->get_physical_addr(buffer + i * 0x1000);
+            isize phy = pagemap->get_physical_addr(buffer + i * 0x1000, direction == READ);
             if (phy < 0)
                 co_return phy;
             if (isize err = co_await read_write_block(first_block + i, phy, direction); err < 0)
@@ -25,7 +25,9 @@ namespace dev {
 
         // read/write partial block at the beginning
         if (buf_virt % 0x1000) {
-            pmm::Page *tmp_page = pmm::alloc_page();
+            pmm::Page *tmp_page = pmm::try_alloc_page();
+            if (tmp_page == nullptr)
+                co_return -ENOMEM;
             defer { pmm::free_page(tmp_page); };
             uptr tmp_phy = tmp_page->phy();
 
@@ -66,7 +68,9 @@ namespace dev {
 
         // read/write partial block at the end
         ASSERT(buf_virt % 0x1000 == 0);
-        pmm::Page *tmp_page = pmm::alloc_page();
+        pmm::Page *tmp_page = pmm::try_alloc_page();
+        if (tmp_page == nullptr)
+            co_return -ENOMEM;
         defer { pmm::free_page(tmp_page); };
         uptr tmp_phy = tmp_page->phy();
 
@@ -5,7 +5,11 @@
 
 namespace dev {
     struct BlockInterface {
+        static constexpr usize max_request_blocks = 32;
+
         virtual klib::RootAwaitable<isize> read_write_block(usize block, uptr page_phy, Direction direction) = 0;
+        // consecutive blocks from or to up to max_request_blocks pages in a single request
+        virtual klib::RootAwaitable<isize> read_write_block_range(usize first_block, const uptr *page_phys, usize count, Direction direction) = 0;
 
         klib::Awaitable<isize> read_write_blocks(uptr buffer, usize block_count, usize first_block, Direction direction);
         klib::Awaitable<isize> read_write(void *buf, usize count, usize offset, Direction direction);
@@ -242,7 +242,7 @@ namespace net {
 
     Packet LoopbackInterface::alloc_packet(usize requested_size) {
         ASSERT(requested_size <= mtu);
-        pmm::Page *page = pmm::alloc_page();
+        pmm::Page *page = pmm::try_alloc_page();
         if (page == nullptr)
             return {};
         return Packet {
@@ -6,9 +6,8 @@
 namespace dev::pci {
     void BAR::map() {
         ASSERT(is_mmio);
-        address = mem::vmm->virt_alloc(length);
         u64 page_flags = PAGE_PRESENT | PAGE_WRITABLE | PAGE_NO_EXECUTE | (is_prefetchable ? PAGE_WRITE_THROUGH : PAGE_CACHE_DISABLE);
-        mem::vmm->kernel_pagemap.map_direct(address, length, page_flags, physical);
+        address = mem::vmm->map_mmio(physical, length, page_flags);
     }
 
     BAR* Device::get_bar(u8 index) {
@@ -180,11 +180,20 @@ namespace dev::virtio {
         for (i = queue.last_seen_used; i != queue.used_ring->index % queue.length; i = (i + 1) % queue.length) {
             u16 desc = queue.used_ring->ring[i].id;
             Request *request = (Request*)(queue.descriptor_array[desc].address + mem::hhdm - offsetof(Request, request_header));
-            request->callback.invoke(0); // FIXME: should return actual result
+            isize result = request->request_status == 0 ? 0 : -EIO;
+
+            // the chain is the header, the pages and the status
+            while (true) {
+                u16 next = queue.descriptor_array[desc].next;
+                bool has_next = queue.descriptor_array[desc].flags & Queue::Descriptor::FLAG_NEXT;
+                queue.free_descriptor(desc);
+                if (!has_next)
+                    break;
+                desc = next;
+            }
+            auto callback = request->callback;
             free_request(request);
-            queue.free_descriptor(queue.descriptor_array[queue.descriptor_array[desc].next].next);
-            queue.free_descriptor(queue.descriptor_array[desc].next);
-            queue.free_descriptor(desc);
+            callback.invoke(result);
         }
         queue.last_seen_used = i;
     }
@@ -207,44 +216,53 @@ namespace dev::virtio {
     }
 
     klib::RootAwaitable<isize> BlockDevice::read_write_block(usize block, uptr page_phy, Direction direction) {
-        isize err = 0;
+        return read_write_block_range(block, &page_phy, 1, direction);
+    }
+
+    klib::RootAwaitable<isize> BlockDevice::read_write_block_range(usize first_block, const uptr *page_phys, usize count, Direction direction) {
+        ASSERT(count > 0 && count <= max_request_blocks);
         auto *descriptors = queue.descriptor_array;
 
         auto *request = alloc_request();
-        defer { if (err < 0) free_request(request); };
-        if (!request) return err = -ENOMEM;
+        if (!request) return -ENOMEM;
+
+        u16 chain[max_request_blocks + 2];
+        usize chain_length = count + 2;
+        for (usize i = 0; i < chain_length; i++) {
+            chain[i] = queue.alloc_descriptor();
+            if (chain[i] == queue.length) {
+                for (usize j = 0; j < i; j++)
+                    queue.free_descriptor(chain[j]);
+                free_request(request);
+                return -ENOMEM;
+            }
+        }
 
         request->request_header.type = direction == WRITE ? RequestHeader::TYPE_OUT : RequestHeader::TYPE_IN;
-        request->request_header.sector = block * 8;
-
-        u16 desc1 = queue.alloc_descriptor();
-        if (desc1 == queue.length) return err = -ENOMEM;
-        defer { if (err < 0) queue.free_descriptor(desc1); };
-        descriptors[desc1].address = (uptr)&request->request_header - mem::hhdm;
-        descriptors[desc1].length = sizeof(RequestHeader);
-        descriptors[desc1].flags = Queue::Descriptor::FLAG_NEXT;
-
-        u16 desc2 = queue.alloc_descriptor();
-        if (desc2 == queue.length) return err = -ENOMEM;
-        defer { if (err < 0) queue.free_descriptor(desc2); };
-        descriptors[desc2].address = page_phy;
-        descriptors[desc2].length = 0x1000;
-        descriptors[desc2].flags = Queue::Descriptor::FLAG_NEXT | (direction == WRITE ? 0 : Queue::Descriptor::FLAG_DEVICE_WRITE);
-
-        u16 desc3 = queue.alloc_descriptor();
-        if (desc3 == queue.length) return err = -ENOMEM;
-        defer { if (err < 0) queue.free_descriptor(desc3); };
-        descriptors[desc3].address = (uptr)&request->request_status - mem::hhdm;
-        descriptors[desc3].length = sizeof(u8);
-        descriptors[desc3].flags = Queue::Descriptor::FLAG_DEVICE_WRITE;
-
-        descriptors[desc1].next = desc2;
-        descriptors[desc2].next = desc3;
+        request->request_header.sector = first_block * 8;
+        request->request_status = 0xFF;
+
+        descriptors[chain[0]].address = (uptr)&request->request_header - mem::hhdm;
+        descriptors[chain[0]].length = sizeof(RequestHeader);
+        descriptors[chain[0]].flags = Queue::Descriptor::FLAG_NEXT;
+
+        for (usize i = 0; i < count; i++) {
+            descriptors[chain[i + 1]].address = page_phys[i];
+            descriptors[chain[i + 1]].length = 0x1000;
+            descriptors[chain[i + 1]].flags = Queue::Descriptor::FLAG_NEXT | (direction == WRITE ? 0 : Queue::Descriptor::FLAG_DEVICE_WRITE);
+        }
+
+        descriptors[chain[count + 1]].address = (uptr)&request->request_status - mem::hhdm;
+        descriptors[chain[count + 1]].length = sizeof(u8);
+        descriptors[chain[count + 1]].flags = Queue::Descriptor::FLAG_DEVICE_WRITE;
+
+        for (usize i = 0; i + 1 < chain_length; i++)
+            descriptors[chain[i]].next = chain[i + 1];
 
         auto awaitable = klib::RootAwaitable<isize>(&request->callback);
         {
             klib::InterruptLock interrupt_guard;
-            queue.submit_descriptor(desc1);
+            queue.submit_descriptor(chain[0]);
             notify_queue(&queue, 0);
         }
         return awaitable;
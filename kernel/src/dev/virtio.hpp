@@ -90,6 +90,7 @@ namespace dev::virtio {
         void deinit();
 
         klib::RootAwaitable<isize> read_write_block(usize block, uptr page_phy, Direction direction) override;
+        klib::RootAwaitable<isize> read_write_block_range(usize first_block, const uptr *page_phys, usize count, Direction direction) override;
     
     private:
         struct [[gnu::packed]] RequestHeader {
@@ -6,6 +6,10 @@
 #include <dev/devnode.hpp>
 #include <sched/sched.hpp>
 #include <sched/time.hpp>
+#include <mem/slab.hpp>
+#include <mem/reclaim.hpp>
+#include <mem/swap.hpp>
+#include <mem/zram.hpp>
 #include <cpu/cpu.hpp>
 #include <panic.hpp>
 #include <sys/mman.h>
@@ -173,6 +177,30 @@ namespace procfs {
         return total_written;
     }
 
+    isize TunableNode::read(vfs::FileDescription *fd, void *buf, usize count, usize offset) {
+        char str[24];
+        usize length = klib::snprintf(str, sizeof(str), "%lu\n", *value);
+        if (offset >= length)
+            return 0;
+        usize actual_count = klib::min(count, length - offset);
+        memcpy(buf, str + offset, actual_count);
+        return actual_count;
+    }
+
+    isize TunableNode::write(vfs::FileDescription *fd, const void *buf, usize count, usize offset) {
+        const char *str = (const char*)buf;
+        usize new_value = 0, i = 0;
+        for (; i < count && str[i] >= '0' && str[i] <= '9'; i++) {
+            new_value = new_value * 10 + (str[i] - '0');
+            if (new_value > max)
+                return -EINVAL;
+        }
+        if (i == 0 || (i < count && str[i] != '\n') || new_value < min)
+            return -EINVAL;
+        *value = new_value;
+        return count;
+    }
+
     Driver::Driver() {
         fs_global = new Filesystem();
     }
@@ -222,12 +250,106 @@ namespace procfs {
                 info_node_printf("%s%8lu kB\n", name, value / 1024);
             };
             print_value("MemTotal:       ", pmm::stats.total_pages_usable * 0x1000);
-            print_value("MemFree:        ", pmm::stats.total_free_pages * 0x1000);
-            print_value("MemAvailable:   ", pmm::stats.total_free_pages * 0x1000);
+            print_value("MemFree:        ", pmm::num_free_pages() * 0x1000);
+            print_value("MemAvailable:   ", mem::reclaim::available_pages() * 0x1000);
             print_value("Buffers:        ", 0);
-            print_value("Cached:         ", 0);
+            print_value("Cached:         ", pmm::stats.file_pages * 0x1000);
             print_value("SwapCached:     ", 0);
-            print_value("Slab:           ", 0);
+            print_value("SwapTotal:      ", mem::swap::total_slots() * 0x1000);
+            print_value("SwapFree:       ", (mem::swap::total_slots() - mem::swap::used_slots()) * 0x1000);
+            print_value("Slab:           ", mem::slab::total_bytes());
+            print_value("KernelStack:    ", sched::kernel_stack_stats.num_stacks * sched::kernel_stack_size);
+            print_value("VmallocTotal:   ", mem::kernel_va_size);
+            print_value("VmallocUsed:    ", mem::vm_stats.vmalloc_pages * 0x1000);
+        }, vfs::NodeType::REGULAR), 0, 0, 0444);
+
+        vfs::create_entry(root_entry, "buddyinfo", new InfoNode([] (InfoNode *self) {
+            info_node_printf("Node 0, zone   Normal");
+            for (usize order = 0; order <= pmm::max_order; order++)
+                info_node_printf(" %6lu", pmm::stats.free_blocks[order]);
+            info_node_printf("\n");
+        }, vfs::NodeType::REGULAR), 0, 0, 0444);
+
+        vfs::create_entry(root_entry, "pagecache_stats", new InfoNode([] (InfoNode *self) {
+            info_node_printf("# cpu <pages> <alloc_hits> <alloc_misses> <free_hits> <free_drains> <alloc_hit_percent> <free_hit_percent>\n");
+            usize cpu_index = 0;
+            for (auto *cache = pmm::cpu_page_cache_list(); cache; cache = cache->next, cpu_index++) {
+                usize allocs = cache->alloc_hits + cache->alloc_misses;
+                usize frees = cache->free_hits + cache->free_drains;
+                info_node_printf("cpu%lu %lu %lu %lu %lu %lu %lu %lu\n", cpu_index, cache->num_pages,
+                    cache->alloc_hits, cache->alloc_misses, cache->free_hits, cache->free_drains,
+                    allocs ? cache->alloc_hits * 100 / allocs : 0, frees ? cache->free_hits * 100 / frees : 0);
+            }
+        }, vfs::NodeType::REGULAR), 0, 0, 0444);
+
+        vfs::create_entry(root_entry, "vmstat", new InfoNode([] (InfoNode *self) {
+            info_node_printf("zero_page_faults %lu\n", mem::vm_stats.zero_page_faults);
+            info_node_printf("zero_page_copies %lu\n", mem::vm_stats.zero_page_copies);
+            usize zeroed_allocs = pmm::stats.zeroed_hits + pmm::stats.zeroed_misses;
+            info_node_printf("zeroed_pool_pages %lu\n", pmm::stats.zeroed_pages);
+            info_node_printf("zeroed_pool_hits %lu\n", pmm::stats.zeroed_hits);
+            info_node_printf("zeroed_pool_misses %lu\n", pmm::stats.zeroed_misses);
+            info_node_printf("zeroed_pool_hit_percent %lu\n", zeroed_allocs ? pmm::stats.zeroed_hits * 100 / zeroed_allocs : 0);
+            info_node_printf("pages_zeroed_idle %lu\n", pmm::stats.pages_zeroed);
+            info_node_printf("pages_deferred %lu\n", pmm::stats.deferred_pages);
+            info_node_printf("file_faults %lu\n", mem::vm_stats.file_faults);
+            info_node_printf("fault_around_pages %lu\n", mem::vm_stats.fault_around_pages);
+            info_node_printf("pglazyfree %lu\n", mem::vm_stats.lazyfree_marked);
+            info_node_printf("pglazyfreed %lu\n", mem::vm_stats.lazyfree_reclaimed);
+            info_node_printf("pgscan %lu\n", mem::vm_stats.pages_scanned);
+            info_node_printf("pgsteal_file %lu\n", mem::vm_stats.file_pages_reclaimed);
+            info_node_printf("kswapd_wakeups %lu\n", mem::reclaim::stats.kswapd_wakeups);
+            info_node_printf("direct_reclaims %lu\n", mem::reclaim::stats.direct_reclaims);
+            info_node_printf("oom_kill %lu\n", mem::reclaim::stats.oom_kills);
+            info_node_printf("pswpin %lu\n", mem::swap::stats.pages_swapped_in);
+            info_node_printf("pswpout %lu\n", mem::swap::stats.pages_swapped_out);
+            info_node_printf("pswpout_failed %lu\n", mem::swap::stats.failed_swap_outs);
+            info_node_printf("swap_clusters %lu\n", mem::swap::stats.clusters_written);
+            info_node_printf("swap_ra %lu\n", mem::swap::stats.readahead_pages);
+            info_node_printf("swap_ra_hit %lu\n", mem::swap::stats.readahead_hits);
+        }, vfs::NodeType::REGULAR), 0, 0, 0444);
+
+        vfs::create_entry(root_entry, "swaps", new InfoNode([] (InfoNode *self) {
+            info_node_printf("Filename\t\t\t\tType\t\tSize\t\tUsed\t\tPriority\n");
+            for (usize i = 0; i < mem::swap::num_areas; i++) {
+                mem::swap::Area *area = mem::swap::areas[i];
+                info_node_printf("%s\t\t\t\t%s\t%lu\t\t%lu\t\t%d\n", area->name, area->type, area->num_slots * 4, area->num_used * 4, area->priority);
+            }
+        }, vfs::NodeType::REGULAR), 0, 0, 0444);
+
+        vfs::create_entry(root_entry, "zram", new InfoNode([] (InfoNode *self) {
+            mem::zram::Device *device = mem::zram::device;
+            if (device == nullptr)
+                return;
+            auto &stats = device->stats;
+            usize orig_bytes = stats.pages_stored * 0x1000;
+            usize used_bytes = stats.pool_pages * 0x1000;
+            // the ratio is against the memory the pool really takes up, fragmentation included
+            usize ratio = used_bytes ? orig_bytes * 100 / used_bytes : 0;
+            info_node_printf("orig_data_size %lu\n", orig_bytes);
+            info_node_printf("compr_data_size %lu\n", stats.compressed_bytes);
+            info_node_printf("mem_used_total %lu\n", used_bytes);
+            info_node_printf("mem_limit %lu\n", device->max_pool_pages * 0x1000);
+            info_node_printf("same_pages %lu\n", stats.zero_pages);
+            info_node_printf("incompressible_pages %lu\n", stats.incompressible_pages);
+            info_node_printf("pool_limit_hits %lu\n", stats.pool_limit_hits);
+            info_node_printf("compr_ratio %lu.%02lu\n", ratio / 100, ratio % 100);
+        }, vfs::NodeType::REGULAR), 0, 0, 0444);
+
+        vfs::create_entry(root_entry, "slabinfo", new InfoNode([] (InfoNode *self) {
+            info_node_printf("# name <active_objs> <num_slabs> <objsize> <objperslab> <allocs> <frees> <magazine_hits> <depot_full> <depot_empty>\n");
+            for (usize i = 0; i < mem::slab::num_size_classes; i++) {
+                mem::slab::Cache *cache = &mem::slab::caches[i];
+                usize alloc_hits, free_hits;
+                mem::slab::magazine_hits(i, &alloc_hits, &free_hits);
+                info_node_printf("%s %lu %lu %lu %lu %lu %lu %lu %lu %lu\n", cache->name,
+                    cache->stats.active_objects, cache->stats.num_slabs, cache->object_size, cache->objects_per_slab,
+                    cache->stats.num_allocs + alloc_hits, cache->stats.num_frees + free_hits, alloc_hits + free_hits,
+                    cache->depot_num_full, cache->depot_num_empty);
+            }
+            auto &large = mem::slab::large_stats;
+            info_node_printf("kmalloc-large %lu %lu 0 0 %lu %lu 0 0 0\n",
+                large.active_allocations, large.active_bytes / 0x1000, large.num_allocs, large.num_frees);
         }, vfs::NodeType::REGULAR), 0, 0, 0444);
 
         vfs::create_entry(root_entry, "stat", new InfoNode([] (InfoNode *self) {
@@ -244,6 +366,16 @@ namespace procfs {
             info_node_printf("procs_blocked 0\n");
             info_node_printf("softirq 0 0 0 0 0 0 0 0 0 0 0\n");
         }, vfs::NodeType::REGULAR), 0, 0, 0444);
+
+        auto *sys_dir = vfs::lookup(root_entry, "sys");
+        sys_dir->create(vfs::NodeType::DIRECTORY, 0, 0, 0555);
+        auto *sys_vm_dir = vfs::lookup(sys_dir, "vm");
+        sys_vm_dir->create(vfs::NodeType::DIRECTORY, 0, 0, 0555);
+
+        vfs::create_entry(sys_vm_dir, "fault_around_pages", new TunableNode(&mem::fault_around_pages, 1, mem::max_fault_around_pages), 0, 0, 0644);
+        vfs::create_entry(sys_vm_dir, "min_free_pages", new TunableNode(&pmm::min_free_pages, 32, 1 << 20), 0, 0, 0644);
+        vfs::create_entry(sys_vm_dir, "zeroed_pool_pages", new TunableNode(&pmm::max_zeroed_pages, 0, 1 << 20), 0, 0, 0644);
+        vfs::create_entry(sys_vm_dir, "readahead_pages", new TunableNode(&mem::readahead_pages, 1, mem::max_fault_around_pages), 0, 0, 0644);
     }
 
     static void create_thread_process_common(sched::Thread *thread, vfs::Entry *dir) {
@@ -261,9 +393,16 @@ namespace procfs {
             case sched::Thread::ZOMBIE:  state = 'Z'; break;
             }
 
-            info_node_printf("%d (%s) %c %d %d %d",
-                process->pid, thread->name, state, process->parent->pid, process->group->leader_process->pid, process->session_leader()->pid);
-            for (int i = 0; i < 52 - 6; i++) {
+            usize min_faults = 0, maj_faults = 0;
+            if (auto *pagemap = process->pagemap) {
+                maj_faults = pagemap->num_file_faults;
+                min_faults = pagemap->num_faults - maj_faults;
+            }
+
+            info_node_printf("%d (%s) %c %d %d %d 0 0 0 %lu 0 %lu",
+                process->pid, thread->name, state, process->parent->pid, process->group->leader_process->pid, process->session_leader()->pid,
+                min_faults, maj_faults);
+            for (int i = 0; i < 52 - 12; i++) {
                 info_node_put(' ');
                 info_node_put('0');
             }
@@ -296,6 +435,16 @@ namespace procfs {
             for (usize i = 0; i < cred.groups.size(); i++)
                 info_node_printf("%d ", cred.groups[i]);
             info_node_put('\n');
+            auto *pagemap = process->pagemap;
+            info_node_printf("VmRSS:\t%lu kB\n", pagemap->num_small_pages * 4 + pagemap->num_huge_pages * (mem::huge_page_size / 1024));
+            info_node_printf("VmSwap:\t%lu kB\n", pagemap->num_swap_pages * 4);
+            info_node_printf("RssSmallPages:\t%lu\n", pagemap->num_small_pages);
+            info_node_printf("RssHugePages:\t%lu\n", pagemap->num_huge_pages);
+            info_node_printf("PageFaults:\t%lu\n", pagemap->num_faults);
+            info_node_printf("FileFaults:\t%lu\n", pagemap->num_file_faults);
+            info_node_printf("FaultAroundPages:\t%lu\n", pagemap->num_fault_around_pages);
+            if (thread->stack_top)
+                info_node_printf("KernelStackHighWater:\t%lu kB\n", sched::kernel_stack_high_water(thread->stack_top) / 1024);
         }, vfs::NodeType::REGULAR), uid, gid, 0444);
     }
 
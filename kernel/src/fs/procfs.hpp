@@ -30,6 +30,17 @@ namespace procfs {
         klib::Function<void(InfoNode *self)> print_contents;
     };
 
+    // a number that can be changed by writing to it, for the tunables in /proc/sys
+    struct TunableNode final : public vfs::VNode {
+        usize *value;
+        usize min, max;
+
+        TunableNode(usize *value, usize min, usize max) : value(value), min(min), max(max) { node_type = vfs::NodeType::REGULAR; }
+
+        isize read(vfs::FileDescription *fd, void *buf, usize count, usize offset) override;
+        isize write(vfs::FileDescription *fd, const void *buf, usize count, usize offset) override;
+    };
+
     struct NodeData {
         ino_t inode_num;
         u8 *storage;
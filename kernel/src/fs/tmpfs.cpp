@@ -4,6 +4,7 @@
 #include <klib/cstdlib.hpp>
 #include <klib/cstdio.hpp>
 #include <dev/devnode.hpp>
+#include <mem/reclaim.hpp>
 #include <sched/sched.hpp>
 #include <sched/time.hpp>
 #include <cpu/cpu.hpp>
@@ -59,8 +60,8 @@ namespace tmpfs {
         buf->f_bsize = 0x1000;
         buf->f_frsize = 0x1000;
         buf->f_blocks = pmm::stats.total_pages_usable;
-        buf->f_bfree = pmm::stats.total_free_pages;
-        buf->f_bavail = pmm::stats.total_free_pages;
+        buf->f_bfree = pmm::num_free_pages();
+        buf->f_bavail = pmm::num_free_pages();
         buf->f_files = 1 << 20;
         buf->f_ffree = (1 << 20) - 1000;
     }
@@ -114,6 +115,9 @@ namespace tmpfs {
         if (node_type == vfs::NodeType::DIRECTORY) return -EISDIR;
         NodeData *node_data = (NodeData*)fs_data;
         if (count == 0) [[unlikely]] return 0;
+        // growing the file backs its storage with new pages on behalf of user space, like a user fault
+        if (!mem::reclaim::direct_reclaim_if_low() && offset + count > node_data->size)
+            return -ENOSPC;
         if (offset + count > node_data->size)
             grow_to(offset + count);
         memcpy(node_data->storage + offset, buf, count);
@@ -4,6 +4,7 @@
 #include <klib/cstdio.hpp>
 #include <klib/algorithm.hpp>
 #include <klib/hashtable.hpp>
+#include <mem/uaccess.hpp>
 #include <dev/devnode.hpp>
 #include <sched/sched.hpp>
 #include <sched/time.hpp>
@@ -894,25 +895,61 @@ namespace vfs {
         }
     }
 
+    // ppoll_impl on a copy of the user's pollfds, timeout and sigmask are already in kernel memory
+    static isize ppoll_user(struct pollfd *user_fds, nfds_t nfds, const klib::TimeSpec *timeout, const u64 *sigmask) {
+        if (nfds > 1024)
+            return -EINVAL;
+        struct pollfd *fds = new struct pollfd[nfds];
+        defer { delete[] fds; };
+        if (mem::copy_from_user(fds, user_fds, nfds * sizeof(struct pollfd)) < 0)
+            return -EFAULT;
+
+        isize ret = ppoll_impl(fds, nfds, timeout, sigmask);
+        if (ret < 0)
+            return ret;
+        if (mem::copy_to_user(user_fds, fds, nfds * sizeof(struct pollfd)) < 0)
+            return -EFAULT;
+        return ret;
+    }
+
     isize syscall_poll(struct pollfd *fds, nfds_t nfds, int timeout) {
         log_syscall("poll(%#lX, %lu, %d)\n", (uptr)fds, nfds, timeout);
         if (timeout >= 0) {
             klib::TimeSpec ts;
             ts.seconds = timeout / 1000;
             ts.nanoseconds = (timeout % 1000) * 1000000;
-            return ppoll_impl(fds, nfds, &ts, nullptr);
+            return ppoll_user(fds, nfds, &ts, nullptr);
         }
-        return ppoll_impl(fds, nfds, nullptr, nullptr);
+        return ppoll_user(fds, nfds, nullptr, nullptr);
     }
 
     isize syscall_ppoll(struct pollfd *fds, nfds_t nfds, const klib::TimeSpec *timeout, const u64 *sigmask) {
         log_syscall("ppoll(%#lX, %lu, %#lX, %#lX)\n", (uptr)fds, nfds, (uptr)timeout, (uptr)sigmask);
-        return ppoll_impl(fds, nfds, timeout, sigmask);
+        klib::TimeSpec kernel_timeout;
+        u64 kernel_sigmask;
+        if (timeout && mem::get_user(&kernel_timeout, timeout) < 0)
+            return -EFAULT;
+        if (sigmask && mem::get_user(&kernel_sigmask, sigmask) < 0)
+            return -EFAULT;
+        return ppoll_user(fds, nfds, timeout ? &kernel_timeout : nullptr, sigmask ? &kernel_sigmask : nullptr);
     }
 
-    static isize pselect_impl(nfds_t nfds, fd_set *readfds, fd_set *writefds, fd_set *exceptfds, const klib::TimeSpec *timeout, const u64 *sigmask) {
+    // the fd sets are user pointers, timeout and sigmask are in kernel memory
+    static isize pselect_impl(nfds_t nfds, fd_set *user_readfds, fd_set *user_writefds, fd_set *user_exceptfds, const klib::TimeSpec *timeout, const u64 *sigmask) {
         if (nfds > 1024)
             return -EINVAL;
+
+        fd_set kernel_readfds, kernel_writefds, kernel_exceptfds;
+        fd_set *readfds = user_readfds ? &kernel_readfds : nullptr;
+        fd_set *writefds = user_writefds ? &kernel_writefds : nullptr;
+        fd_set *exceptfds = user_exceptfds ? &kernel_exceptfds : nullptr;
+        if (readfds && mem::get_user(readfds, user_readfds) < 0)
+            return -EFAULT;
+        if (writefds && mem::get_user(writefds, user_writefds) < 0)
+            return -EFAULT;
+        if (exceptfds && mem::get_user(exceptfds, user_exceptfds) < 0)
+            return -EFAULT;
+
         struct pollfd fds[1024] = {};
 
         for (usize i = 0; i < nfds; i++) {
@@ -952,21 +989,24 @@ namespace vfs {
                 FD_SET(i, &res_exceptfds);
         }
 
-        if (readfds)
-            *readfds = res_readfds;
-        if (writefds)
-            *writefds = res_writefds;
-        if (exceptfds)
-            *exceptfds = res_exceptfds;
+        if (readfds && mem::put_user(user_readfds, res_readfds) < 0)
+            return -EFAULT;
+        if (writefds && mem::put_user(user_writefds, res_writefds) < 0)
+            return -EFAULT;
+        if (exceptfds && mem::put_user(user_exceptfds, res_exceptfds) < 0)
+            return -EFAULT;
         return ret;
     }
 
     isize syscall_select(int nfds, fd_set *readfds, fd_set *writefds, fd_set *exceptfds, timeval *timeout) {
         log_syscall("select(%d, %#lX, %#lX, %#lX, %#lX)\n", nfds, (uptr)readfds, (uptr)writefds, (uptr)exceptfds, (uptr)timeout);
         if (timeout) {
+            timeval kernel_timeout;
+            if (mem::get_user(&kernel_timeout, timeout) < 0)
+                return -EFAULT;
             klib::TimeSpec ts;
-            ts.seconds = timeout->tv_sec;
-            ts.nanoseconds = timeout->tv_usec * 1000;
+            ts.seconds = kernel_timeout.tv_sec;
+            ts.nanoseconds = kernel_timeout.tv_usec * 1000;
             return pselect_impl(nfds, readfds, writefds, exceptfds, &ts, nullptr);
         }
         return pselect_impl(nfds, readfds, writefds, exceptfds, nullptr, nullptr);
@@ -974,7 +1014,16 @@ namespace vfs {
 
     isize syscall_pselect6(int nfds, fd_set *readfds, fd_set *writefds, fd_set *exceptfds, const klib::TimeSpec *timeout, const u64 **sigmask) {
         log_syscall("pselect6(%d, %#lX, %#lX, %#lX, %#lX, %#lX)\n", nfds, (uptr)readfds, (uptr)writefds, (uptr)exceptfds, (uptr)timeout, (uptr)sigmask);
-        return pselect_impl(nfds, readfds, writefds, exceptfds, timeout, sigmask ? *sigmask : nullptr);
+        klib::TimeSpec kernel_timeout;
+        const u64 *user_sigmask = nullptr;
+        u64 kernel_sigmask;
+        if (timeout && mem::get_user(&kernel_timeout, timeout) < 0)
+            return -EFAULT;
+        if (sigmask && mem::get_user(&user_sigmask, sigmask) < 0)
+            return -EFAULT;
+        if (user_sigmask && mem::get_user(&kernel_sigmask, user_sigmask) < 0)
+            return -EFAULT;
+        return pselect_impl(nfds, readfds, writefds, exceptfds, timeout ? &kernel_timeout : nullptr, user_sigmask ? &kernel_sigmask : nullptr);
     }
 
     static isize readlinkat_impl(int dirfd, const char *path, void *buf, usize count) {
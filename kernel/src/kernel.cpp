@@ -15,7 +15,10 @@
 #include <mem/pmm.hpp>
 #include <mem/vmm.hpp>
 #include <mem/vmem.hpp>
-#include <mem/bump.hpp>
+#include <mem/slab.hpp>
+#include <mem/bench.hpp>
+#include <mem/reclaim.hpp>
+#include <mem/zram.hpp>
 #include <panic.hpp>
 #include <acpi/tables.hpp>
 #include <sched/timer/pit.hpp>
@@ -148,7 +151,7 @@ extern "C" [[noreturn]] void kmain() {
     mem::vmm->init(hhdm, memmap_req.response, kernel_addr_req.response);
     klib::printf("VMM: Initialized\n");
 
-    mem::bump::init(mem::vmm->heap_base, mem::vmm->heap_size);
+    mem::slab::init(mem::vmm->heap_base, mem::vmm->heap_size);
     klib::printf("Allocator: Initialized\n");
 
     // call global constructors
@@ -159,6 +162,8 @@ extern "C" [[noreturn]] void kmain() {
     gfx::kernel_terminal_enabled = true;
     klib::printf("Terminal: Initialized\n");
 
+    klib::select_mem_variants();
+
     cpu::smp_init(smp_req.response);
 
     klib::printf("ACPI: Parsing ACPI tables and enabling APIC\n");
@@ -173,7 +178,15 @@ extern "C" [[noreturn]] void kmain() {
     sched::init_time(boot_time_req.response);
     klib::printf("Scheduler: Initialized\n");
 
-    procfs::kernel_cmdline = kernel_file_req.response->kernel_file->cmdline;
+    mem::reclaim::init();
+    klib::printf("Reclaim: Initialized\n");
+
+    // copied since it is in bootloader memory
+    procfs::kernel_cmdline = klib::strdup(kernel_file_req.response->kernel_file->cmdline);
+
+    if (!klib::strstr(procfs::kernel_cmdline, "nozram"))
+        mem::zram::init();
+
     vfs::init();
     klib::printf("VFS: Initialized\n");
 
@@ -208,6 +221,9 @@ static void create_device_file(const char *path, uint major, uint minor, bool is
     dev::input::init();
     klib::printf("Input: Initialized\n");
 
+    if (klib::strstr(procfs::kernel_cmdline, "membench"))
+        mem::bench::run_all();
+
     auto module_res = module_req.response;
     if (module_res->module_count == 0) panic("No initramfs Limine module loaded");
     if (module_res->module_count > 1) panic("Too many Limine modules loaded");
@@ -215,6 +231,9 @@ static void create_device_file(const char *path, uint major, uint minor, bool is
     klib::printf("Loading initramfs file %s (size: %ld KiB)\n", initramfs_module->path, initramfs_module->size / 1024);
     initramfs::load_into(vfs::get_root_entry(), initramfs_module->address, initramfs_module->size);
 
+    // the limine responses are not used past this point, and kmain's stack was left behind by the first context switch
+    pmm::reclaim_bootloader_mem(memmap_req.response);
+
     auto *dev_dir = vfs::path_to_entry("/dev");
     if (dev_dir->vnode == nullptr)
         dev_dir->create(vfs::NodeType::DIRECTORY, 0, 0, 0755);
@@ -255,7 +274,7 @@ static void create_device_file(const char *path, uint major, uint minor, bool is
 
     klib::printf("Loading executable %s\n", init_path);
     sched::Process *init_process;
-    if (klib::strstr(kernel_file_req.response->kernel_file->cmdline, "startwm")) {
+    if (klib::strstr(procfs::kernel_cmdline, "startwm")) {
         gfx::kernel_terminal_enabled = false;
         char *argv[] = { (char*)init_path, (char*)"--startwm", nullptr };
         init_process = sched::create_init_process(init_path, 2, argv);
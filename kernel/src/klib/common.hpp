@@ -154,12 +154,7 @@ namespace klib {
         return __builtin_addressof(x);
     }
 
-    inline u32 hash(const char *str) { // djb2a
-        u32 hash = 5381;
-        for (const char *c = str; *c; c++)
-            hash = ((hash << 5) + hash) ^ *c; // hash * 33 ^ str[i]
-        return hash;
-    }
+    u32 hash(const char *str); // a word at a time, in cstring.cpp
 
     inline u64 hash(u64 h) { // murmur64
         h ^= h >> 33;
@@ -69,8 +69,8 @@ void operator delete[](void *ptr) {
 }
 
 void operator delete(void *ptr, usize size) {
+    memset(ptr, 0xAE, size); // poison before the memory can be reused
     ::operator delete(ptr);
-    memset(ptr, 0xAE, size);
 }
 
 void operator delete[](void *ptr, usize size) {
@@ -1,12 +1,31 @@
 #include <klib/cstring.hpp>
 #include <klib/cstdlib.hpp>
+#include <klib/cstdio.hpp>
+#include <cpu/cpu.hpp>
 
 namespace klib {
+    using word_t [[gnu::may_alias]] = u64;
+
+    constexpr u64 low_bytes = 0x0101010101010101;
+    constexpr u64 high_bits = 0x8080808080808080;
+
+    // the lowest set bit is the high bit of the first zero byte, higher ones can be wrong
+    static inline u64 zero_byte_mask(u64 word) {
+        return (word - low_bytes) & ~word & high_bits;
+    }
+
+    // an aligned word never crosses into the next page, so reading past the terminator with it cannot fault
     usize strlen(const char *str) {
-        usize len = 0;
-        while (str[len])
-            len++;
-        return len;
+        const char *c = str;
+        for (; (uptr)c % 8; c++)
+            if (*c == '\0')
+                return c - str;
+
+        const word_t *word = (const word_t*)c;
+        u64 mask;
+        while (!(mask = zero_byte_mask(*word)))
+            word++;
+        return (const char*)word - str + __builtin_ctzl(mask) / 8;
     }
 
     usize strnlen(const char *str, usize maxlen) {
@@ -42,6 +61,21 @@ namespace klib {
     }
 
     int strcmp(const char *lhs, const char *rhs) {
+        // a word at a time once both are aligned, which they can only be together if they start equally misaligned
+        if ((uptr)lhs % 8 == (uptr)rhs % 8) {
+            for (; (uptr)lhs % 8; lhs++, rhs++)
+                if (*lhs == '\0' || *lhs != *rhs)
+                    return *(const unsigned char*)lhs - *(const unsigned char*)rhs;
+
+            const word_t *lhs_word = (const word_t*)lhs, *rhs_word = (const word_t*)rhs;
+            while (*lhs_word == *rhs_word && !zero_byte_mask(*lhs_word)) {
+                lhs_word++;
+                rhs_word++;
+            }
+            lhs = (const char*)lhs_word;
+            rhs = (const char*)rhs_word;
+        }
+
         while (*lhs && (*lhs == *rhs)) {
             lhs++;
             rhs++;
@@ -79,4 +113,100 @@ namespace klib {
                 return (char*)(str - 1);
         return nullptr;
     }
+
+    u32 hash(const char *str) {
+        usize length = strlen(str);
+        u64 h = 0xcbf29ce484222325 ^ length;
+        for (; length >= 8; str += 8, length -= 8) {
+            u64 word;
+            memcpy(&word, str, 8);
+            h = (h ^ word) * 0x9e3779b97f4a7c15;
+            h ^= h >> 29;
+        }
+        u64 tail = 0;
+        memcpy(&tail, str, length);
+        return hash(h ^ tail);
+    }
+
+    using MemcpyFunction = void* (*)(void *dst, const void *src, usize size);
+    using MemsetFunction = void* (*)(void *dst, u8 value, usize size);
+
+    struct MemVariant {
+        const char *name;
+        MemcpyFunction copy;
+        MemsetFunction set;
+        bool available[3]; // for each size class
+    };
+
+    // the least cycles one call took in a few rounds, the rounds an interrupt landed in are thrown away that way
+    static u64 time_mem_variant(const MemVariant &variant, u8 *dst, u8 *src, usize size, usize iterations, bool copy) {
+        u64 best = (u64)-1;
+        for (usize round = 0; round < 4; round++) {
+            u64 start = __builtin_ia32_rdtsc();
+            for (usize i = 0; i < iterations; i++) {
+                if (copy)
+                    variant.copy(dst, src, size);
+                else
+                    variant.set(dst, (u8)i, size);
+            }
+            u64 cycles = (__builtin_ia32_rdtsc() - start) / iterations;
+            if (round > 0) // the first round warms up the caches
+                best = min(best, cycles);
+        }
+        return best;
+    }
+
+    void select_mem_variants() {
+        u32 eax, ebx, ecx, edx;
+        bool erms = false, fsrm = false;
+        if (cpu::cpuid(7, 0, &eax, &ebx, &ecx, &edx)) {
+            erms = ebx & (1 << 9);
+            fsrm = edx & (1 << 4);
+        }
+
+        // rep movsb only beats rep movsq with ERMS, and for short sizes with FSRM
+        // non temporal stores only pay off for sizes that would push everything else out of the cache
+        MemVariant variants[] = {
+            { "rep movsb", memcpy_movsb, memset_stosb, { fsrm, erms, erms } },
+            { "rep movsq", memcpy_movsq, memset_stosq, { true, true, true } },
+            { "non-temporal", memcpy_nontemporal, memset_nontemporal, { false, false, true } },
+        };
+        constexpr usize sizes[3] = { 64, 0x1000, 0x100000 };
+        constexpr usize iterations[3] = { 4096, 512, 8 };
+        constexpr const char *size_names[3] = { "64 B", "4 KiB", "1 MiB" };
+        static_assert(sizes[0] < mem_small_limit && sizes[1] >= mem_small_limit && sizes[1] < mem_large_limit && sizes[2] >= mem_large_limit);
+
+        u8 *src = (u8*)malloc(sizes[2]);
+        u8 *dst = (u8*)malloc(sizes[2]);
+        memset_stosb(src, 0xAA, sizes[2]);
+        memset_stosb(dst, 0, sizes[2]);
+
+        const char *copy_names[3], *set_names[3];
+        for (usize class_index = 0; class_index < 3; class_index++) {
+            u64 best_copy = (u64)-1, best_set = (u64)-1;
+            for (const MemVariant &variant : variants) {
+                if (!variant.available[class_index])
+                    continue;
+                u64 copy_cycles = time_mem_variant(variant, dst, src, sizes[class_index], iterations[class_index], true);
+                if (copy_cycles < best_copy) {
+                    best_copy = copy_cycles;
+                    memcpy_variants[class_index] = variant.copy;
+                    copy_names[class_index] = variant.name;
+                }
+                u64 set_cycles = time_mem_variant(variant, dst, src, sizes[class_index], iterations[class_index], false);
+                if (set_cycles < best_set) {
+                    best_set = set_cycles;
+                    memset_variants[class_index] = variant.set;
+                    set_names[class_index] = variant.name;
+                }
+            }
+        }
+
+        free(src);
+        free(dst);
+
+        klib::printf("Mem: ERMS %s, FSRM %s\n", erms ? "yes" : "no", fsrm ? "yes" : "no");
+        for (usize class_index = 0; class_index < 3; class_index++)
+            klib::printf("Mem: %s: memcpy uses %s, memset uses %s\n", size_names[class_index], copy_names[class_index], set_names[class_index]);
+    }
 }
@@ -7,6 +7,17 @@ extern "C" int memcmp(const void *lhs, const void *rhs, usize size);
 extern "C" void* memcpy(void *dst, const void *src, usize size);
 extern "C" void* memmove(void *dst, const void *src, usize size);
 extern "C" void* memset(void *dst, u8 value, usize size);
+extern "C" void memzero_nontemporal(void *dst, usize size);
+
+// the variants memcpy and memset dispatch to, by size class
+extern "C" void* memcpy_movsb(void *dst, const void *src, usize size);
+extern "C" void* memcpy_movsq(void *dst, const void *src, usize size);
+extern "C" void* memcpy_nontemporal(void *dst, const void *src, usize size);
+extern "C" void* memset_stosb(void *dst, u8 value, usize size);
+extern "C" void* memset_stosq(void *dst, u8 value, usize size);
+extern "C" void* memset_nontemporal(void *dst, u8 value, usize size);
+extern "C" void* (*memcpy_variants[3])(void *dst, const void *src, usize size);
+extern "C" void* (*memset_variants[3])(void *dst, u8 value, usize size);
 
 #define memcmp __builtin_memcmp
 #define memcpy __builtin_memcpy
@@ -14,6 +25,13 @@ extern "C" void* memset(void *dst, u8 value, usize size);
 #define memset __builtin_memset
 
 namespace klib {
+    // sizes below the small limit are small, from the large limit on large and medium in between, must match mem.asm
+    constexpr usize mem_small_limit = 512;
+    constexpr usize mem_large_limit = 0x40000;
+
+    // times the variants available on this cpu at 64 B, 4 KiB and 1 MiB and makes memcpy and memset use the fastest
+    void select_mem_variants();
+
     usize strlen(const char *str);
     usize strnlen(const char *str, usize maxlen);
     char* strcpy(char *dst, const char *src);
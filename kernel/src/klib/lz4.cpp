@@ -0,0 +1,165 @@
+#include <klib/lz4.hpp>
+#include <klib/cstring.hpp>
+
+namespace klib::lz4 {
+    constexpr usize min_match = 4;
+    constexpr usize last_literals = 5; // the last bytes are always literals
+    constexpr usize match_limit = 12; // no match can start this close to the end
+    constexpr usize hash_bits = 12;
+
+    static inline u32 read32(const u8 *ptr) {
+        u32 value;
+        memcpy(&value, ptr, sizeof(value));
+        return value;
+    }
+
+    static inline u32 hash(u32 sequence) {
+        return (sequence * 2654435761u) >> (32 - hash_bits);
+    }
+
+    // writes the rest of a length that did not fit in its 4 bits of the token
+    static inline u8* write_length(u8 *op, usize length) {
+        for (; length >= 255; length -= 255)
+            *op++ = 255;
+        *op++ = length;
+        return op;
+    }
+
+    usize compress(const void *src, usize src_size, void *dst, usize dst_size, u16 *hash_table) {
+        if (src_size > max_input_size)
+            return 0;
+
+        const u8 *base = (const u8*)src;
+        const u8 *ip = base, *anchor = base;
+        const u8 *end = base + src_size;
+        u8 *op = (u8*)dst, *op_end = op + dst_size;
+
+        if (src_size >= match_limit + 1) {
+            memset(hash_table, 0, sizeof(u16) << hash_bits);
+            const u8 *mflimit = end - match_limit;
+            const u8 *matchlimit = end - last_literals;
+
+            ip++;
+            while (ip < mflimit) {
+                u32 sequence = read32(ip);
+                u32 h = hash(sequence);
+                const u8 *ref = base + hash_table[h];
+                hash_table[h] = ip - base;
+                if (ref >= ip || read32(ref) != sequence) {
+                    ip++;
+                    continue;
+                }
+
+                while (ip > anchor && ref > base && ip[-1] == ref[-1]) {
+                    ip--;
+                    ref--;
+                }
+
+                // token, literal length, literals, offset and the worst case for the match length
+                usize num_literals = ip - anchor;
+                if (op + 1 + num_literals / 255 + 1 + num_literals + 2 + 1 + (src_size / 255) > op_end)
+                    return 0;
+
+                u8 *token = op++;
+                if (num_literals >= 15) {
+                    *token = 15 << 4;
+                    op = write_length(op, num_literals - 15);
+                } else {
+                    *token = num_literals << 4;
+                }
+                memcpy(op, anchor, num_literals);
+                op += num_literals;
+
+                usize offset = ip - ref;
+                *op++ = offset & 0xFF;
+                *op++ = offset >> 8;
+
+                const u8 *match_start = ip;
+                ip += min_match;
+                ref += min_match;
+                while (ip < matchlimit && *ip == *ref) {
+                    ip++;
+                    ref++;
+                }
+
+                usize match_length = ip - match_start - min_match;
+                if (match_length >= 15) {
+                    *token |= 15;
+                    op = write_length(op, match_length - 15);
+                } else {
+                    *token |= match_length;
+                }
+                anchor = ip;
+            }
+        }
+
+        usize num_literals = end - anchor;
+        if (op + 1 + num_literals / 255 + 1 + num_literals > op_end)
+            return 0;
+        if (num_literals >= 15) {
+            *op++ = 15 << 4;
+            op = write_length(op, num_literals - 15);
+        } else {
+            *op++ = num_literals << 4;
+        }
+        memcpy(op, anchor, num_literals);
+        op += num_literals;
+        return op - (u8*)dst;
+    }
+
+    isize decompress(const void *src, usize src_size, void *dst, usize dst_size) {
+        const u8 *ip = (const u8*)src, *ip_end = ip + src_size;
+        u8 *op = (u8*)dst, *op_end = op + dst_size;
+
+        while (ip < ip_end) {
+            u8 token = *ip++;
+
+            usize num_literals = token >> 4;
+            if (num_literals == 15) {
+                u8 byte;
+                do {
+                    if (ip >= ip_end)
+                        return -1;
+                    byte = *ip++;
+                    num_literals += byte;
+                } while (byte == 255);
+            }
+            if (num_literals > (usize)(ip_end - ip) || num_literals > (usize)(op_end - op))
+                return -1;
+            memcpy(op, ip, num_literals);
+            ip += num_literals;
+            op += num_literals;
+
+            if (ip == ip_end)
+                break; // the last sequence has no match
+
+            if (ip_end - ip < 2)
+                return -1;
+            usize offset = ip[0] | (ip[1] << 8);
+            ip += 2;
+            if (offset == 0 || offset > (usize)(op - (u8*)dst))
+                return -1;
+
+            usize match_length = token & 15;
+            if (match_length == 15) {
+                u8 byte;
+                do {
+                    if (ip >= ip_end)
+                        return -1;
+                    byte = *ip++;
+                    match_length += byte;
+                } while (byte == 255);
+            }
+            match_length += min_match;
+            if (match_length > (usize)(op_end - op))
+                return -1;
+
+            // the match can overlap what it is writing, which repeats the last offset bytes
+            const u8 *ref = op - offset;
+            for (usize i = 0; i < match_length; i++)
+                op[i] = ref[i];
+            op += match_length;
+        }
+        return op - (u8*)dst;
+    }
+}
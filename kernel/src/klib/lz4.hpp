@@ -0,0 +1,16 @@
+#pragma once
+
+#include <klib/common.hpp>
+
+// the lz4 block format, without the frame around it
+// sequences of a token, literals and a match with a 16 bit offset, see https://github.com/lz4/lz4/blob/dev/doc/lz4_Block_format.md
+namespace klib::lz4 {
+    constexpr usize max_input_size = 0x10000; // positions in the hash table are 16 bit
+
+    // returns the compressed size, or 0 if it would not fit in dst_size bytes
+    // hash_table must have room for 4096 entries and is overwritten
+    usize compress(const void *src, usize src_size, void *dst, usize dst_size, u16 *hash_table);
+
+    // returns the decompressed size, or -1 if the input is malformed or does not fit in dst_size bytes
+    isize decompress(const void *src, usize src_size, void *dst, usize dst_size);
+}
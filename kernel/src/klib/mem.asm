@@ -1,16 +1,104 @@
+section .data
+
+; what memcpy and memset jump to for small, medium and large sizes, picked at boot by klib::select_mem_variants
+; rep movsb and rep stosb work everywhere, so they are used until then
+global memcpy_variants
+memcpy_variants:
+    dq memcpy_movsb, memcpy_movsb, memcpy_movsb
+
+global memset_variants
+memset_variants:
+    dq memset_stosb, memset_stosb, memset_stosb
+
 section .text
 
-; implementations copied from limine source code
+; keep in sync with klib::mem_small_limit and klib::mem_large_limit
+%define SMALL_LIMIT 512
+%define LARGE_LIMIT 0x40000
 
 global memcpy
 memcpy:
+    cmp rdx, SMALL_LIMIT
+    jb .small
+    cmp rdx, LARGE_LIMIT
+    jae .large
+    jmp [rel memcpy_variants + 8]
+.small:
+    jmp [rel memcpy_variants]
+.large:
+    jmp [rel memcpy_variants + 16]
+
+global memset
+memset:
+    cmp rdx, SMALL_LIMIT
+    jb .small
+    cmp rdx, LARGE_LIMIT
+    jae .large
+    jmp [rel memset_variants + 8]
+.small:
+    jmp [rel memset_variants]
+.large:
+    jmp [rel memset_variants + 16]
+
+; fast with ERMS, and for short copies too with FSRM
+global memcpy_movsb
+memcpy_movsb:
     mov rcx, rdx
     mov rax, rdi
     rep movsb
     ret
 
-global memset
-memset:
+global memcpy_movsq
+memcpy_movsq:
+    mov rax, rdi
+    mov rcx, rdx
+    shr rcx, 3
+    rep movsq
+    mov ecx, edx
+    and ecx, 7
+    rep movsb
+    ret
+
+; stores bypass the cache, for copies too big to stay in it anyway
+; loads of a block all happen before its stores, so copying forwards over an overlap is still fine for memmove
+global memcpy_nontemporal
+memcpy_nontemporal:
+    mov rax, rdi
+    mov rcx, rdx
+    shr rcx, 6
+    jz .tail
+
+.loop:
+    mov r8, [rsi]
+    mov r9, [rsi + 8]
+    mov r10, [rsi + 16]
+    mov r11, [rsi + 24]
+    movnti [rdi], r8
+    movnti [rdi + 8], r9
+    movnti [rdi + 16], r10
+    movnti [rdi + 24], r11
+    mov r8, [rsi + 32]
+    mov r9, [rsi + 40]
+    mov r10, [rsi + 48]
+    mov r11, [rsi + 56]
+    movnti [rdi + 32], r8
+    movnti [rdi + 40], r9
+    movnti [rdi + 48], r10
+    movnti [rdi + 56], r11
+    add rsi, 64
+    add rdi, 64
+    dec rcx
+    jnz .loop
+    sfence
+
+.tail:
+    mov ecx, edx
+    and ecx, 63
+    rep movsb
+    ret
+
+global memset_stosb
+memset_stosb:
     push rdi
     mov rax, rsi
     mov rcx, rdx
@@ -18,27 +106,107 @@ memset:
     pop rax
     ret
 
-global memmove
-memmove:
+global memset_stosq
+memset_stosq:
+    mov r8, rdi
+    movzx eax, sil
+    mov r9, 0x0101010101010101
+    imul rax, r9 ; the byte in every byte of rax
     mov rcx, rdx
-    mov rax, rdi
+    shr rcx, 3
+    rep stosq
+    mov ecx, edx
+    and ecx, 7
+    rep stosb
+    mov rax, r8
+    ret
+
+global memset_nontemporal
+memset_nontemporal:
+    mov r8, rdi
+    movzx eax, sil
+    mov r9, 0x0101010101010101
+    imul rax, r9
+    mov rcx, rdx
+    shr rcx, 6
+    jz .tail
+
+.loop:
+    movnti [rdi], rax
+    movnti [rdi + 8], rax
+    movnti [rdi + 16], rax
+    movnti [rdi + 24], rax
+    movnti [rdi + 32], rax
+    movnti [rdi + 40], rax
+    movnti [rdi + 48], rax
+    movnti [rdi + 56], rax
+    add rdi, 64
+    dec rcx
+    jnz .loop
+    sfence
 
+.tail:
+    mov ecx, edx
+    and ecx, 63
+    rep stosb
+    mov rax, r8
+    ret
+
+global memmove
+memmove:
+    ; copying forwards is fine when the destination is below the source or they do not overlap
     cmp rdi, rsi
-    ja .copy_backwards
+    jbe memcpy
+    lea rcx, [rsi + rdx]
+    cmp rdi, rcx
+    jae memcpy
 
-    rep movsb
-    jmp .done
+    ; backwards 8 bytes at a time from the end, std would make rep movs take its slow path
+    mov rax, rdi
+    mov rcx, rdx
 
-.copy_backwards:
-    lea rdi, [rdi + rcx - 1]
-    lea rsi, [rsi + rcx - 1]
-    std
-    rep movsb
-    cld
+.backwards_bytes:
+    test rcx, 7
+    jz .backwards_words
+    dec rcx
+    mov r8b, [rsi + rcx]
+    mov [rdi + rcx], r8b
+    jmp .backwards_bytes
+
+.backwards_words:
+    test rcx, rcx
+    jz .done
+    sub rcx, 8
+    mov r8, [rsi + rcx]
+    mov [rdi + rcx], r8
+    jmp .backwards_words
 
 .done:
     ret
 
+; zeroes rsi bytes at rdi, a non zero multiple of 64, with stores that bypass the cache
+global memzero_nontemporal
+memzero_nontemporal:
+    xor eax, eax
+    shr rsi, 6
+
+.loop:
+    movnti [rdi], rax
+    movnti [rdi + 8], rax
+    movnti [rdi + 16], rax
+    movnti [rdi + 24], rax
+    movnti [rdi + 32], rax
+    movnti [rdi + 40], rax
+    movnti [rdi + 48], rax
+    movnti [rdi + 56], rax
+    add rdi, 64
+    dec rsi
+    jnz .loop
+
+    sfence
+    ret
+
+; copied from limine source code
 global memcmp
 memcmp:
     mov rcx, rdx
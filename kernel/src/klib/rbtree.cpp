@@ -0,0 +1,231 @@
+#include <klib/rbtree.hpp>
+
+namespace klib {
+    RBNode* RBNode::next() const {
+        const RBNode *node = this;
+        if (node->right) {
+            node = node->right;
+            while (node->left)
+                node = node->left;
+            return (RBNode*)node;
+        }
+        while (node->parent && node == node->parent->right)
+            node = node->parent;
+        return node->parent;
+    }
+
+    RBNode* RBNode::prev() const {
+        const RBNode *node = this;
+        if (node->left) {
+            node = node->left;
+            while (node->right)
+                node = node->right;
+            return (RBNode*)node;
+        }
+        while (node->parent && node == node->parent->left)
+            node = node->parent;
+        return node->parent;
+    }
+
+    RBNode* RBTree::first() const {
+        RBNode *node = root;
+        if (node)
+            while (node->left)
+                node = node->left;
+        return node;
+    }
+
+    RBNode* RBTree::last() const {
+        RBNode *node = root;
+        if (node)
+            while (node->right)
+                node = node->right;
+        return node;
+    }
+
+    void RBTree::replace_child(RBNode *parent, RBNode *old_child, RBNode *new_child) {
+        if (parent == nullptr)
+            root = new_child;
+        else if (parent->left == old_child)
+            parent->left = new_child;
+        else
+            parent->right = new_child;
+    }
+
+    void RBTree::rotate_left(RBNode *node) {
+        RBNode *pivot = node->right;
+        node->right = pivot->left;
+        if (pivot->left)
+            pivot->left->parent = node;
+        pivot->parent = node->parent;
+        replace_child(node->parent, node, pivot);
+        pivot->left = node;
+        node->parent = pivot;
+    }
+
+    void RBTree::rotate_right(RBNode *node) {
+        RBNode *pivot = node->left;
+        node->left = pivot->right;
+        if (pivot->right)
+            pivot->right->parent = node;
+        pivot->parent = node->parent;
+        replace_child(node->parent, node, pivot);
+        pivot->right = node;
+        node->parent = pivot;
+    }
+
+    void RBTree::insert(RBNode *node, RBNode *parent, RBNode **link) {
+        node->parent = parent;
+        node->left = nullptr;
+        node->right = nullptr;
+        node->red = true;
+        *link = node;
+        insert_fixup(node);
+    }
+
+    void RBTree::insert_fixup(RBNode *node) {
+        RBNode *parent;
+        while ((parent = node->parent) && parent->red) {
+            RBNode *grandparent = parent->parent; // the root is black so a red parent always has a parent
+            if (parent == grandparent->left) {
+                RBNode *uncle = grandparent->right;
+                if (uncle && uncle->red) {
+                    parent->red = false;
+                    uncle->red = false;
+                    grandparent->red = true;
+                    node = grandparent;
+                    continue;
+                }
+                if (node == parent->right) {
+                    rotate_left(parent);
+                    node = parent;
+                    parent = node->parent;
+                }
+                parent->red = false;
+                grandparent->red = true;
+                rotate_right(grandparent);
+            } else {
+                RBNode *uncle = grandparent->left;
+                if (uncle && uncle->red) {
+                    parent->red = false;
+                    uncle->red = false;
+                    grandparent->red = true;
+                    node = grandparent;
+                    continue;
+                }
+                if (node == parent->left) {
+                    rotate_right(parent);
+                    node = parent;
+                    parent = node->parent;
+                }
+                parent->red = false;
+                grandparent->red = true;
+                rotate_left(grandparent);
+            }
+        }
+        root->red = false;
+    }
+
+    void RBTree::remove(RBNode *node) {
+        RBNode *child, *parent;
+        bool removed_red;
+
+        if (node->left == nullptr || node->right == nullptr) {
+            child = node->left ? node->left : node->right;
+            parent = node->parent;
+            removed_red = node->red;
+            replace_child(node->parent, node, child);
+            if (child)
+                child->parent = node->parent;
+        } else {
+            // swap in the successor, which has no left child
+            RBNode *successor = node->right;
+            while (successor->left)
+                successor = successor->left;
+
+            removed_red = successor->red;
+            child = successor->right;
+            if (successor->parent == node) {
+                parent = successor;
+            } else {
+                parent = successor->parent;
+                parent->left = child;
+                if (child)
+                    child->parent = parent;
+                successor->right = node->right;
+                node->right->parent = successor;
+            }
+
+            replace_child(node->parent, node, successor);
+            successor->parent = node->parent;
+            successor->left = node->left;
+            node->left->parent = successor;
+            successor->red = node->red;
+        }
+
+        node->parent = node->left = node->right = nullptr;
+        if (!removed_red)
+            remove_fixup(child, parent);
+    }
+
+    // node carries an extra black, it may be nullptr so its parent is passed separately
+    void RBTree::remove_fixup(RBNode *node, RBNode *parent) {
+        while (node != root && (node == nullptr || !node->red)) {
+            if (node == parent->left) {
+                RBNode *sibling = parent->right;
+                if (sibling->red) {
+                    sibling->red = false;
+                    parent->red = true;
+                    rotate_left(parent);
+                    sibling = parent->right;
+                }
+                if ((!sibling->left || !sibling->left->red) && (!sibling->right || !sibling->right->red)) {
+                    sibling->red = true;
+                    node = parent;
+                    parent = node->parent;
+                } else {
+                    if (!sibling->right || !sibling->right->red) {
+                        sibling->left->red = false;
+                        sibling->red = true;
+                        rotate_right(sibling);
+                        sibling = parent->right;
+                    }
+                    sibling->red = parent->red;
+                    parent->red = false;
+                    if (sibling->right)
+                        sibling->right->red = false;
+                    rotate_left(parent);
+                    node = root;
+                }
+            } else {
+                RBNode *sibling = parent->left;
+                if (sibling->red) {
+                    sibling->red = false;
+                    parent->red = true;
+                    rotate_right(parent);
+                    sibling = parent->left;
+                }
+                if ((!sibling->left || !sibling->left->red) && (!sibling->right || !sibling->right->red)) {
+                    sibling->red = true;
+                    node = parent;
+                    parent = node->parent;
+                } else {
+                    if (!sibling->left || !sibling->left->red) {
+                        sibling->right->red = false;
+                        sibling->red = true;
+                        rotate_left(sibling);
+                        sibling = parent->left;
+                    }
+                    sibling->red = parent->red;
+                    parent->red = false;
+                    if (sibling->left)
+                        sibling->left->red = false;
+                    rotate_right(parent);
+                    node = root;
+                }
+            }
+        }
+        if (node)
+            node->red = false;
+    }
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <klib/common.hpp>
+
+// node: pointer to an RBNode, type: type of struct that the RBNode is in, member: the name of the RBNode in the struct
+#define RB_ENTRY(node, type, member) ((type*)((uptr)(node) - (uptr)(&((type*)0)->member)))
+
+namespace klib {
+    // intrusive red-black tree node, the owner does the searching and the tree only keeps itself balanced
+    struct RBNode {
+        RBNode *parent = nullptr;
+        RBNode *left = nullptr, *right = nullptr;
+        bool red = false;
+
+        RBNode* next() const;
+        RBNode* prev() const;
+    };
+
+    struct RBTree {
+        RBNode *root = nullptr;
+
+        // links node in as a child of parent at *link (which is &parent->left, &parent->right or &root) and rebalances
+        void insert(RBNode *node, RBNode *parent, RBNode **link);
+        void remove(RBNode *node);
+
+        RBNode* first() const;
+        RBNode* last() const;
+
+        inline bool is_empty() const { return root == nullptr; }
+
+    private:
+        void replace_child(RBNode *parent, RBNode *old_child, RBNode *new_child);
+        void rotate_left(RBNode *node);
+        void rotate_right(RBNode *node);
+        void insert_fixup(RBNode *node);
+        void remove_fixup(RBNode *node, RBNode *parent);
+    };
+}
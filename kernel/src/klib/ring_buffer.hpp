@@ -5,6 +5,7 @@
 
 #include <klib/algorithm.hpp>
 #include <klib/cstring.hpp>
+#include <mem/uaccess.hpp>
 
 namespace klib {
     template<typename T, usize s>
@@ -52,6 +53,38 @@ namespace klib {
             return count;
         }
 
+        // like read and write but with a user buffer, nothing is consumed or added if it faults
+        isize read_to_user(T *user_buffer, usize count) {
+            count = min(count, data_count());
+            if (count == 0) return 0;
+            usize first_pass_offset = read_index % size;
+            usize first_pass_count = min(count, size - first_pass_offset);
+
+            if (mem::copy_to_user(user_buffer, data + first_pass_offset, first_pass_count * sizeof(T)) < 0)
+                return -EFAULT;
+            if (first_pass_count < count)
+                if (mem::copy_to_user(user_buffer + first_pass_count, data, (count - first_pass_count) * sizeof(T)) < 0)
+                    return -EFAULT;
+
+            read_index += count;
+            return count;
+        }
+
+        isize write_from_user(const T *user_buffer, usize count) {
+            count = min(count, free_count());
+            usize first_pass_offset = write_index % size;
+            usize first_pass_count = min(count, size - first_pass_offset);
+
+            if (mem::copy_from_user(data + first_pass_offset, user_buffer, first_pass_count * sizeof(T)) < 0)
+                return -EFAULT;
+            if (first_pass_count < count)
+                if (mem::copy_from_user(data, user_buffer + first_pass_count, (count - first_pass_count) * sizeof(T)) < 0)
+                    return -EFAULT;
+
+            write_index += count;
+            return count;
+        }
+
         usize truncate(usize count) {
             count = min(count, data_count());
             read_index += count;
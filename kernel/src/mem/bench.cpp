@@ -0,0 +1,288 @@
+#include <mem/bench.hpp>
+#include <klib/cstdlib.hpp>
+#include <klib/cstdio.hpp>
+#include <klib/cstring.hpp>
+#include <mem/vmm.hpp>
+#include <userland/pipe.hpp>
+#include <sched/sched.hpp>
+#include <sched/timer/hpet.hpp>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <poll.h>
+
+namespace mem::bench {
+    using sched::timer::hpet::monotonic_time_ns;
+
+    // stops the compiler from optimizing away allocations whose result is unused
+    static inline void keep(void *ptr) {
+        asm volatile("" : : "r" (ptr) : "memory");
+    }
+
+    void run_all() {
+        if (!sched::timer::hpet::is_initialized()) {
+            klib::printf("Bench: No HPET, skipping memory benchmarks\n");
+            return;
+        }
+        klib::printf("Bench: Running memory benchmarks\n");
+        kmalloc();
+        fork_exec();
+        mappings();
+        pipe_round_trip();
+        mremap();
+    }
+
+    void kmalloc() {
+        constexpr usize sizes[] = { 32, 256, 2048 };
+        constexpr usize num_pairs = 100'000;
+        constexpr usize batch_size = 256;
+        constexpr usize num_batches = 400;
+
+        void **batch = (void**)klib::malloc(batch_size * sizeof(void*));
+
+        for (usize size : sizes) {
+            // warm up so that slabs and magazines exist before timing
+            for (usize i = 0; i < batch_size; i++)
+                batch[i] = klib::malloc(size);
+            for (usize i = 0; i < batch_size; i++)
+                klib::free(batch[i]);
+
+            // a single object allocated and freed right away, the common case for short lived objects
+            u64 start = monotonic_time_ns();
+            for (usize i = 0; i < num_pairs; i++) {
+                void *ptr = klib::malloc(size);
+                keep(ptr);
+                klib::free(ptr);
+            }
+            u64 pair_ns = (monotonic_time_ns() - start) / num_pairs;
+
+            // many objects alive at once, exercises magazine exchanges with the depot
+            start = monotonic_time_ns();
+            for (usize j = 0; j < num_batches; j++) {
+                for (usize i = 0; i < batch_size; i++)
+                    batch[i] = klib::malloc(size);
+                for (usize i = 0; i < batch_size; i++)
+                    klib::free(batch[i]);
+            }
+            u64 batch_ns = (monotonic_time_ns() - start) / (num_batches * batch_size);
+
+            klib::printf("Bench: kmalloc %4lu B | alloc+free: %lu ns/op, batched alloc+free: %lu ns/op\n", size, pair_ns, batch_ns);
+        }
+
+        klib::free(batch);
+    }
+
+    // forks a process with a populated address space and tears the child down again, which is what exec does to it
+    void fork_exec() {
+        constexpr usize sizes_mib[] = { 4, 64, 256 };
+        constexpr usize num_iterations = 10;
+        constexpr uptr base = 0x10000000;
+
+        for (usize size_mib : sizes_mib) {
+            usize size = size_mib * 1024 * 1024;
+            Pagemap *parent = new Pagemap();
+            memset(parent->pml4, 0, 0x1000);
+            parent->map_kernel();
+            parent->map_anonymous(base, size, PAGE_PRESENT | PAGE_USER | PAGE_WRITABLE | PAGE_NO_EXECUTE);
+            for (uptr virt = base; virt < base + size; virt += 0x1000)
+                parent->get_physical_addr(virt, true);
+
+            u64 fork_ns = 0, teardown_ns = 0;
+            for (usize i = 0; i < num_iterations; i++) {
+                u64 start = monotonic_time_ns();
+                Pagemap *child = parent->fork();
+                u64 forked = monotonic_time_ns();
+                delete child;
+                u64 end = monotonic_time_ns();
+
+                fork_ns += forked - start;
+                teardown_ns += end - forked;
+            }
+
+            klib::printf("Bench: fork+exec %3lu MiB | fork: %lu us, exec teardown: %lu us\n", size_mib,
+                fork_ns / num_iterations / 1000, teardown_ns / num_iterations / 1000);
+            delete parent;
+        }
+    }
+
+    // an address space with many small mappings, like a program that mmaps lots of separate buffers
+    void mappings() {
+        constexpr usize num_mappings = 10'000;
+        constexpr usize num_lookups = 100'000;
+        constexpr uptr base = 0x10000000;
+        constexpr u64 flags = PAGE_PRESENT | PAGE_USER | PAGE_WRITABLE | PAGE_NO_EXECUTE;
+
+        Pagemap *pagemap = new Pagemap();
+        memset(pagemap->pml4, 0, 0x1000);
+
+        // every other page is left unmapped so that the ranges dont merge
+        u64 start = monotonic_time_ns();
+        for (usize i = 0; i < num_mappings; i++)
+            pagemap->map_anonymous(base + i * 0x2000, 0x1000, flags);
+        u64 map_ns = (monotonic_time_ns() - start) / num_mappings;
+
+        u64 seed = 0x2545F4914F6CDD1D;
+        start = monotonic_time_ns();
+        for (usize i = 0; i < num_lookups; i++) {
+            seed ^= seed << 13; seed ^= seed >> 7; seed ^= seed << 17;
+            keep(pagemap->addr_to_range(base + (seed % num_mappings) * 0x2000));
+        }
+        u64 lookup_ns = (monotonic_time_ns() - start) / num_lookups;
+
+        start = monotonic_time_ns();
+        for (usize i = 0; i < num_mappings; i++)
+            pagemap->add_range(base + i * 0x2000, 0x1000, flags & ~(u64)PAGE_WRITABLE, MappedRange::Type::ANONYMOUS, 0, nullptr, 0, true, true, true);
+        u64 mprotect_ns = (monotonic_time_ns() - start) / num_mappings;
+
+        start = monotonic_time_ns();
+        for (usize i = 0; i < num_mappings; i++)
+            pagemap->add_range(base + i * 0x2000, 0x1000, 0, MappedRange::Type::NONE, 0, nullptr, 0, false, true, false);
+        u64 munmap_ns = (monotonic_time_ns() - start) / num_mappings;
+
+        klib::printf("Bench: %lu mappings | mmap: %lu ns/op, lookup: %lu ns/op, mprotect: %lu ns/op, munmap: %lu ns/op\n",
+            num_mappings, map_ns, lookup_ns, mprotect_ns, munmap_ns);
+        delete pagemap;
+    }
+
+    constexpr usize round_trip_pages = 64;
+    constexpr uptr round_trip_base = 0x10000000;
+
+    // state shared with the partner thread of pipe_round_trip
+    static userland::Pipe *ping_pipe, *pong_pipe;
+    static vfs::FileDescription *ping_read, *ping_write, *pong_read, *pong_write;
+    static Pagemap *partner_pagemap;
+
+    static void touch_working_set() {
+        for (usize i = 0; i < round_trip_pages; i++)
+            keep((void*)*(volatile u64*)(round_trip_base + i * 0x1000));
+    }
+
+    // kernel threads stay on whatever pagemap is active, so the two sides switch to their own one after every wakeup
+    // like the scheduler does for a process, before the byte is copied into their address space
+    static isize read_byte(Pagemap *pagemap, userland::Pipe *pipe, vfs::FileDescription *fd) {
+        while (!(pipe->poll(fd, POLLIN) & (POLLIN | POLLHUP)))
+            pipe->pipe_event.wait();
+        pagemap->activate();
+        return pipe->read(fd, (void*)round_trip_base, 1, 0);
+    }
+
+    [[noreturn]] static void pipe_partner() {
+        while (read_byte(partner_pagemap, ping_pipe, ping_read) == 1) {
+            touch_working_set();
+            pong_pipe->write(pong_write, (void*)round_trip_base, 1, 0);
+        }
+
+        // the benchmark closed its end, it reaps this thread once it sees the eof
+        vmm->kernel_pagemap.activate();
+        pong_write->decrement_ref_count();
+        while (true) {
+            sched::dequeue_thread(cpu::get_current_thread());
+            sched::yield();
+        }
+    }
+
+    static userland::Pipe* create_pipe(vfs::FileDescription **read_end, vfs::FileDescription **write_end) {
+        auto *pipe = new userland::Pipe();
+        *read_end = new vfs::FileDescription(pipe, O_RDONLY);
+        pipe->open(*read_end);
+        *write_end = new vfs::FileDescription(pipe, O_WRONLY);
+        pipe->open(*write_end);
+        return pipe;
+    }
+
+    // two address spaces passing a byte back and forth over a pair of pipes and touching their working set in between,
+    // like two processes ping ponging, with a kernel thread standing in for the second process
+    void pipe_round_trip() {
+        constexpr usize num_rounds = 20'000;
+
+        Pagemap *pagemaps[2];
+        for (auto &pagemap : pagemaps) {
+            pagemap = new Pagemap();
+            memset(pagemap->pml4, 0, 0x1000);
+            pagemap->map_kernel();
+            pagemap->map_anonymous(round_trip_base, round_trip_pages * 0x1000, PAGE_PRESENT | PAGE_USER | PAGE_WRITABLE | PAGE_NO_EXECUTE);
+            for (usize i = 0; i < round_trip_pages; i++)
+                pagemap->get_physical_addr(round_trip_base + i * 0x1000, true);
+        }
+        partner_pagemap = pagemaps[1];
+        ping_pipe = create_pipe(&ping_read, &ping_write);
+        pong_pipe = create_pipe(&pong_read, &pong_write);
+        sched::Thread *partner = sched::new_kernel_thread(pipe_partner, true, "Pipe bench partner");
+
+        Pagemap *old_pagemap = vmm->active_pagemap;
+        bool pcid_enabled = vmm->pcid_enabled;
+
+        for (int use_pcid = 0; use_pcid <= (pcid_enabled ? 1 : 0); use_pcid++) {
+            {
+                klib::InterruptLock interrupt_guard;
+                vmm->pcid_enabled = use_pcid;
+                vmm->reset_pcids();
+                pagemaps[0]->activate();
+            }
+
+            u64 start = monotonic_time_ns();
+            for (usize round = 0; round < num_rounds; round++) {
+                touch_working_set();
+                ping_pipe->write(ping_write, (void*)round_trip_base, 1, 0);
+                read_byte(pagemaps[0], pong_pipe, pong_read);
+            }
+            u64 round_trip_ns = (monotonic_time_ns() - start) / num_rounds;
+
+            klib::printf("Bench: pipe round trip, %lu page working set | pcid %s: %lu ns/round trip\n", round_trip_pages, use_pcid ? "on" : "off", round_trip_ns);
+        }
+
+        ping_write->decrement_ref_count();
+        read_byte(pagemaps[0], pong_pipe, pong_read); // the eof of the partner closing its end
+
+        {
+            klib::InterruptLock interrupt_guard;
+            vmm->pcid_enabled = pcid_enabled;
+            vmm->reset_pcids();
+            old_pagemap->activate();
+            sched::terminate_thread(partner);
+        }
+        delete partner;
+        ping_read->decrement_ref_count();
+        pong_read->decrement_ref_count();
+        delete ping_pipe;
+        delete pong_pipe;
+        for (auto *pagemap : pagemaps)
+            delete pagemap;
+    }
+
+    // a buffer that doubles from 1 MiB to 1 GiB, with another mapping right after it every time so that it has to move
+    void mremap() {
+        constexpr usize start_size = 1024 * 1024;
+        constexpr usize end_size = 1024 * 1024 * 1024;
+        constexpr u64 flags = PAGE_PRESENT | PAGE_USER | PAGE_WRITABLE | PAGE_NO_EXECUTE;
+
+        Pagemap *pagemap = new Pagemap();
+        memset(pagemap->pml4, 0, 0x1000);
+        pagemap->map_kernel();
+        pagemap->mmap_base = 0x10000000;
+
+        uptr buffer = pagemap->find_free_area(0, start_size);
+        pagemap->map_anonymous(buffer, start_size, flags);
+
+        u64 total_ns = 0;
+        for (usize size = start_size; size < end_size; size *= 2) {
+            // reads map the zero page, which keeps a gigabyte of ptes from needing a gigabyte of memory
+            for (uptr virt = buffer; virt < buffer + size; virt += 0x1000)
+                pagemap->get_physical_addr(virt);
+            uptr blocker = buffer + size;
+            pagemap->map_anonymous(blocker, 0x1000, flags & ~(u64)PAGE_WRITABLE);
+
+            u64 start = monotonic_time_ns();
+            isize new_buffer = pagemap->remap(buffer, size, size * 2, MREMAP_MAYMOVE, 0);
+            u64 remap_ns = monotonic_time_ns() - start;
+            total_ns += remap_ns;
+            ASSERT(new_buffer > 0);
+
+            pagemap->add_range(blocker, 0x1000, 0, MappedRange::Type::NONE, 0, nullptr, 0, false, true, false);
+            buffer = new_buffer;
+            klib::printf("Bench: mremap %5lu MiB -> %5lu MiB | %lu us\n", size / (1024 * 1024), size * 2 / (1024 * 1024), remap_ns / 1000);
+        }
+
+        klib::printf("Bench: mremap 1 MiB -> 1 GiB total | %lu us\n", total_ns / 1000);
+        delete pagemap;
+    }
+}
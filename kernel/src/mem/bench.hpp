@@ -0,0 +1,14 @@
+#pragma once
+
+#include <klib/common.hpp>
+
+// memory management microbenchmarks, run at boot when "membench" is on the kernel command line
+namespace mem::bench {
+    void run_all();
+
+    void kmalloc();
+    void fork_exec();
+    void mappings();
+    void pipe_round_trip();
+    void mremap();
+}
@@ -1,132 +1,570 @@
 #include <mem/pmm.hpp>
+#include <mem/reclaim.hpp>
 #include <klib/lock.hpp>
 #include <klib/cstdio.hpp>
 #include <klib/cstring.hpp>
 #include <klib/algorithm.hpp>
+#include <cpu/cpu.hpp>
 #include <panic.hpp>
 #include <limine.hpp>
 
 namespace pmm {
     Stats stats;
+    usize min_free_pages = 0;
+    usize max_zeroed_pages = 0;
 
     static klib::Spinlock pmm_lock;
-    static klib::ListHead page_freelist;
+    static klib::ListHead freelists[max_order + 1];
+    static klib::ListHead zeroed_list;
     static klib::ListHead region_list;
+    static CpuPageCache *cpu_page_caches;
+
+    static void freelist_insert(Page *page, usize order) {
+        page->free = true;
+        page->order = order;
+        freelists[order].add_before(&page->link);
+        stats.free_blocks[order]++;
+    }
+
+    static void freelist_remove(Page *page) {
+        page->free = false;
+        page->link.remove();
+        stats.free_blocks[page->order]--;
+    }
+
+    static inline void clear_flags(Page *page) {
+        if (page->flags & page_flag_file)
+            __atomic_sub_fetch(&stats.file_pages, 1, __ATOMIC_RELAXED);
+        page->flags = 0;
+    }
+
+    struct PfnRange {
+        usize start, end;
+    };
+
+    constexpr usize max_deferred_ranges = 64;
+    static PfnRange deferred_ranges[max_deferred_ranges]; // copied out of the memmap, which is in bootloader memory
+    static usize num_deferred_ranges = 0;
+
+    static Region **section_map; // the lowest region overlapping each section, the ones above it follow in region_list
+    static usize num_sections = 0;
+
+    static Region* region_for_pfn(usize pfn) {
+        usize section = pfn >> section_shift;
+        if (section >= num_sections) [[unlikely]]
+            return nullptr;
+
+        // only regions that overlap the section are walked, usually just the first one
+        for (Region *region = section_map[section]; region; region = LIST_NEXT(region, link)) {
+            if (pfn < region->base_phy() / 0x1000)
+                return nullptr;
+            if (pfn < region->end_pfn())
+                return region;
+            if (region->link.next == &region_list)
+                return nullptr;
+        }
+        return nullptr;
+    }
+
+    static inline Region* region_of(Page *page) {
+        return region_for_pfn(page->pfn);
+    }
+
+    static inline usize usable_pages_for(usize num_pages) {
+        usize num_pages_reserved = Region::reserved_pages_for(num_pages);
+        return num_pages > num_pages_reserved ? num_pages - num_pages_reserved : 0;
+    }
+
+    static PfnRange range_of_entry(const limine_memmap_entry *entry) {
+        return { klib::align_up(entry->base, 0x1000) / 0x1000, klib::align_down(entry->base + entry->length, 0x1000) / 0x1000 };
+    }
+
+    // chunks end on a max order boundary so that they do not cut blocks short
+    static usize deferred_chunk_end(usize start, usize end) {
+        usize chunk_end = klib::align_down(start + deferred_chunk_pages, 1ul << max_order);
+        return chunk_end > start && chunk_end < end ? chunk_end : end;
+    }
+
+    // writes the header and page structs of a region, nothing else may touch the range while this runs
+    static Region* create_region(PfnRange range) {
+        usize num_pages = range.end - range.start;
+        if (usable_pages_for(num_pages) == 0)
+            return nullptr;
+
+        Region *region = (Region*)(range.start * 0x1000 + mem::hhdm);
+        region->link = {};
+        region->num_pages = num_pages;
+        region->padding = 0;
+
+        Page *pages = region->pages_array();
+        usize first_pfn = region->first_pfn();
+        for (usize i = 0; i < region->num_pages_usable(); i++) {
+            Page *page = &pages[i];
+            page->link = {};
+            page->pfn = first_pfn + i;
+            page->order = 0;
+            page->free = false;
+            page->ref_count = 0;
+            page->flags = 0;
+        }
+        return region;
+    }
+
+    // makes the pages of a created region allocatable, with pmm_lock held
+    static void add_region_locked(Region *region) {
+        // region_list is kept sorted by address for region_for_pfn
+        klib::ListHead *next = region_list.next;
+        while (next != &region_list && (LIST_ENTRY(next, Region, link))->base_phy() < region->base_phy())
+            next = next->next;
+        next->add_before(&region->link);
+
+        usize first_section = region->base_phy() / 0x1000 >> section_shift;
+        usize last_section = (region->end_pfn() - 1) >> section_shift;
+        ASSERT(last_section < num_sections);
+        for (usize section = first_section; section <= last_section; section++)
+            if (section_map[section] == nullptr || section_map[section]->base_phy() > region->base_phy())
+                section_map[section] = region;
+
+        stats.total_pages_reserved += region->num_pages_reserved();
+
+        // carve the region into the biggest naturally aligned blocks that fit
+        usize pfn = region->first_pfn();
+        while (pfn < region->end_pfn()) {
+            usize order = klib::min(max_order, (usize)__builtin_ctzl(pfn | (1ul << max_order)));
+            while (pfn + (1ul << order) > region->end_pfn())
+                order--;
+
+            freelist_insert(region->page_for_pfn(pfn), order);
+            stats.total_free_pages += 1ul << order;
+            pfn += 1ul << order;
+        }
+    }
 
     void init(uptr hhdm, limine_memmap_response *memmap_res) {
+        mem::hhdm = hhdm; // Region::base_phy needs it before the vmm sets it
         region_list.init();
-        page_freelist.init();
+        zeroed_list.init();
+        for (usize order = 0; order <= max_order; order++)
+            freelists[order].init();
+
+        // the map also covers bootloader memory so that it can be reclaimed later
+        usize end_pfn = 0;
+        for (usize e = 0; e < memmap_res->entry_count; e++) {
+            auto *entry = memmap_res->entries[e];
+            if (entry->type == LIMINE_MEMMAP_USABLE || entry->type == LIMINE_MEMMAP_BOOTLOADER_RECLAIMABLE)
+                end_pfn = klib::max(end_pfn, range_of_entry(entry).end);
+        }
+        num_sections = (end_pfn >> section_shift) + 1;
+        usize section_map_pages = klib::align_up(num_sections * sizeof(Region*), 0x1000) / 0x1000;
+
+        // the map goes at the start of the first usable entry with room for it, before any region needs it
+        usize section_map_pfn = 0;
+        for (usize e = 0; e < memmap_res->entry_count && section_map == nullptr; e++) {
+            auto *entry = memmap_res->entries[e];
+            PfnRange range = range_of_entry(entry);
+            if (entry->type == LIMINE_MEMMAP_USABLE && range.end - range.start > section_map_pages) {
+                section_map_pfn = range.start;
+                section_map = (Region**)(range.start * 0x1000 + hhdm);
+                memset(section_map, 0, section_map_pages * 0x1000);
+                stats.total_pages_reserved += section_map_pages;
+            }
+        }
+        if (section_map == nullptr)
+            panic("No room for the PMM section map");
+
+        // only the first boot_init_pages are initialised now, the rest is left for init_deferred_pages or an allocation that runs out
+        usize num_boot_pages = 0;
         for (usize e = 0; e < memmap_res->entry_count; e++) {
             auto *entry = memmap_res->entries[e];
-            if (entry->type == LIMINE_MEMMAP_USABLE)
-                absorb_memmap_entry(hhdm, entry);
+            if (entry->type != LIMINE_MEMMAP_USABLE)
+                continue;
+
+            PfnRange range = range_of_entry(entry);
+            if (range.start == section_map_pfn)
+                range.start += section_map_pages;
+            if (range.start >= range.end)
+                continue;
+
+            if (num_boot_pages < boot_init_pages) {
+                usize split = range.end;
+                if (range.end - range.start > boot_init_pages - num_boot_pages)
+                    split = klib::min(range.end, klib::align_up(range.start + boot_init_pages - num_boot_pages, 1ul << max_order));
+                if (Region *region = create_region({ range.start, split }))
+                    add_region_locked(region);
+                num_boot_pages += split - range.start;
+                range.start = split;
+                if (range.start == range.end)
+                    continue;
+            }
+
+            if (num_deferred_ranges == max_deferred_ranges) {
+                if (Region *region = create_region(range))
+                    add_region_locked(region);
+                continue;
+            }
+            deferred_ranges[num_deferred_ranges++] = range;
+            for (usize start = range.start; start < range.end;) {
+                usize chunk_end = deferred_chunk_end(start, range.end);
+                stats.deferred_pages += usable_pages_for(chunk_end - start);
+                start = chunk_end;
+            }
         }
 
-        stats.total_pages_usable = stats.total_free_pages;
+        stats.total_pages_usable = stats.total_free_pages + stats.deferred_pages;
+        max_zeroed_pages = klib::clamp(stats.total_pages_usable / 64, (usize)64, (usize)4096);
 
         klib::printf("PMM: %ld page structs created, representing %ld KiB (%ld MiB) of usable memory\n", stats.total_free_pages, stats.total_free_pages * 0x1000 / 1024, stats.total_free_pages * 0x1000 / 1024 / 1024);
+        klib::printf("PMM: %ld pages (%ld MiB) deferred until after boot\n", stats.deferred_pages, stats.deferred_pages * 0x1000 / 1024 / 1024);
         klib::printf("PMM: %ld pages (%ld KiB) reserved for storing page structs\n", stats.total_pages_reserved, stats.total_pages_reserved * 0x1000 / 1024);
     }
 
-    void absorb_memmap_entry(uptr hhdm, limine_memmap_entry *entry) {            
-        usize pfn_start = entry->base / 0x1000;
-        usize pfn_end = entry->base / 0x1000 + entry->length / 0x1000;
-        if (entry->base % 0x1000)
-            pfn_start++;
-        if (entry->length % 0x1000)
-            pfn_end--;
-        usize num_pages = pfn_end - pfn_start;
+    // with pmm_lock held, the chunk stays counted in deferred_pages until it is added
+    static bool take_deferred_chunk_locked(PfnRange &chunk) {
+        if (num_deferred_ranges == 0)
+            return false;
+        PfnRange &range = deferred_ranges[num_deferred_ranges - 1];
+        chunk = { range.start, deferred_chunk_end(range.start, range.end) };
+        range.start = chunk.end;
+        if (range.start == range.end)
+            num_deferred_ranges--;
+        return true;
+    }
 
-        uptr ptr = pfn_start * 0x1000 + hhdm;
-        Region *region = (Region*)ptr;
-        ptr += sizeof(Region);
-        region->num_pages = num_pages;
-        region_list.add_before(&region->link);
+    static void add_deferred_chunk_locked(PfnRange chunk, Region *region) {
+        stats.deferred_pages -= usable_pages_for(chunk.end - chunk.start);
+        if (region)
+            add_region_locked(region);
+    }
 
-        usize num_pages_reserved = region->num_pages_reserved();
-        usize num_page_structs = region->num_pages_usable();
-        stats.total_pages_reserved += num_pages_reserved;
+    // for an allocation that would fail otherwise, with pmm_lock held
+    static bool absorb_deferred_locked() {
+        PfnRange chunk;
+        if (!take_deferred_chunk_locked(chunk))
+            return false;
+        add_deferred_chunk_locked(chunk, create_region(chunk));
+        return true;
+    }
 
-        for (usize i = 0; i < num_page_structs; i++) {
-            ASSERT(ptr % 32 == 0);
-            Page *page = (Page*)ptr;
-            ptr += sizeof(Page);
+    // the page structs are written with interrupts enabled, the chunk is out of the deferred ranges so nobody else touches it
+    bool init_deferred_pages() {
+        PfnRange chunk;
+        {
+            klib::SpinlockGuard guard(pmm_lock);
+            if (!take_deferred_chunk_locked(chunk))
+                return false;
+        }
 
-            usize pfn = pfn_start + num_pages_reserved + i;
-            page->pfn = pfn;
-            page->free = true;
-            page_freelist.add_before(&page->link);
+        Region *region = create_region(chunk);
 
-            stats.total_free_pages++;
-        }
+        klib::SpinlockGuard guard(pmm_lock);
+        add_deferred_chunk_locked(chunk, region);
+        return true;
     }
 
-    // broken
-    void reclaim_bootloader_mem(uptr hhdm, limine_memmap_response *memmap_res) {
-        usize previous_free_pages = stats.total_free_pages;
+    void reclaim_bootloader_mem(limine_memmap_response *memmap_res) {
+        // the memmap is itself in bootloader memory, so the ranges are copied out before any of it is overwritten
         Page *page = alloc_page();
-        pmm_lock.lock();
-
-        auto *entry = (limine_memmap_entry*)(page->pfn * 0x1000);
-        usize num_entries = 0;
+        PfnRange *ranges = page->as<PfnRange>();
+        usize num_ranges = 0;
         for (usize e = 0; e < memmap_res->entry_count; e++) {
             if (memmap_res->entries[e]->type != LIMINE_MEMMAP_BOOTLOADER_RECLAIMABLE)
                 continue;
-            
-            memcpy(&entry[num_entries], memmap_res->entries[e], sizeof(limine_memmap_entry));
-            num_entries++;
-            if (num_entries >= 0x1000 / sizeof(limine_memmap_entry))
+            if (num_ranges == 0x1000 / sizeof(PfnRange))
                 break;
+            ranges[num_ranges++] = range_of_entry(memmap_res->entries[e]);
         }
 
-        for (usize i = 0; i < num_entries; i++)
-            absorb_memmap_entry(hhdm, &entry[i]);
+        usize num_reclaimed_pages = 0;
+        for (usize i = 0; i < num_ranges; i++) {
+            Region *region = create_region(ranges[i]);
+            if (region == nullptr)
+                continue;
 
-        pmm_lock.unlock();
+            klib::SpinlockGuard guard(pmm_lock);
+            add_region_locked(region);
+            stats.total_pages_usable += region->num_pages_usable();
+            num_reclaimed_pages += region->num_pages_usable();
+        }
         free_page(page);
 
-        usize num_reclaimed_pages = stats.total_free_pages - previous_free_pages;
         klib::printf("PMM: Reclaimed %ld pages (%ld KiB) of bootloader memory\n", num_reclaimed_pages, num_reclaimed_pages * 0x1000 / 1024);
     }
 
     Page* find_page(uptr phy) {
-        const Region *region;
-        LIST_FOR_EACH(region, &region_list, link) {
-            if (phy < region->base_phy() || phy > region->end_phy())
-                continue;
+        usize pfn = phy / 0x1000;
+        Region *region = region_for_pfn(pfn);
+        if (region == nullptr || pfn < region->first_pfn())
+            return nullptr;
+        return region->page_for_pfn(pfn);
+    }
+
+    // splits the smallest block bigger than a page until there is one in the order 0 freelist
+    static bool split_for_order_0() {
+        usize block_order = 1;
+        while (freelists[block_order].is_empty()) {
+            block_order++;
+            if (block_order > max_order) [[unlikely]] {
+                if (!absorb_deferred_locked())
+                    return false;
+                if (!freelists[0].is_empty())
+                    return true;
+                block_order = 1;
+            }
+        }
+
+        Page *page = LIST_HEAD(&freelists[block_order], Page, link);
+        freelist_remove(page);
+        while (block_order > 0) {
+            block_order--;
+            freelist_insert(page + (1ul << block_order), block_order);
+        }
+        freelist_insert(page, 0);
+        return true;
+    }
 
-            usize offset_pages = (phy - region->base_phy()) / 0x1000;
-            if (offset_pages < region->num_pages_reserved())
+    static Page* try_alloc_block(usize order) {
+        ASSERT(order <= max_order);
+        klib::SpinlockGuard guard(pmm_lock);
+
+        usize block_order = order;
+        while (freelists[block_order].is_empty()) {
+            block_order++;
+            if (block_order > max_order) [[unlikely]] {
+                if (!absorb_deferred_locked())
+                    return nullptr;
+                block_order = order;
+            }
+        }
+
+        Page *page = LIST_HEAD(&freelists[block_order], Page, link);
+        freelist_remove(page);
+
+        // split the block, giving the upper halves back until it is the requested size
+        while (block_order > order) {
+            block_order--;
+            freelist_insert(page + (1ul << block_order), block_order);
+        }
+
+        page->order = order;
+        page->ref_count = 1;
+        stats.total_free_pages -= 1ul << order;
+        return page;
+    }
+
+    // the slow path of the allocators once nothing was free, returns whether it is worth trying again
+    // without reclaim only kswapd can help, so the caller gets nullptr or panics
+    static bool reclaim_for_allocation(usize num_pages, usize attempt) {
+        mem::reclaim::wake_kswapd();
+        if (attempt == max_reclaim_retries)
+            return false;
+        return mem::reclaim::reclaim_for_allocation(num_pages);
+    }
+
+    Page* alloc_block(usize order) {
+        for (usize attempt = 0; ; attempt++) {
+            if (Page *page = try_alloc_block(order))
+                return page;
+            // a fragmented buddy allocator is not helped by reclaim, callers like the huge page faults fall back to small pages
+            if (num_free_pages() >= min_free_pages + (1ul << order))
                 return nullptr;
+            if (!reclaim_for_allocation(1ul << order, attempt))
+                return nullptr;
+        }
+    }
+
+    static void free_block_locked(Page *page) {
+        ASSERT(!page->free);
+        Region *region = region_of(page);
+        ASSERT(region);
 
-            Page *page = &region->pages_array()[offset_pages - region->num_pages_reserved()];
-            ASSERT(page->phy() == phy);
-            return page;
+        usize order = page->order;
+        usize pfn = page->pfn;
+        page->ref_count = 0;
+        clear_flags(page);
+        stats.total_free_pages += 1ul << order;
+
+        // merge with the buddy for as long as it is a free block of the same order
+        while (order < max_order) {
+            usize buddy_pfn = pfn ^ (1ul << order);
+            if (buddy_pfn < region->first_pfn() || buddy_pfn + (1ul << order) > region->end_pfn())
+                break;
+
+            Page *buddy = region->page_for_pfn(buddy_pfn);
+            if (!buddy->free || buddy->order != order)
+                break;
+
+            freelist_remove(buddy);
+            buddy->order = 0;
+            pfn &= ~(1ul << order);
+            order++;
         }
-        return nullptr;
+
+        freelist_insert(region->page_for_pfn(pfn), order);
     }
 
-    Page* alloc_page() {
+    void free_block(Page *page) {
         klib::SpinlockGuard guard(pmm_lock);
+        free_block_locked(page);
+    }
 
-        if (page_freelist.is_empty()) [[unlikely]]
-            panic("Out of physical memory");
+    void split_block(Page *page) {
+        ASSERT(!page->free);
+        usize num_pages = 1ul << page->order;
+        u32 ref_count = page->ref_count;
+        for (usize i = 0; i < num_pages; i++) {
+            page[i].order = 0;
+            page[i].ref_count = ref_count;
+        }
+    }
 
-        Page *page = LIST_ENTRY(page_freelist.next, Page, link);
-        // ASSERT(page->free);
-        page->free = false;
-        page_freelist.next->remove();
-        stats.total_free_pages--;
+    CpuPageCache* create_cpu_page_cache() {
+        CpuPageCache *cache = new CpuPageCache();
+        cache->pages.init();
+
+        // appended so that the list is in cpu order
+        klib::SpinlockGuard guard(pmm_lock);
+        CpuPageCache **tail = &cpu_page_caches;
+        while (*tail)
+            tail = &(*tail)->next;
+        *tail = cache;
+        return cache;
+    }
+
+    CpuPageCache* cpu_page_cache_list() {
+        return cpu_page_caches;
+    }
+
+    usize num_free_pages() {
+        usize num_pages = stats.total_free_pages + stats.zeroed_pages + stats.deferred_pages;
+        for (CpuPageCache *cache = cpu_page_caches; cache; cache = cache->next)
+            num_pages += cache->num_pages;
+        return num_pages;
+    }
+
+    // pages in a cpu cache are allocated as far as the buddy allocator is concerned
+    static void refill_cpu_cache(CpuPageCache *cache) {
+        klib::SpinlockGuard guard(pmm_lock);
+        for (usize i = 0; i < page_cache_batch; i++) {
+            Page *page;
+            if (!freelists[0].is_empty() || split_for_order_0()) {
+                page = LIST_HEAD(&freelists[0], Page, link);
+                freelist_remove(page);
+                stats.total_free_pages--;
+            } else if (!zeroed_list.is_empty()) { // the last free pages may be sitting in the pool
+                page = LIST_HEAD(&zeroed_list, Page, link);
+                page->link.remove();
+                stats.zeroed_pages--;
+            } else {
+                break;
+            }
+            cache->pages.add_before(&page->link);
+            cache->num_pages++;
+        }
+    }
+
+    static void drain_cpu_cache(CpuPageCache *cache) {
+        klib::SpinlockGuard guard(pmm_lock);
+        for (usize i = 0; i < page_cache_batch && !cache->pages.is_empty(); i++) {
+            Page *page = LIST_HEAD(&cache->pages, Page, link); // oldest pages go first, recently freed ones are likely still in the cpu cache
+            page->link.remove();
+            cache->num_pages--;
+            free_block_locked(page);
+        }
+    }
+
+    Page* try_alloc_page() {
+        klib::InterruptLock interrupt_guard;
+        CpuPageCache *cache = cpu::get_current_cpu()->page_cache;
+        if (cache == nullptr) [[unlikely]]
+            return try_alloc_block(0);
+
+        if (cache->num_pages <= page_cache_low) {
+            cache->alloc_misses++;
+            refill_cpu_cache(cache);
+            if (stats.total_free_pages < low_watermark())
+                mem::reclaim::wake_kswapd();
+            if (cache->pages.is_empty()) [[unlikely]]
+                return nullptr;
+        } else {
+            cache->alloc_hits++;
+        }
+
+        Page *page = LIST_TAIL(&cache->pages, Page, link);
+        page->link.remove();
+        page->ref_count = 1;
+        cache->num_pages--;
         return page;
     }
 
-    void free_page(Page *page) {
+    Page* alloc_page() {
+        for (usize attempt = 0; ; attempt++) {
+            if (Page *page = try_alloc_page())
+                return page;
+            if (!reclaim_for_allocation(1, attempt))
+                panic("Out of physical memory");
+        }
+    }
+
+    Page* alloc_zeroed_page() {
+        {
+            klib::SpinlockGuard guard(pmm_lock);
+            if (!zeroed_list.is_empty()) {
+                Page *page = LIST_HEAD(&zeroed_list, Page, link);
+                page->link.remove();
+                page->ref_count = 1;
+                stats.zeroed_pages--;
+                stats.zeroed_hits++;
+                return page;
+            }
+            stats.zeroed_misses++;
+        }
+
+        Page *page = alloc_page();
+        memset(page->as<void>(), 0, 0x1000);
+        return page;
+    }
+
+    // the page is zeroed with interrupts enabled so that the idle thread can be preempted halfway
+    // non temporal stores keep the zeroes from pushing data that is in use out of the cache
+    bool fill_zeroed_pool() {
+        Page *page;
+        {
+            klib::SpinlockGuard guard(pmm_lock);
+            if (stats.zeroed_pages >= max_zeroed_pages || stats.total_free_pages <= high_watermark())
+                return false;
+            if (freelists[0].is_empty() && !split_for_order_0())
+                return false;
+            page = LIST_HEAD(&freelists[0], Page, link);
+            freelist_remove(page);
+            stats.total_free_pages--;
+            stats.zeroed_pages++; // still counted as free while it is being zeroed
+        }
+
+        memzero_nontemporal(page->as<void>(), 0x1000);
+
         klib::SpinlockGuard guard(pmm_lock);
+        zeroed_list.add_before(&page->link);
+        stats.pages_zeroed++;
+        return true;
+    }
 
-        // ASSERT(!page->free);
-        page->free = true;
-        page->mapped_addr = 0;
-        page_freelist.add_before(&page->link);
-        stats.total_free_pages++;
+    void free_page(Page *page) {
+        ASSERT(page->order == 0);
+        page->ref_count = 0;
+        clear_flags(page);
+
+        klib::InterruptLock interrupt_guard;
+        CpuPageCache *cache = cpu::get_current_cpu()->page_cache;
+        if (cache == nullptr) [[unlikely]]
+            return free_block(page);
+
+        cache->pages.add_before(&page->link);
+        cache->num_pages++;
+        if (cache->num_pages > page_cache_high) {
+            cache->free_drains++;
+            drain_cpu_cache(cache);
+        } else {
+            cache->free_hits++;
+        }
     }
 }
@@ -7,12 +7,23 @@
 
 namespace mem { extern uptr hhdm; }
 
+// binary buddy allocator, blocks of 2^order pages are naturally aligned and never cross a region
+// single pages go through a per cpu cache that is refilled from and drained to the buddy allocator in batches
 namespace pmm {
+    constexpr usize max_order = 10; // 4 MiB blocks
+    constexpr usize page_cache_batch = 32; // pages moved between a cpu cache and the buddy allocator at once
+    constexpr usize page_cache_low = 0; // a cpu cache is refilled when it drops to this many pages
+    constexpr usize max_reclaim_retries = 8; // rounds of reclaim an allocation waits for, the oom victim needs some to exit
+    constexpr usize page_cache_high = 128; // a cpu cache is drained when it grows past this many pages
+    constexpr u32 page_flag_file = 1 << 0; // holds data read from a file that can be read again, counted in stats.file_pages
+
     struct Page {
         klib::ListHead link;
-        bool free : 1; // true if its in the freelist
-        u64 pfn : 63; // page frame number (the physical address of the page >> 12)
-        uptr mapped_addr; // virtual address that it is mapped to if this is anonymous memory
+        u64 pfn : 52; // page frame number (the physical address of the page >> 12)
+        u64 order : 6; // order of the block if this is the first page of one
+        u64 free : 1; // true if this is the first page of a block in a freelist
+        u32 ref_count; // 1 when allocated, incremented for every extra pte or user sharing the page
+        u32 flags; // page_flag_*, cleared when the page is freed
 
         inline uptr phy() const { return pfn * 0x1000; }
 
@@ -28,32 +39,119 @@ namespace pmm {
 
         inline usize base_phy() const { return (uptr)this - mem::hhdm; }
         inline usize end_phy() const { return base_phy() + num_pages * 0x1000; }
-        inline usize num_pages_reserved() const { return (sizeof(Region) + num_pages * sizeof(Page) + 0x1000 - 1) / 0x1000; }
+        inline usize num_pages_reserved() const { return reserved_pages_for(num_pages); }
         inline usize num_pages_usable() const { return num_pages - num_pages_reserved(); }
         inline Page* pages_array() const { return (Page*)((uptr)this + sizeof(Region)); }
+        inline usize first_pfn() const { return base_phy() / 0x1000 + num_pages_reserved(); }
+        inline usize end_pfn() const { return base_phy() / 0x1000 + num_pages; }
+        inline Page* page_for_pfn(usize pfn) const { return &pages_array()[pfn - first_pfn()]; }
+        inline bool contains(const Page *page) const { return page >= pages_array() && page < pages_array() + num_pages_usable(); }
+
+        // pages at the start of a region of num_pages pages that hold the region and its page structs
+        static inline usize reserved_pages_for(usize num_pages) { return (sizeof(Region) + num_pages * sizeof(Page) + 0x1000 - 1) / 0x1000; }
     };
     static_assert(sizeof(Region) == 32);
 
+    constexpr usize section_shift = 9; // the pfn to region map has an entry for every 2 MiB of physical memory
+    constexpr usize boot_init_pages = 1 << 16; // memory whose page structs are initialised during init, the rest is absorbed later
+    constexpr usize deferred_chunk_pages = 1 << 14; // memory absorbed at a time after boot, each chunk becomes its own region
+
     void init(uptr hhdm, limine_memmap_response *memmap_res);
-    void absorb_memmap_entry(uptr hhdm, limine_memmap_entry *entry);
-    void reclaim_bootloader_mem(uptr hhdm, limine_memmap_response *memmap_res);
+    // initialises the page structs of the next chunk of memory that init left out, returns false once there is nothing left
+    bool init_deferred_pages();
+    // must only be called once nothing uses the bootloader's memory anymore, the stack kmain started on included
+    void reclaim_bootloader_mem(limine_memmap_response *memmap_res);
 
+    // nullptr if the page is not in any region
     Page* find_page(uptr phy);
 
+    // returns the first page of a block of 2^order pages, or nullptr if there is no free block big enough
+    // reclaims first if memory is short and the caller holds no locks, it does not try to undo fragmentation
+    Page* alloc_block(usize order);
+    void free_block(Page *page);
+
+    // turns an allocated block into 2^order individually freeable pages that each hold the references of the block
+    void split_block(Page *page);
+
+    // never fails, reclaims or calls the oom killer and panics only if that cannot free a page either
     Page* alloc_page();
+    // nullptr instead of reclaiming, for callers that can return an error
+    Page* try_alloc_page();
     void free_page(Page *page);
 
+    // a page that is already zeroed, from the pool the idle thread fills in its spare time if it has one
+    Page* alloc_zeroed_page();
+    // zeroes a free page into the pool, returns false if the pool is full or memory is too low to take more
+    bool fill_zeroed_pool();
+
+    inline void get_page(Page *page) {
+        __atomic_add_fetch(&page->ref_count, 1, __ATOMIC_RELAXED);
+    }
+
+    // drops a reference, freeing the page or block when it was the last one
+    inline void put_page(Page *page) {
+        if (__atomic_sub_fetch(&page->ref_count, 1, __ATOMIC_ACQ_REL) == 0) {
+            if (page->order == 0)
+                free_page(page);
+            else
+                free_block(page);
+        }
+    }
+
+    inline usize order_for_pages(usize num_pages) {
+        if (num_pages <= 1)
+            return 0;
+        return klib::NumericLimits<u64>::bits - __builtin_clzl(num_pages - 1);
+    }
+
+    // returns the physical address of a naturally aligned block of at least num_pages pages
     inline uptr alloc_pages(usize num_pages) {
-        ASSERT(num_pages == 1);
-        Page *page = alloc_page();
+        Page *page = alloc_block(order_for_pages(num_pages));
+        if (page == nullptr) [[unlikely]]
+            panic("Out of physical memory for %ld contiguous pages", num_pages);
         return page->phy();
     }
 
+    inline void free_pages(uptr phy) {
+        free_block(find_page(phy));
+    }
+
     struct Stats {
-        usize total_pages_usable = 0;
+        usize total_pages_usable = 0; // including the deferred pages
         usize total_pages_reserved = 0;
         usize total_free_pages = 0;
+        usize deferred_pages = 0; // usable pages whose page structs are not initialised yet, not part of total_free_pages
+        usize free_blocks[max_order + 1] = {}; // number of free blocks of each order
+        usize file_pages = 0; // allocated pages with page_flag_file
+        usize zeroed_pages = 0; // free pages in the pre-zeroed pool, not part of total_free_pages
+        usize zeroed_hits = 0; // alloc_zeroed_page served from the pool
+        usize zeroed_misses = 0; // alloc_zeroed_page that had to zero a page itself
+        usize pages_zeroed = 0; // by the idle thread
     };
 
     extern Stats stats;
+
+    // only touched by its own cpu with interrupts disabled
+    struct CpuPageCache {
+        klib::ListHead pages;
+        usize num_pages = 0;
+        usize alloc_hits = 0;
+        usize alloc_misses = 0; // allocations that had to refill from the buddy allocator
+        usize free_hits = 0;
+        usize free_drains = 0; // frees that had to drain to the buddy allocator
+        CpuPageCache *next = nullptr; // list of every cpu cache, for statistics
+    };
+
+    CpuPageCache* create_cpu_page_cache();
+    CpuPageCache* cpu_page_cache_list();
+
+    // free pages in the buddy allocator, in every cpu cache, in the pre-zeroed pool and not absorbed yet
+    usize num_free_pages();
+
+    extern usize max_zeroed_pages; // tunable through /proc/sys/vm
+
+    // reclaim tries to keep the number of free pages between the low and high watermarks, min is the reserve below which it gets desperate
+    extern usize min_free_pages;
+    inline usize low_watermark() { return min_free_pages + min_free_pages / 4; }
+    inline usize high_watermark() { return min_free_pages + min_free_pages / 2; }
 }
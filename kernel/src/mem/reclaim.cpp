@@ -0,0 +1,173 @@
+#include <mem/reclaim.hpp>
+#include <mem/vmm.hpp>
+#include <mem/slab.hpp>
+#include <mem/swap.hpp>
+#include <sched/sched.hpp>
+#include <sched/event.hpp>
+#include <klib/cstdio.hpp>
+#include <klib/algorithm.hpp>
+#include <signal.h>
+
+namespace mem::reclaim {
+    Stats stats;
+
+    constexpr usize scan_batch = 4096; // ptes looked at with interrupts disabled before other threads get a chance to run
+
+    static sched::Event kswapd_event("kswapd");
+    static sched::Thread *kswapd_thread = nullptr;
+    static bool kswapd_wakeup_pending = false;
+    static int oom_victim_pid = 0;
+
+    // moves the clock hand over the pagemaps until target pages are freed or scan_batch ptes were looked at
+    // sets *wrapped when the hand went past the last pagemap
+    static usize shrink(usize target, bool *wrapped) {
+        klib::InterruptLock interrupt_guard;
+
+        usize num_freed = slab::shrink();
+        usize budget = scan_batch;
+        auto *list = &vmm->pagemap_list;
+        while (num_freed < target && budget > 0) {
+            if (vmm->reclaim_hand == nullptr) {
+                if (list->is_empty())
+                    break;
+                vmm->reclaim_hand = LIST_HEAD(list, Pagemap, pagemap_link);
+                vmm->reclaim_hand_virt = 0;
+            }
+
+            Pagemap *pagemap = vmm->reclaim_hand;
+            num_freed += pagemap->reclaim(target - num_freed, &vmm->reclaim_hand_virt, &budget);
+            if (vmm->reclaim_hand_virt == 0) {
+                if (pagemap->pagemap_link.next == list) {
+                    vmm->reclaim_hand = nullptr;
+                    *wrapped = true;
+                    break;
+                }
+                vmm->reclaim_hand = LIST_ENTRY(pagemap->pagemap_link.next, Pagemap, pagemap_link);
+            }
+        }
+        return num_freed;
+    }
+
+    static void oom_kill() {
+        // the last victim still has to exit and give back its memory
+        if (oom_victim_pid) {
+            sched::Thread *thread = sched::Thread::get_from_tid(oom_victim_pid);
+            if (thread && thread->process->pid == oom_victim_pid && thread->process->pagemap)
+                return;
+            oom_victim_pid = 0;
+        }
+
+        sched::Process *victim = sched::find_largest_process();
+        if (victim == nullptr) {
+            klib::printf("OOM: Out of memory and no process left to kill\n");
+            return;
+        }
+
+        usize rss = victim->pagemap->num_small_pages + victim->pagemap->num_huge_pages * (huge_page_size / 0x1000);
+        klib::printf("OOM: Killing process %d (%s) with %lu KiB resident\n", victim->pid, victim->get_main_thread()->name, rss * 4);
+        oom_victim_pid = victim->pid;
+        stats.oom_kills++;
+        victim->send_signal(SIGKILL);
+    }
+
+    // reclaims until there are goal free pages, the oom killer is called if the clock hand went around twice without freeing anything
+    // the first time around only takes the accessed bits away
+    // sleeps while swap::flush writes the queued pages, direct reclaim included, so other threads run in between anyway
+    static void reclaim_until(usize goal) {
+        usize num_empty_sweeps = 0, freed_this_sweep = 0;
+        while (pmm::num_free_pages() < goal) {
+            bool wrapped = false;
+            freed_this_sweep += shrink(goal - pmm::num_free_pages() + pmm::page_cache_batch, &wrapped);
+            swap::flush(); // pages queued for a swap device are only freed once they are written
+            if (wrapped) {
+                num_empty_sweeps = freed_this_sweep ? 0 : num_empty_sweeps + 1;
+                freed_this_sweep = 0;
+                if (num_empty_sweeps == 2) {
+                    if (pmm::num_free_pages() < pmm::min_free_pages)
+                        oom_kill();
+                    return;
+                }
+            }
+            sched::yield();
+        }
+    }
+
+    [[noreturn]] static void kswapd_loop() {
+        cpu::get_current_thread()->reclaiming = true;
+        while (true) {
+            kswapd_event.wait();
+            stats.kswapd_wakeups++;
+            reclaim_until(pmm::high_watermark());
+            __atomic_clear(&kswapd_wakeup_pending, __ATOMIC_RELEASE);
+        }
+    }
+
+    void init() {
+        pmm::min_free_pages = klib::clamp(pmm::stats.total_pages_usable / 128, (usize)128, (usize)16384);
+        kswapd_thread = sched::new_kernel_thread([] () { kswapd_loop(); }, true, "kswapd");
+        klib::printf("Reclaim: Watermarks are %lu, %lu and %lu free pages\n", pmm::min_free_pages, pmm::low_watermark(), pmm::high_watermark());
+    }
+
+    void wake_kswapd() {
+        if (kswapd_thread == nullptr)
+            return;
+        // one wakeup per round of kswapd
+        if (__atomic_test_and_set(&kswapd_wakeup_pending, __ATOMIC_ACQUIRE))
+            return;
+        kswapd_event.trigger();
+    }
+
+    // reclaiming needs interrupts, which are only enabled if no spinlock is held and no pagemap is being changed
+    // the allocations made while reclaiming, like the buffers of a swap write, must not reclaim again
+    static bool can_direct_reclaim() {
+        if (!cpu::get_interrupt_state())
+            return false;
+        sched::Thread *thread = cpu::get_current_thread();
+        return thread && !thread->reclaiming;
+    }
+
+    static void direct_reclaim(usize goal) {
+        sched::Thread *thread = cpu::get_current_thread();
+        stats.direct_reclaims++;
+        thread->reclaiming = true;
+        reclaim_until(goal);
+        thread->reclaiming = false;
+    }
+
+    bool direct_reclaim_if_low() {
+        usize num_free = pmm::num_free_pages();
+        if (num_free >= pmm::low_watermark())
+            return true;
+        wake_kswapd();
+        if (num_free >= pmm::min_free_pages)
+            return true;
+        if (!can_direct_reclaim())
+            return false;
+
+        direct_reclaim(pmm::min_free_pages);
+        return pmm::num_free_pages() >= pmm::min_free_pages;
+    }
+
+    bool reclaim_for_allocation(usize num_pages) {
+        if (!can_direct_reclaim())
+            return false;
+        direct_reclaim(pmm::min_free_pages + num_pages);
+        return true;
+    }
+
+    usize available_pages() {
+        usize low = pmm::low_watermark();
+        usize num_free = pmm::num_free_pages();
+        usize available = num_free > low ? num_free - low : 0;
+
+        // like linux, assume that at least half of the file pages or the low watermark worth of them are needed
+        usize file_pages = pmm::stats.file_pages;
+        available += file_pages - klib::min(file_pages / 2, low);
+
+        klib::InterruptLock interrupt_guard;
+        Pagemap *pagemap;
+        LIST_FOR_EACH(pagemap, &vmm->pagemap_list, pagemap_link)
+            available += pagemap->num_lazyfree_pages;
+        return available;
+    }
+}
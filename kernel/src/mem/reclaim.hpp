@@ -0,0 +1,36 @@
+#pragma once
+
+#include <klib/common.hpp>
+
+// keeps free memory above the watermarks of the pmm by dropping pages that can be brought back:
+// clean file pages, lazily freed anonymous pages and empty slabs
+// there is no rmap, so instead of lru lists a clock hand sweeps the ptes of every user pagemap and uses their accessed bits
+// the oom killer is the last resort once a whole sweep frees nothing
+namespace mem::reclaim {
+    struct Stats {
+        usize kswapd_wakeups = 0;
+        usize direct_reclaims = 0; // user faults and allocations that had to reclaim because free memory was below the min watermark
+        usize oom_kills = 0;
+    };
+
+    extern Stats stats;
+
+    // sets the watermarks and starts kswapd
+    void init();
+
+    // asks kswapd to bring free memory back up to the high watermark, can be called with interrupts disabled
+    void wake_kswapd();
+
+    // called before the kernel allocates on behalf of user space: user faults, faults of user access primitives and tmpfs writes
+    // wakes kswapd below the low watermark and reclaims right away below the min watermark if interrupts are enabled
+    // reclaiming may sleep on the disk writes of swap areas, like swapping a page in does
+    // returns false if free memory is still below the min watermark
+    bool direct_reclaim_if_low();
+
+    // the slow path of the pmm once nothing is free, reclaims num_pages above the min watermark or calls the oom killer
+    // returns false without doing anything if the caller has interrupts disabled or is already reclaiming
+    bool reclaim_for_allocation(usize num_pages);
+
+    // free pages plus the ones that can be reclaimed without hurting much, for MemAvailable
+    usize available_pages();
+}
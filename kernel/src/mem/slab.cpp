@@ -0,0 +1,384 @@
+#include <mem/slab.hpp>
+#include <mem/vmem.hpp>
+#include <mem/vmm.hpp>
+#include <klib/cstring.hpp>
+#include <klib/cstdio.hpp>
+#include <klib/algorithm.hpp>
+#include <cpu/cpu.hpp>
+#include <panic.hpp>
+
+namespace mem::slab {
+    Cache caches[num_size_classes];
+    LargeStats large_stats;
+
+    static vmem::Arena slab_arena; // hands out slab_size aligned slabs
+    static vmem::Arena large_arena; // hands out pages for allocations bigger than max_object_size
+    static uptr slab_region_base, slab_region_end;
+
+    static CpuCache *cpu_cache_list;
+    static klib::Spinlock cpu_cache_list_lock;
+
+    static usize size_class_index(usize size) {
+        if (size <= min_object_size)
+            return 0;
+        return klib::NumericLimits<u64>::bits - __builtin_clzl(size - 1) - 4;
+    }
+
+    static inline bool is_slab_object(void *ptr) {
+        return (uptr)ptr >= slab_region_base && (uptr)ptr < slab_region_end;
+    }
+
+    static inline Slab* slab_of(void *ptr) {
+        Slab *slab = (Slab*)klib::align_down((uptr)ptr, slab_size);
+        if (slab->magic != Slab::magic_value) [[unlikely]]
+            panic("Bad free of %#lX, not a slab object", (uptr)ptr);
+        return slab;
+    }
+
+    // magazines come straight from the slab layer of their size class so that they never recurse into the magazine layer
+    static inline Cache* magazine_cache() {
+        return &caches[size_class_index(sizeof(Magazine))];
+    }
+
+    void init(uptr base, usize size) {
+        // the lower half of the heap is reserved for slabs, the upper half for large allocations
+        slab_region_base = klib::align_up(base, slab_size);
+        slab_region_end = klib::align_down(slab_region_base + (base + size - slab_region_base) / 2, slab_size);
+
+        slab_arena.init("kernel-slab", slab_size);
+        slab_arena.add(slab_region_base, slab_region_end - slab_region_base);
+        large_arena.init("kernel-large", 0x1000);
+        large_arena.add(slab_region_end, base + size - slab_region_end);
+
+        for (usize i = 0; i < num_size_classes; i++)
+            caches[i].init(min_object_size << i);
+    }
+
+    void Cache::init(usize object_size) {
+        klib::snprintf(name, sizeof(name), "kmalloc-%lu", object_size);
+        this->object_size = object_size;
+        objects_per_slab = (slab_size - sizeof(Slab)) / object_size;
+        partial_list.init();
+        full_list.init();
+        empty_slab = nullptr;
+        depot_full = nullptr;
+        depot_empty = nullptr;
+        depot_num_full = 0;
+        depot_num_empty = 0;
+    }
+
+    CpuCache* create_cpu_cache() {
+        CpuCache *cpu_cache = new CpuCache();
+        klib::SpinlockGuard guard(cpu_cache_list_lock);
+        cpu_cache->next = cpu_cache_list;
+        cpu_cache_list = cpu_cache;
+        return cpu_cache;
+    }
+
+    Slab* Cache::create_slab() {
+        uptr base = slab_arena.xalloc(slab_size);
+        if (base == 0) [[unlikely]]
+            panic("Kernel heap exhausted while growing %s", name);
+
+        // only the header page is touched here, object pages are faulted in as they are handed out
+        Slab *slab = (Slab*)base;
+        slab->link = {};
+        slab->cache = this;
+        slab->freelist = nullptr;
+        slab->num_used = 0;
+        slab->num_fresh = objects_per_slab;
+        slab->magic = Slab::magic_value;
+        stats.num_slabs++;
+        return slab;
+    }
+
+    void Cache::destroy_slab(Slab *slab) {
+        slab->magic = 0;
+        vmm->kernel_pagemap.invalidate_pages((uptr)slab, slab_size); // frees the physical pages
+        slab_arena.xfree((uptr)slab, slab_size);
+        stats.num_slabs--;
+    }
+
+    void* Cache::allocate() {
+        klib::SpinlockGuard guard(lock);
+
+        Slab *slab;
+        if (!partial_list.is_empty()) {
+            slab = LIST_HEAD(&partial_list, Slab, link);
+        } else {
+            if (empty_slab) {
+                slab = empty_slab;
+                empty_slab = nullptr;
+            } else {
+                slab = create_slab();
+            }
+            partial_list.add(&slab->link);
+        }
+
+        void *object;
+        if (slab->freelist) {
+            object = slab->freelist;
+            slab->freelist = *(void**)object;
+        } else {
+            ASSERT(slab->num_fresh > 0);
+            object = (void*)(slab->objects_base() + (objects_per_slab - slab->num_fresh) * object_size);
+            slab->num_fresh--;
+        }
+
+        slab->num_used++;
+        if (slab->num_used == objects_per_slab) {
+            slab->link.remove();
+            full_list.add(&slab->link);
+        }
+
+        stats.num_allocs++;
+        stats.active_objects++;
+        return object;
+    }
+
+    void Cache::free(Slab *slab, void *object) {
+        klib::SpinlockGuard guard(lock);
+
+        *(void**)object = slab->freelist;
+        slab->freelist = object;
+
+        if (slab->num_used == objects_per_slab) {
+            slab->link.remove();
+            partial_list.add(&slab->link);
+        }
+        slab->num_used--;
+
+        stats.num_frees++;
+        stats.active_objects--;
+
+        if (slab->num_used == 0) {
+            slab->link.remove();
+            if (empty_slab == nullptr)
+                empty_slab = slab;
+            else
+                destroy_slab(slab);
+        }
+    }
+
+    void Cache::shrink() {
+        klib::SpinlockGuard guard(lock);
+        if (empty_slab) {
+            destroy_slab(empty_slab);
+            empty_slab = nullptr;
+        }
+    }
+
+    void* Cache::allocate_cached(CpuMagazines *cpu_magazines) {
+        Magazine *loaded = cpu_magazines->loaded;
+        if (loaded && loaded->rounds > 0) {
+            cpu_magazines->num_alloc_hits++;
+            return loaded->objects[--loaded->rounds];
+        }
+
+        Magazine *previous = cpu_magazines->previous;
+        if (previous && previous->rounds > 0) {
+            cpu_magazines->previous = loaded;
+            cpu_magazines->loaded = previous;
+            cpu_magazines->num_alloc_hits++;
+            return previous->objects[--previous->rounds];
+        }
+
+        // both magazines are empty, exchange one of them for a full one from the depot
+        Magazine *full = nullptr;
+        {
+            klib::SpinlockGuard guard(depot_lock);
+            if (depot_full) {
+                full = depot_full;
+                depot_full = full->next;
+                depot_num_full--;
+                if (previous) {
+                    previous->next = depot_empty;
+                    depot_empty = previous;
+                    depot_num_empty++;
+                }
+            }
+        }
+
+        if (!full)
+            return allocate();
+
+        cpu_magazines->previous = loaded;
+        cpu_magazines->loaded = full;
+        cpu_magazines->num_alloc_hits++;
+        return full->objects[--full->rounds];
+    }
+
+    void Cache::free_cached(CpuMagazines *cpu_magazines, void *object) {
+        Magazine *loaded = cpu_magazines->loaded;
+        if (loaded && loaded->rounds < magazine_size) {
+            loaded->objects[loaded->rounds++] = object;
+            cpu_magazines->num_free_hits++;
+            return;
+        }
+
+        Magazine *previous = cpu_magazines->previous;
+        if (previous && previous->rounds < magazine_size) {
+            cpu_magazines->previous = loaded;
+            cpu_magazines->loaded = previous;
+            previous->objects[previous->rounds++] = object;
+            cpu_magazines->num_free_hits++;
+            return;
+        }
+
+        // both magazines are full, hand one of them to the depot and load an empty one
+        Magazine *empty = nullptr;
+        bool depot_overflow = false;
+        {
+            klib::SpinlockGuard guard(depot_lock);
+            if (previous && depot_num_full >= depot_max_full) {
+                depot_overflow = true;
+            } else {
+                if (previous) {
+                    previous->next = depot_full;
+                    depot_full = previous;
+                    depot_num_full++;
+                }
+                if (depot_empty) {
+                    empty = depot_empty;
+                    depot_empty = empty->next;
+                    depot_num_empty--;
+                }
+            }
+        }
+
+        if (depot_overflow) {
+            // the depot already holds enough rounds, return this magazine's rounds to the slabs and reuse it
+            drain_magazine(previous);
+            empty = previous;
+        } else if (!empty) {
+            empty = (Magazine*)magazine_cache()->allocate();
+            empty->rounds = 0;
+        }
+
+        cpu_magazines->previous = loaded;
+        cpu_magazines->loaded = empty;
+        empty->objects[empty->rounds++] = object;
+    }
+
+    void Cache::drain_magazine(Magazine *magazine) {
+        for (usize i = 0; i < magazine->rounds; i++)
+            free(slab_of(magazine->objects[i]), magazine->objects[i]);
+        magazine->rounds = 0;
+    }
+
+    static void* allocate_large(usize size) {
+        usize aligned_size = klib::align_up(size, 0x1000);
+        uptr base = large_arena.xalloc(aligned_size);
+        if (base == 0) [[unlikely]]
+            panic("Kernel heap exhausted while allocating %#lX bytes", size);
+
+        klib::InterruptLock interrupt_guard;
+        large_stats.num_allocs++;
+        large_stats.active_allocations++;
+        large_stats.active_bytes += aligned_size;
+        return (void*)base;
+    }
+
+    static void free_large(void *ptr) {
+        usize size = large_arena.allocated_size((uptr)ptr);
+        if (size == 0) [[unlikely]]
+            panic("Bad free of %#lX, not a large allocation", (uptr)ptr);
+
+        vmm->kernel_pagemap.invalidate_pages((uptr)ptr, size); // frees the physical pages
+        large_arena.xfree((uptr)ptr, size);
+
+        klib::InterruptLock interrupt_guard;
+        large_stats.num_frees++;
+        large_stats.active_allocations--;
+        large_stats.active_bytes -= size;
+    }
+
+    void* allocate(usize size, usize alignment) {
+        if (size == 0)
+            return nullptr;
+
+        // objects in a slab are aligned to their size up to the size of the slab header
+        if (alignment <= sizeof(Slab)) {
+            usize object_size = klib::max(size, alignment);
+            if (object_size <= max_object_size) {
+                usize size_class = size_class_index(object_size);
+                klib::InterruptLock interrupt_guard;
+                CpuCache *cpu_cache = cpu::get_current_cpu()->slab_cache;
+                if (cpu_cache)
+                    return caches[size_class].allocate_cached(&cpu_cache->magazines[size_class]);
+                return caches[size_class].allocate();
+            }
+        }
+
+        ASSERT(alignment <= 0x1000);
+        return allocate_large(size);
+    }
+
+    void free(void *ptr) {
+        if (ptr == nullptr)
+            return;
+
+        if (is_slab_object(ptr)) {
+            Slab *slab = slab_of(ptr);
+            Cache *cache = slab->cache;
+            klib::InterruptLock interrupt_guard;
+            CpuCache *cpu_cache = cpu::get_current_cpu()->slab_cache;
+            if (cpu_cache)
+                cache->free_cached(&cpu_cache->magazines[cache - caches], ptr);
+            else
+                cache->free(slab, ptr);
+        } else {
+            free_large(ptr);
+        }
+    }
+
+    usize allocation_size(void *ptr) {
+        if (is_slab_object(ptr))
+            return slab_of(ptr)->cache->object_size;
+        return large_arena.allocated_size((uptr)ptr);
+    }
+
+    void* reallocate(void *ptr, usize size) {
+        if (ptr == nullptr)
+            return allocate(size);
+
+        if (size == 0) {
+            free(ptr);
+            return nullptr;
+        }
+
+        usize old_size = allocation_size(ptr);
+        if (size <= old_size && size > old_size / 2)
+            return ptr;
+
+        void *new_ptr = allocate(size);
+        memcpy(new_ptr, ptr, klib::min(size, old_size));
+        free(ptr);
+        return new_ptr;
+    }
+
+    usize total_bytes() {
+        usize total = large_stats.active_bytes;
+        for (usize i = 0; i < num_size_classes; i++)
+            total += caches[i].stats.num_slabs * slab_size;
+        return total;
+    }
+
+    usize shrink() {
+        // only the pages of a slab that were ever touched are backed, so count what the kernel pagemap actually lost
+        usize num_pages = vmm->kernel_pagemap.num_small_pages;
+        for (usize i = 0; i < num_size_classes; i++)
+            caches[i].shrink();
+        return num_pages - vmm->kernel_pagemap.num_small_pages;
+    }
+
+    void magazine_hits(usize size_class, usize *alloc_hits, usize *free_hits) {
+        *alloc_hits = 0;
+        *free_hits = 0;
+        klib::SpinlockGuard guard(cpu_cache_list_lock);
+        for (CpuCache *cpu_cache = cpu_cache_list; cpu_cache; cpu_cache = cpu_cache->next) {
+            *alloc_hits += cpu_cache->magazines[size_class].num_alloc_hits;
+            *free_hits += cpu_cache->magazines[size_class].num_free_hits;
+        }
+    }
+}
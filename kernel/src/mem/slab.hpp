@@ -0,0 +1,130 @@
+#pragma once
+
+#include <klib/common.hpp>
+#include <klib/list.hpp>
+#include <klib/lock.hpp>
+
+// size class allocator backing klib::malloc
+// objects up to max_object_size are carved out of slabs of their power of two size class,
+// anything bigger gets whole pages straight from the large allocation arena
+// each cpu caches objects in magazines so that most allocations never take a lock, see section 3 of
+// https://www.usenix.org/legacy/publications/library/proceedings/usenix01/full_papers/bonwick/bonwick.pdf
+namespace mem::slab {
+    constexpr usize default_alignment = 16;
+    constexpr usize slab_size = 0x8000; // 32 KiB, slabs are aligned to this so the header can be found from any object
+    constexpr usize min_object_size = 16;
+    constexpr usize max_object_size = 2048;
+    constexpr usize num_size_classes = 8; // 16, 32, 64, ..., 2048
+    constexpr usize magazine_size = 30; // rounds per magazine, makes a magazine exactly 256 bytes
+    constexpr usize depot_max_full = 16; // full magazines kept per size class before rounds are given back to the slabs
+
+    struct Cache;
+
+    struct alignas(64) Slab {
+        static constexpr u64 magic_value = 0x51AB51AB51AB51AB;
+
+        klib::ListHead link; // partial_list or full_list of the cache
+        Cache *cache;
+        void *freelist; // singly linked through the first word of each freed object
+        usize num_used;
+        usize num_fresh; // objects at the end of the slab that have never been handed out
+        u64 magic;
+
+        inline uptr objects_base() const { return (uptr)this + sizeof(Slab); }
+    };
+    static_assert(sizeof(Slab) == 64);
+
+    struct Magazine {
+        Magazine *next; // used when the magazine is in the depot
+        usize rounds;
+        void *objects[magazine_size];
+    };
+    static_assert(sizeof(Magazine) == 256);
+
+    struct Stats {
+        usize num_allocs = 0;
+        usize num_frees = 0;
+        usize active_objects = 0;
+        usize num_slabs = 0;
+    };
+
+    // the per cpu layer of a size class, only touched by its own cpu with interrupts disabled
+    struct CpuMagazines {
+        Magazine *loaded = nullptr;
+        Magazine *previous = nullptr;
+        usize num_alloc_hits = 0;
+        usize num_free_hits = 0;
+    };
+
+    struct CpuCache {
+        CpuMagazines magazines[num_size_classes];
+        CpuCache *next = nullptr; // list of every cpu cache, for statistics
+    };
+
+    struct Cache {
+        char name[16];
+        usize object_size;
+        usize objects_per_slab;
+
+        klib::Spinlock lock;
+        klib::ListHead partial_list; // slabs with at least one used and one free object
+        klib::ListHead full_list;
+        Slab *empty_slab; // a single completely free slab is kept around to avoid thrashing
+
+        Stats stats;
+
+        klib::Spinlock depot_lock;
+        Magazine *depot_full; // singly linked through Magazine::next
+        Magazine *depot_empty;
+        usize depot_num_full;
+        usize depot_num_empty;
+
+        void init(usize object_size);
+
+        // slab layer, always takes the lock
+        void* allocate();
+        void free(Slab *slab, void *object);
+
+        // magazine layer, falls back to the slab layer when the cpu and the depot are out of rounds
+        void* allocate_cached(CpuMagazines *cpu_magazines);
+        void free_cached(CpuMagazines *cpu_magazines, void *object);
+
+        // gives back the empty slab kept around
+        void shrink();
+
+    private:
+        Slab* create_slab();
+        void destroy_slab(Slab *slab);
+        void drain_magazine(Magazine *magazine);
+    };
+
+    struct LargeStats {
+        usize num_allocs = 0;
+        usize num_frees = 0;
+        usize active_allocations = 0;
+        usize active_bytes = 0;
+    };
+
+    extern Cache caches[num_size_classes];
+    extern LargeStats large_stats;
+
+    void init(uptr base, usize size);
+
+    // allocates the magazine layer of a cpu, until this is done every allocation on that cpu goes to the slab layer
+    CpuCache* create_cpu_cache();
+    void* allocate(usize size, usize alignment = default_alignment);
+    void* reallocate(void *ptr, usize size);
+    void free(void *ptr);
+
+    // usable size of an allocation
+    usize allocation_size(void *ptr);
+
+    // bytes of virtual memory currently held by slabs and large allocations
+    usize total_bytes();
+
+    // frees the memory held by empty slabs, returns the number of pages freed
+    usize shrink();
+
+    // allocations and frees of a size class served by the magazine layer, summed over every cpu
+    void magazine_hits(usize size_class, usize *alloc_hits, usize *free_hits);
+}
@@ -0,0 +1,81 @@
+#include <mem/swap.hpp>
+#include <mem/vmm.hpp>
+#include <klib/lock.hpp>
+#include <panic.hpp>
+
+namespace mem::swap {
+    Stats stats;
+    Area *areas[max_areas];
+    usize num_areas = 0;
+    static usize priority_order[max_areas]; // indices into areas, highest priority first
+
+    // areas keep their index for as long as swap entries pointing into them exist, so they are never removed
+    void add_area(Area *area) {
+        klib::InterruptLock interrupt_guard;
+        ASSERT(num_areas < max_areas);
+        usize index = num_areas++;
+        areas[index] = area;
+
+        usize i = index;
+        for (; i > 0 && areas[priority_order[i - 1]]->priority < area->priority; i--)
+            priority_order[i] = priority_order[i - 1];
+        priority_order[i] = index;
+    }
+
+    u64 swap_out(pmm::Page *page) {
+        klib::InterruptLock interrupt_guard;
+        for (usize i = 0; i < num_areas; i++) {
+            usize index = priority_order[i];
+            isize slot = areas[index]->write(page);
+            if (slot >= 0) {
+                stats.pages_swapped_out++;
+                return make_swap_entry(index, slot);
+            }
+        }
+        stats.failed_swap_outs++;
+        return 0;
+    }
+
+    // may block while an area reads from its device
+    isize swap_in(u64 entry, pmm::Page *page) {
+        usize area = swap_entry_area(entry);
+        ASSERT(area < num_areas);
+        isize err = areas[area]->read(swap_entry_slot(entry), page);
+        if (err >= 0)
+            __atomic_add_fetch(&stats.pages_swapped_in, 1, __ATOMIC_RELAXED);
+        return err;
+    }
+
+    void dup_entry(u64 entry) {
+        klib::InterruptLock interrupt_guard;
+        usize area = swap_entry_area(entry);
+        ASSERT(area < num_areas);
+        areas[area]->dup(swap_entry_slot(entry));
+    }
+
+    void free_entry(u64 entry) {
+        klib::InterruptLock interrupt_guard;
+        usize area = swap_entry_area(entry);
+        ASSERT(area < num_areas);
+        areas[area]->free(swap_entry_slot(entry));
+    }
+
+    void flush() {
+        for (usize i = 0; i < num_areas; i++)
+            areas[i]->flush();
+    }
+
+    usize total_slots() {
+        usize total = 0;
+        for (usize i = 0; i < num_areas; i++)
+            total += areas[i]->num_slots;
+        return total;
+    }
+
+    usize used_slots() {
+        usize used = 0;
+        for (usize i = 0; i < num_areas; i++)
+            used += areas[i]->num_used;
+        return used;
+    }
+}
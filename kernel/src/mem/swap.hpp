@@ -0,0 +1,61 @@
+#pragma once
+
+#include <mem/pmm.hpp>
+#include <klib/common.hpp>
+
+namespace dev {
+    struct BlockInterface;
+}
+
+// anonymous pages that reclaim takes away are written to a swap area and the pte keeps a swap entry pointing at the slot
+// a slot is shared by every pte that holds its entry, like a page is shared by the ptes that map it
+namespace mem::swap {
+    constexpr usize max_areas = 4;
+
+    struct Area {
+        const char *name; // as shown in /proc/swaps
+        const char *type;
+        int priority = 0; // areas with a higher priority are tried first
+        usize num_slots = 0;
+        usize num_used = 0;
+        dev::BlockInterface *device = nullptr; // the one the area is on, nullptr if it is in memory
+
+        virtual ~Area() {}
+
+        // stores a copy of page, returns the slot or ENOSPC if it does not want the page
+        // called by reclaim with interrupts disabled so it must not block, an area with a device queues the write for flush
+        // reclaim calls flush after every batch, kswapd and direct reclaim alike, and sleeps until the writes are done
+        virtual isize write(pmm::Page *page) = 0;
+        virtual isize read(usize slot, pmm::Page *page) = 0; // may block
+        virtual void dup(usize slot) = 0; // another pte holds the slot
+        virtual void free(usize slot) = 0; // a pte let go of the slot, it is freed once nothing holds it
+        virtual void flush() {} // finishes the writes that write queued up, may block
+    };
+
+    struct Stats {
+        usize pages_swapped_out = 0;
+        usize pages_swapped_in = 0;
+        usize failed_swap_outs = 0; // no area took the page
+        usize clusters_written = 0; // write requests to swap devices
+        usize write_errors = 0;
+        usize device_reads = 0; // read requests to swap devices
+        usize readahead_pages = 0; // read along with a swap in
+        usize readahead_hits = 0; // swap ins that found their page read ahead
+    };
+
+    extern Stats stats;
+    extern Area *areas[max_areas]; // in the order they were added, the index is part of the swap entry
+    extern usize num_areas;
+
+    void add_area(Area *area);
+
+    // returns the swap entry for the pte, or 0 if no area took the page
+    u64 swap_out(pmm::Page *page);
+    isize swap_in(u64 entry, pmm::Page *page);
+    void dup_entry(u64 entry);
+    void free_entry(u64 entry);
+    void flush();
+
+    usize total_slots();
+    usize used_slots();
+}
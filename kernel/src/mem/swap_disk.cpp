@@ -0,0 +1,275 @@
+#include <mem/swap_disk.hpp>
+#include <mem/vmm.hpp>
+#include <dev/devnode.hpp>
+#include <fs/vfs.hpp>
+#include <sched/sched.hpp>
+#include <cpu/cpu.hpp>
+#include <cpu/syscall/syscall.hpp>
+#include <klib/async.hpp>
+#include <klib/algorithm.hpp>
+#include <klib/cstring.hpp>
+#include <klib/cstdio.hpp>
+#include <klib/lock.hpp>
+#include <panic.hpp>
+#include <errno.h>
+#include <sys/swap.h>
+#include <linux/capability.h>
+
+namespace mem::swap {
+    DiskArea::DiskArea(dev::BlockInterface *device, usize num_pages) : num_pages(num_pages) {
+        this->device = device;
+        type = "partition";
+        used_bitmap = new u64[(num_pages + 63) / 64]();
+        ref_counts = new u16[num_pages]();
+
+        // the header and the bits past the end are never handed out
+        set_used(0, true);
+        for (usize slot = num_pages; slot % 64; slot++)
+            set_used(slot, true);
+
+        for (usize i = 0; i < readahead_window; i++)
+            readahead_pages[i] = pmm::alloc_page();
+    }
+
+    DiskArea* DiskArea::create(dev::BlockInterface *device, const char *name, int priority) {
+        pmm::Page *header_page = pmm::alloc_page();
+        defer { pmm::free_page(header_page); };
+
+        if (klib::sync(device->read_write_block(0, header_page->phy(), Direction::READ)) < 0) {
+            klib::printf("Swap: Failed to read the header of %s\n", name);
+            return nullptr;
+        }
+        if (memcmp(header_page->as<u8>() + disk_signature_offset, "SWAPSPACE2", 10) != 0) {
+            klib::printf("Swap: %s is not a swap area\n", name);
+            return nullptr;
+        }
+
+        DiskHeader *header = header_page->as<DiskHeader>();
+        if (header->version != 1 || header->last_page < 1 || header->num_bad_pages > max_bad_pages) {
+            klib::printf("Swap: %s has an unsupported header\n", name);
+            return nullptr;
+        }
+
+        DiskArea *area = new DiskArea(device, (usize)header->last_page + 1);
+        area->name = klib::strdup(name);
+        area->priority = priority;
+        area->num_slots = header->last_page;
+        for (usize i = 0; i < header->num_bad_pages; i++) {
+            usize bad_page = header->bad_pages[i];
+            if (bad_page == 0 || bad_page >= area->num_pages || area->is_used(bad_page))
+                continue;
+            area->set_used(bad_page, true);
+            area->num_slots--;
+        }
+        return area;
+    }
+
+    // next fit, so that consecutive writes get consecutive slots
+    isize DiskArea::alloc_slot() {
+        usize num_words = (num_pages + 63) / 64;
+        usize word = next_slot / 64;
+        for (usize i = 0; i <= num_words; i++, word = (word + 1) % num_words) {
+            u64 free_bits = ~used_bitmap[word];
+            if (i == 0)
+                free_bits &= ~(((u64)1 << (next_slot % 64)) - 1);
+            if (free_bits == 0)
+                continue;
+            usize slot = word * 64 + __builtin_ctzl(free_bits);
+            next_slot = slot + 1 < num_pages ? slot + 1 : 1;
+            return slot;
+        }
+        return -ENOSPC;
+    }
+
+    pmm::Page* DiskArea::find_queued_page(usize slot) {
+        // filling is newer, a slot that was freed while writing may already be in it again
+        if (slot - filling.first_slot < filling.num_pages)
+            return filling.pages[slot - filling.first_slot];
+        if (is_writing && slot - writing.first_slot < writing.num_pages)
+            return writing.pages[slot - writing.first_slot];
+        return nullptr;
+    }
+
+    void DiskArea::forget_readahead(usize slot) {
+        if (slot - readahead_first_slot < readahead_window) {
+            readahead_valid &= ~(1u << (slot - readahead_first_slot));
+            readahead_stale |= 1u << (slot - readahead_first_slot);
+        }
+    }
+
+    isize DiskArea::write(pmm::Page *page) {
+        klib::InterruptLock interrupt_guard;
+        if (is_broken || filling.num_pages == cluster_pages)
+            return -ENOSPC; // until flush catches up
+
+        usize slot;
+        if (filling.num_pages > 0) {
+            // a cluster only grows while the slot after it is free
+            slot = filling.first_slot + filling.num_pages;
+            if (slot >= num_pages || is_used(slot))
+                return -ENOSPC;
+            next_slot = slot + 1 < num_pages ? slot + 1 : 1;
+        } else {
+            isize free_slot = alloc_slot();
+            if (free_slot < 0)
+                return free_slot;
+            slot = free_slot;
+            filling.first_slot = slot;
+        }
+
+        set_used(slot, true);
+        ref_counts[slot] = 1;
+        num_used++;
+        forget_readahead(slot);
+
+        pmm::get_page(page);
+        filling.pages[filling.num_pages++] = page;
+        return slot;
+    }
+
+    void DiskArea::flush() {
+        {
+            klib::InterruptLock interrupt_guard;
+            if (is_writing || is_broken || filling.num_pages == 0)
+                return;
+            writing = filling;
+            filling.num_pages = 0;
+            is_writing = true;
+        }
+
+        uptr page_phys[cluster_pages];
+        for (usize i = 0; i < writing.num_pages; i++)
+            page_phys[i] = writing.pages[i]->phy();
+        isize err = klib::sync(device->read_write_block_range(writing.first_slot, page_phys, writing.num_pages, Direction::WRITE));
+
+        klib::InterruptLock interrupt_guard;
+        if (err < 0) {
+            klib::printf("Swap: Failed to write %lu pages to %s (%ld), keeping them in memory\n", writing.num_pages, name, err);
+            stats.write_errors++;
+            is_broken = true;
+            return;
+        }
+
+        for (usize i = 0; i < writing.num_pages; i++)
+            pmm::put_page(writing.pages[i]);
+        stats.clusters_written++;
+        writing.num_pages = 0;
+        is_writing = false;
+    }
+
+    isize DiskArea::read(usize slot, pmm::Page *page) {
+        usize window_first = slot, window_length = 1;
+        bool use_window = false;
+        {
+            klib::InterruptLock interrupt_guard;
+            ASSERT(slot < num_pages && ref_counts[slot] > 0);
+
+            if (pmm::Page *queued_page = find_queued_page(slot)) {
+                memcpy(page->as<void>(), queued_page->as<void>(), 0x1000);
+                return 0;
+            }
+            if (slot - readahead_first_slot < readahead_window && (readahead_valid & (1u << (slot - readahead_first_slot)))) {
+                memcpy(page->as<void>(), readahead_pages[slot - readahead_first_slot]->as<void>(), 0x1000);
+                stats.readahead_hits++;
+                return 0;
+            }
+
+            stats.device_reads++;
+            if (!is_reading_ahead) { // otherwise someone else is using the window
+                use_window = true;
+                is_reading_ahead = true;
+                window_first = klib::align_down(slot, readahead_window);
+                window_length = klib::min(readahead_window, num_pages - window_first);
+                readahead_first_slot = window_first;
+                readahead_valid = 0;
+                readahead_stale = 0;
+            }
+        }
+
+        if (!use_window)
+            return klib::sync(device->read_write_block(slot, page->phy(), Direction::READ));
+
+        // the page asked for is read in place, the rest of the window into the readahead pages
+        uptr page_phys[readahead_window];
+        for (usize i = 0; i < window_length; i++)
+            page_phys[i] = window_first + i == slot ? page->phy() : readahead_pages[i]->phy();
+        isize err = klib::sync(device->read_write_block_range(window_first, page_phys, window_length, Direction::READ));
+
+        klib::InterruptLock interrupt_guard;
+        is_reading_ahead = false;
+        if (err < 0)
+            return err;
+
+        // only slots that were on the disk the whole time can be trusted
+        u32 valid = 0;
+        for (usize i = 0; i < window_length; i++) {
+            usize other = window_first + i;
+            if (other != slot && ref_counts[other] > 0 && !find_queued_page(other))
+                valid |= 1u << i;
+        }
+        readahead_valid = valid & ~readahead_stale;
+        stats.readahead_pages += __builtin_popcount(readahead_valid);
+        return 0;
+    }
+
+    void DiskArea::dup(usize slot) {
+        klib::InterruptLock interrupt_guard;
+        ASSERT(slot < num_pages && ref_counts[slot] > 0 && ref_counts[slot] < 0xFFFF);
+        ref_counts[slot]++;
+    }
+
+    void DiskArea::free(usize slot) {
+        klib::InterruptLock interrupt_guard;
+        ASSERT(slot < num_pages && ref_counts[slot] > 0);
+        if (--ref_counts[slot] > 0)
+            return;
+
+        set_used(slot, false);
+        num_used--;
+        forget_readahead(slot);
+
+        // a queued page stays until its cluster is written, unless that is never going to happen
+        if (is_broken && is_writing && slot - writing.first_slot < writing.num_pages) {
+            pmm::Page *&queued_page = writing.pages[slot - writing.first_slot];
+            if (queued_page) {
+                pmm::put_page(queued_page);
+                queued_page = nullptr;
+            }
+            set_used(slot, true); // its place in the broken cluster cannot be reused
+        }
+    }
+}
+
+namespace mem {
+    isize syscall_swapon(const char *path, int flags) {
+        log_syscall("swapon(\"%s\", %#X)\n", path, flags);
+        sched::Thread *thread = cpu::get_current_thread();
+        if (!thread->cred.has_capability(CAP_SYS_ADMIN))
+            return -EPERM;
+        if (swap::num_areas == swap::max_areas)
+            return -EPERM;
+
+        vfs::Entry *entry = vfs::path_to_entry(path, thread->process->cwd);
+        if (entry->vnode == nullptr)
+            return -ENOENT;
+        if (entry->vnode->node_type != vfs::NodeType::BLOCK_DEVICE)
+            return -EINVAL; // swap files are not supported
+        auto *block_node = (dev::BlockDevNode*)entry->vnode;
+
+        // the same device can be reached through many paths
+        for (usize i = 0; i < swap::num_areas; i++)
+            if (swap::areas[i]->device == block_node->block_device)
+                return -EBUSY;
+
+        int priority = -2;
+        if (flags & SWAP_FLAG_PREFER)
+            priority = flags & SWAP_FLAG_PRIO_MASK;
+
+        swap::DiskArea *area = swap::DiskArea::create(block_node->block_device, path, priority);
+        if (area == nullptr)
+            return -EINVAL;
+        swap::add_area(area);
+        klib::printf("Swap: Added %s with %lu KiB and priority %d\n", path, area->num_slots * 4, priority);
+        return 0;
+    }
+}
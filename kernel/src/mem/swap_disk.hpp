@@ -0,0 +1,78 @@
+#pragma once
+
+#include <mem/swap.hpp>
+#include <dev/block.hpp>
+
+namespace mem::swap {
+    // the header mkswap writes in the first page of the area, slot n is page n of the area so slot 0 is never used
+    struct [[gnu::packed]] DiskHeader {
+        u8 boot_bits[1024];
+        u32 version;
+        u32 last_page;
+        u32 num_bad_pages;
+        u8 uuid[16];
+        char volume_name[16];
+        u32 padding[117];
+        u32 bad_pages[];
+    };
+
+    constexpr usize disk_signature_offset = 0x1000 - 10; // "SWAPSPACE2"
+    constexpr usize max_bad_pages = (disk_signature_offset - sizeof(DiskHeader)) / sizeof(u32);
+
+    // swap area on a block device
+    // pages are written in clusters of consecutive slots with a single request each, a swap in reads the aligned window of slots around it
+    struct DiskArea final : public Area {
+        static constexpr usize cluster_pages = dev::BlockInterface::max_request_blocks;
+        static constexpr usize readahead_window = 8;
+
+        // reads and checks the header, nullptr if there is no swap area on the device
+        static DiskArea* create(dev::BlockInterface *device, const char *name, int priority);
+
+        isize write(pmm::Page *page) override;
+        isize read(usize slot, pmm::Page *page) override;
+        void dup(usize slot) override;
+        void free(usize slot) override;
+        void flush() override;
+
+    private:
+        struct Cluster {
+            usize first_slot = 0;
+            usize num_pages = 0;
+            pmm::Page *pages[cluster_pages] = {}; // held until they are on the disk
+        };
+
+        usize num_pages; // of the area, including the header and bad pages
+        u64 *used_bitmap;
+        u16 *ref_counts; // ptes holding each slot
+        usize next_slot = 1; // where the search for a free slot starts, so that slots are handed out in order
+
+        Cluster filling; // takes the pages of write
+        Cluster writing; // on its way to the disk, reads of its slots are served from its pages until it is done
+        bool is_writing = false;
+        bool is_broken = false; // a write failed, the pages of writing are kept and nothing more is taken
+
+        pmm::Page *readahead_pages[readahead_window];
+        usize readahead_first_slot = 0;
+        u32 readahead_valid = 0; // slots of the window that hold what is on the disk
+        u32 readahead_stale = 0; // slots written or freed while the window was being read
+        bool is_reading_ahead = false;
+
+        DiskArea(dev::BlockInterface *device, usize num_pages);
+
+        inline bool is_used(usize slot) { return (used_bitmap[slot / 64] >> (slot % 64)) & 1; }
+        inline void set_used(usize slot, bool used) {
+            if (used)
+                used_bitmap[slot / 64] |= (u64)1 << (slot % 64);
+            else
+                used_bitmap[slot / 64] &= ~((u64)1 << (slot % 64));
+        }
+
+        isize alloc_slot();
+        pmm::Page* find_queued_page(usize slot);
+        void forget_readahead(usize slot);
+    };
+}
+
+namespace mem {
+    isize syscall_swapon(const char *path, int flags);
+}
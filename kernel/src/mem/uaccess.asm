@@ -0,0 +1,47 @@
+section .text
+
+; every instruction that may fault on a user pointer gets an entry in __ex_table
+%macro ex_table_entry 2
+section __ex_table progbits alloc noexec nowrite align=8
+    dq %1, %2
+section .text
+%endmacro
+
+; copies rdx bytes from rsi to rdi, returns the number of bytes that were not copied
+; rep movsb leaves the remaining count in rcx when it faults, so the fixup only has to return it
+global __copy_user
+__copy_user:
+    mov rcx, rdx
+.copy:
+    rep movsb
+.done:
+    mov rax, rcx
+    ret
+
+ex_table_entry __copy_user.copy, __copy_user.done
+
+; copies a string of at most rdx bytes from rsi to rdi, returns its length without the null terminator,
+; rdx if there was no terminator or -EFAULT
+global __strncpy_from_user
+__strncpy_from_user:
+    xor eax, eax
+
+.loop:
+    cmp rax, rdx
+    je .done
+.load:
+    mov cl, [rsi + rax]
+    mov [rdi + rax], cl
+    test cl, cl
+    jz .done
+    inc rax
+    jmp .loop
+
+.done:
+    ret
+
+.fault:
+    mov rax, -14 ; EFAULT
+    ret
+
+ex_table_entry __strncpy_from_user.load, __strncpy_from_user.fault
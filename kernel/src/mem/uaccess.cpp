@@ -0,0 +1,14 @@
+#include <mem/uaccess.hpp>
+
+extern "C" const mem::ExceptionTableEntry __ex_table_start[], __ex_table_end[];
+
+namespace mem {
+    bool smap_supported = false;
+
+    uptr find_exception_fixup(uptr rip) {
+        for (const ExceptionTableEntry *entry = __ex_table_start; entry != __ex_table_end; entry++)
+            if (entry->fault_rip == rip)
+                return entry->fixup_rip;
+        return 0;
+    }
+}
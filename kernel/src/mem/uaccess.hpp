@@ -0,0 +1,81 @@
+#pragma once
+
+#include <klib/common.hpp>
+#include <klib/algorithm.hpp>
+#include <mem/vmm.hpp>
+#include <errno.h>
+
+// copies between the kernel and user memory that return -EFAULT on a bad pointer instead of faulting in the kernel
+// the instructions that touch user memory are listed in __ex_table with where to continue when they fault
+namespace mem {
+    struct ExceptionTableEntry {
+        uptr fault_rip;
+        uptr fixup_rip;
+    };
+
+    extern bool smap_supported;
+
+    // where execution continues after a fault at rip that the page fault handler could not resolve, 0 if there is none
+    uptr find_exception_fixup(uptr rip);
+
+    // implemented in uaccess.asm
+    extern "C" usize __copy_user(void *dst, const void *src, usize size); // bytes not copied
+    extern "C" isize __strncpy_from_user(char *dst, const char *src, usize size); // -EFAULT if it faulted
+
+    static inline bool access_ok(const void *user_ptr, usize size) {
+        uptr ptr = (uptr)user_ptr;
+        return ptr <= user_space_end && size <= user_space_end - ptr;
+    }
+
+    // with SMAP stac allows the kernel to touch user pages until the next clac
+    static inline void user_access_begin() {
+        if (smap_supported)
+            asm volatile("stac" ::: "memory", "cc");
+    }
+
+    static inline void user_access_end() {
+        if (smap_supported)
+            asm volatile("clac" ::: "memory", "cc");
+    }
+
+    static inline isize copy_from_user(void *dst, const void *user_src, usize size) {
+        if (!access_ok(user_src, size))
+            return -EFAULT;
+        user_access_begin();
+        usize not_copied = __copy_user(dst, user_src, size);
+        user_access_end();
+        return not_copied ? -EFAULT : 0;
+    }
+
+    static inline isize copy_to_user(void *user_dst, const void *src, usize size) {
+        if (!access_ok(user_dst, size))
+            return -EFAULT;
+        user_access_begin();
+        usize not_copied = __copy_user(user_dst, src, size);
+        user_access_end();
+        return not_copied ? -EFAULT : 0;
+    }
+
+    // copies up to size bytes of a string and its null terminator, returns its length or size if it is longer
+    static inline isize strncpy_from_user(char *dst, const char *user_src, usize size) {
+        if ((uptr)user_src >= user_space_end)
+            return -EFAULT;
+        usize max_size = klib::min(size, user_space_end - (uptr)user_src);
+        user_access_begin();
+        isize ret = __strncpy_from_user(dst, user_src, max_size);
+        user_access_end();
+        if (ret == (isize)max_size && max_size < size)
+            return -EFAULT; // ran into the end of user space
+        return ret;
+    }
+
+    template<typename T>
+    static inline isize get_user(T *dst, const T *user_src) {
+        return copy_from_user(dst, user_src, sizeof(T));
+    }
+
+    template<typename T>
+    static inline isize put_user(T *user_dst, const T &src) {
+        return copy_to_user(user_dst, &src, sizeof(T));
+    }
+}
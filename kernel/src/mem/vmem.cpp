@@ -1,7 +1,9 @@
 #include <mem/vmem.hpp>
+#include <mem/pmm.hpp>
 #include <klib/lock.hpp>
 #include <klib/cstring.hpp>
 #include <klib/cstdio.hpp>
+#include <klib/algorithm.hpp>
 #include <panic.hpp>
 
 namespace mem::vmem {
@@ -18,9 +20,20 @@ namespace mem::vmem {
         num_free_tags += num_static_tags;
     }
 
+    // carves a fresh physical page into tags, called with free_tags_lock held
+    static void refill_free_tags() {
+        pmm::Page *page = pmm::alloc_page();
+        BoundaryTag *tags = page->as<BoundaryTag>();
+        usize num_tags = 0x1000 / sizeof(BoundaryTag);
+        for (usize i = 0; i < num_tags; i++)
+            free_tags_list_head.add_before(&tags[i].tag_list);
+        num_free_tags += num_tags;
+    }
+
     BoundaryTag* allocate_tag() {
         klib::SpinlockGuard guard(free_tags_lock);
-        ASSERT(!free_tags_list_head.is_empty());
+        if (free_tags_list_head.is_empty())
+            refill_free_tags();
         BoundaryTag *tag = LIST_ENTRY(free_tags_list_head.next, BoundaryTag, tag_list);
         tag->tag_list.remove();
         num_free_tags--;
@@ -33,11 +46,10 @@ namespace mem::vmem {
         num_free_tags++;
     }
 
-    // TODO: function to refill free tags list
-
-    void Arena::init(const char *name, usize quantum) {
+    void Arena::init(const char *name, usize quantum, usize qcache_max) {
         klib::strcpy(this->name, name);
         this->quantum = quantum;
+        this->qcache_max = klib::min(qcache_max, quantum * max_qcache_quanta);
 
         tag_list_head.init();
         span_list_head.init();
@@ -48,6 +60,8 @@ namespace mem::vmem {
     }
         
     void Arena::add(uptr base, usize size) {
+        klib::SpinlockGuard guard(lock);
+
         BoundaryTag *previous_span = nullptr;
         LIST_FOR_EACH(previous_span, &span_list_head, list)
             if (previous_span->base >= base)
@@ -79,9 +93,11 @@ namespace mem::vmem {
 
         new_span->tag_list.add(&new_segment->tag_list);
         freelist_insert(new_segment);
+        size_total += size;
     }
 
     uptr Arena::xalloc(usize size) {
+        klib::SpinlockGuard guard(lock);
         ASSERT(size != 0);
         ASSERT(size % quantum == 0);
 
@@ -97,6 +113,7 @@ namespace mem::vmem {
             BoundaryTag *segment = LIST_ENTRY(freelist->next, BoundaryTag, list);
             segment->list.remove();
 
+            size_allocated += size;
             if (segment->size == size) { // perfect match
                 segment->type = BoundaryTag::Type::ALLOCATED;
                 hash_table_insert(segment);
@@ -121,15 +138,9 @@ namespace mem::vmem {
     }
 
     void Arena::xfree(uptr addr, usize size) {
-        klib::ListHead *bucket = hash_bucket_for_addr(addr);
-        BoundaryTag *segment = nullptr;
-        BoundaryTag *tag;
-        LIST_FOR_EACH(tag, bucket, list) {
-            if (tag->base == addr) {
-                segment = tag;
-                break;
-            }
-        }
+        klib::SpinlockGuard guard(lock);
+
+        BoundaryTag *segment = hash_table_find(addr);
         if (!segment)
             panic("No VMem segment at address %#lX", addr);
         
@@ -137,10 +148,11 @@ namespace mem::vmem {
             panic("Mismatched size in VMem free (%#lX given, %#lX actual)", size, segment->size);
         
         segment->list.remove(); // remove from hash table
+        size_allocated -= segment->size;
 
         bool coalesced = false, coalesced_left = false;
 
-        BoundaryTag *left = LIST_ENTRY(segment->tag_list.prev, BoundaryTag, list);
+        BoundaryTag *left = LIST_ENTRY(segment->tag_list.prev, BoundaryTag, tag_list);
         if (left->type == BoundaryTag::Type::FREE) {
             expand_free_segment(left, left->base, left->size + segment->size);
             segment->tag_list.remove();
@@ -151,7 +163,7 @@ namespace mem::vmem {
         }
 
         if (segment->tag_list.next != &tag_list_head) {
-            BoundaryTag *right = LIST_ENTRY(segment->tag_list.next, BoundaryTag, list);
+            BoundaryTag *right = LIST_ENTRY(segment->tag_list.next, BoundaryTag, tag_list);
             if (right->type == BoundaryTag::Type::FREE) {
                 expand_free_segment(right, segment->base, segment->size + right->size);
                 segment->tag_list.remove();
@@ -169,6 +181,39 @@ namespace mem::vmem {
         }
     }
 
+    uptr Arena::alloc(usize size) {
+        ASSERT(size != 0);
+        size = klib::align_up(size, quantum);
+        if (size <= qcache_max) {
+            klib::SpinlockGuard guard(lock);
+            usize index = size / quantum - 1;
+            if (qcache_count[index] > 0)
+                return qcache[index][--qcache_count[index]];
+        }
+        return xalloc(size);
+    }
+
+    // a cached segment stays allocated in the arena, so it is never coalesced with its neighbours until the cache overflows
+    void Arena::free(uptr addr, usize size) {
+        ASSERT(size != 0);
+        size = klib::align_up(size, quantum);
+        if (size <= qcache_max) {
+            klib::SpinlockGuard guard(lock);
+            usize index = size / quantum - 1;
+            if (qcache_count[index] < qcache_depth) {
+                qcache[index][qcache_count[index]++] = addr;
+                return;
+            }
+        }
+        xfree(addr, size);
+    }
+
+    usize Arena::allocated_size(uptr addr) {
+        klib::SpinlockGuard guard(lock);
+        BoundaryTag *segment = hash_table_find(addr);
+        return segment ? segment->size : 0;
+    }
+
     usize Arena::freelist_index_for_size(usize size) {
         return num_freelists - 1 - __builtin_clzl(size);
     }
@@ -195,4 +240,12 @@ namespace mem::vmem {
     void Arena::hash_table_insert(BoundaryTag *segment) {
         hash_bucket_for_addr(segment->base)->add(&segment->list);
     }
+
+    BoundaryTag* Arena::hash_table_find(uptr addr) {
+        BoundaryTag *tag;
+        LIST_FOR_EACH(tag, hash_bucket_for_addr(addr), list)
+            if (tag->base == addr)
+                return tag;
+        return nullptr;
+    }
 }
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <klib/list.hpp>
+#include <klib/lock.hpp>
 
 // incomplete and simplified implementation of the VMem resource allocator
 // https://www.usenix.org/legacy/publications/library/proceedings/usenix01/full_papers/bonwick/bonwick.pdf
@@ -21,9 +22,20 @@ namespace mem::vmem {
     struct Arena {
         static constexpr usize num_freelists = klib::NumericLimits<uptr>::bits;
         static constexpr usize num_hash_buckets = 16;
+        static constexpr usize max_qcache_quanta = 8;
+        static constexpr usize qcache_depth = 16; // segments kept per quantum cache
 
         char name[64]; // identifier for debugging
         usize quantum; // minimum allocation size
+        klib::Spinlock lock;
+        usize size_total = 0; // of every span
+        usize size_allocated = 0; // including the segments sitting in the quantum caches
+
+        // freed segments of 1 to max_qcache_quanta quanta are kept as they are and handed out again by alloc
+        // this is a simplification of the quantum caches in section 4.4 of the paper, they are plain stacks instead of object caches
+        usize qcache_max = 0; // the largest size that goes through the quantum caches, 0 if there are none
+        uptr qcache[max_qcache_quanta][qcache_depth];
+        usize qcache_count[max_qcache_quanta] = {};
 
         klib::ListHead tag_list_head; // lists every tag
         klib::ListHead span_list_head; // lists every span tag
@@ -31,7 +43,7 @@ namespace mem::vmem {
         klib::ListHead hash_table[num_hash_buckets]; // allocated segments are put into this hash table
 
         // no initial span created
-        void init(const char *name, usize quantum);
+        void init(const char *name, usize quantum, usize qcache_max = 0);
 
         // adds a span
         void add(uptr base, usize size);
@@ -41,6 +53,13 @@ namespace mem::vmem {
         // size is actually not necessary, but its used for a sanity check if you provide it
         void xfree(uptr addr, usize size = 0);
 
+        // like xalloc and xfree but small sizes go through the quantum caches, size is rounded up to the quantum, must not be 0 and must be the same for both
+        uptr alloc(usize size);
+        void free(uptr addr, usize size);
+
+        // returns the size of the allocated segment starting at addr, or 0 if there is none
+        usize allocated_size(uptr addr);
+
         static usize freelist_index_for_size(usize size);
 
     private:
@@ -49,6 +68,7 @@ namespace mem::vmem {
 
         klib::ListHead* hash_bucket_for_addr(uptr addr);
         void hash_table_insert(BoundaryTag *segment);
+        BoundaryTag* hash_table_find(uptr addr);
     };
 
     void early_init();
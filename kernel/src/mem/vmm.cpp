@@ -1,5 +1,7 @@
 #include <mem/vmm.hpp>
 #include <mem/pmm.hpp>
+#include <mem/swap.hpp>
+#include <mem/uaccess.hpp>
 #include <panic.hpp>
 #include <klib/cstdio.hpp>
 #include <klib/cstring.hpp>
@@ -14,6 +16,10 @@
 namespace mem {
     VMM *vmm;
     uptr hhdm;
+    VMStats vm_stats;
+    pmm::Page *zero_page;
+    usize fault_around_pages = 16;
+    usize readahead_pages = 64;
 
     void VMM::init(uptr hhdm_base, limine_memmap_response *memmap_res, limine_kernel_address_response *kernel_addr_res) {
         hhdm = hhdm_base;
@@ -28,11 +34,18 @@ namespace mem {
         hhdm_end = klib::align_up(hhdm_end, 0x1000);
         heap_base = hhdm_end;
         heap_size = (usize)12 * 1024 * 1024 * 1024;
-        kernel_virt_alloc_base = heap_base + heap_size;
+        kernel_va_arena.init("kernel-va", 0x1000, kernel_va_qcache_max);
+        kernel_va_arena.add(heap_base + heap_size, kernel_va_size);
 
+        u32 eax, ebx, ecx, edx;
+        gib_pages_supported = cpu::cpuid(0x80000001, 0, &eax, &ebx, &ecx, &edx) && (edx & (1 << 26));
+
+        pagemap_list.init();
         new (&kernel_pagemap) Pagemap();
         memset(kernel_pagemap.pml4, 0, 0x1000);
 
+        u64 map_start_tsc = cpu::MSR::read(cpu::MSR::IA32_TIME_STAMP_COUNTER);
+
         usize kernel_size = 0;
 
         klib::printf("VMM: Physical memory map:\n");
@@ -63,29 +76,47 @@ namespace mem {
 
         kernel_pagemap.map_pages(kernel_phy_base, kernel_virt_base, kernel_size, PAGE_PRESENT | PAGE_WRITABLE | PAGE_GLOBAL);
 
+        // user pagemaps copy the higher half pml4 entries when they are created, so the ones for the heap and kernel va have to exist from the start
+        for (uptr virt = klib::align_down(heap_base, (uptr)1 << 39); virt < heap_base + heap_size + kernel_va_size; virt += (uptr)1 << 39)
+            kernel_pagemap.find_pdpte(virt, true);
+
+        u64 map_cycles = cpu::MSR::read(cpu::MSR::IA32_TIME_STAMP_COUNTER) - map_start_tsc;
+        usize num_pages[3] = {}; // 4 KiB, 2 MiB, 1 GiB
+        kernel_pagemap.for_each_pte(hhdm_base, hhdm_end, [&num_pages] (uptr virt, u64 *entry, usize page_size) {
+            num_pages[page_size == 0x1000 ? 0 : page_size == huge_page_size ? 1 : 2]++;
+        });
+        usize num_table_pages = 0;
+        {
+            pmm::Page *page;
+            LIST_FOR_EACH(page, &kernel_pagemap.page_table_pages_list, link)
+                num_table_pages++;
+        }
+        usize mapped_size = num_pages[0] * 0x1000 + num_pages[1] * huge_page_size + num_pages[2] * gib_page_size;
+        klib::printf("VMM: Direct map | 1 GiB pages: %lu, 2 MiB pages: %lu, 4 KiB pages: %lu (1 GiB pages %s)\n",
+            num_pages[2], num_pages[1], num_pages[0], gib_pages_supported ? "supported" : "not supported");
+        klib::printf("VMM: Kernel page tables | %lu KiB (%lu KiB with only 4 KiB pages), built in %lu cycles\n",
+            num_table_pages * 4, mapped_size / huge_page_size * 4, map_cycles);
+
         new (&kernel_hhdm_range) MappedRange(hhdm_base, hhdm_end - hhdm_base, PAGE_PRESENT | PAGE_WRITABLE | PAGE_GLOBAL, MappedRange::Type::DIRECT);
         kernel_hhdm_range.phy_base = 0;
         new (&kernel_heap_range) MappedRange(heap_base, heap_size, PAGE_PRESENT | PAGE_WRITABLE | PAGE_NO_EXECUTE | PAGE_GLOBAL, MappedRange::Type::ANONYMOUS);
 
-        kernel_pagemap.range_list.add_before(&kernel_hhdm_range.range_link);
-        kernel_pagemap.range_list.add_before(&kernel_heap_range.range_link);
+        kernel_pagemap.insert_range(&kernel_hhdm_range);
+        kernel_pagemap.insert_range(&kernel_heap_range);
         kernel_pagemap.activate();
+
+        zero_page = pmm::alloc_page(); // the reference from alloc_page is never dropped
+        memset(zero_page->as<void>(), 0, 0x1000);
     }
 
     MappedRange::MappedRange(uptr base, usize length, u64 page_flags, Type type) 
-        : base(base), length(length), page_flags(page_flags), type(type)
-    {
-        page_list.init();
-    }
+        : base(base), length(length), page_flags(page_flags), type(type) {}
 
+    // the pages of a range are owned by the ptes that map them, they are released by the pagemap
     MappedRange::~MappedRange() {
         if (!range_link.is_invalid())
             range_link.remove();
 
-        pmm::Page *page;
-        LIST_FOR_EACH_SAFE(page, &page_list, link)
-            pmm::free_page(page);
-
         if (file)
             file->decrement_ref_count();
     }
@@ -94,13 +125,36 @@ namespace mem {
         range_list.init();
         page_table_pages_list.init();
         pml4 = (u64*)(alloc_page_for_page_table() + hhdm);
+
+        if (vmm && this != &vmm->kernel_pagemap) {
+            klib::InterruptLock interrupt_guard;
+            vmm->pagemap_list.add_before(&pagemap_link);
+        }
     }
 
     Pagemap::~Pagemap() {
+        if (!pagemap_link.is_invalid()) {
+            klib::InterruptLock interrupt_guard;
+            if (vmm->reclaim_hand == this)
+                vmm->reclaim_hand = nullptr;
+            pagemap_link.remove();
+        }
         {
             MappedRange *range;
-            LIST_FOR_EACH_SAFE(range, &range_list, range_link)
-                delete range;
+            LIST_FOR_EACH_SAFE(range, &range_list, range_link) {
+                if (range->type != MappedRange::Type::DIRECT) {
+                    for_each_pte(range->base, range->end(), [] (uptr virt, u64 *entry, usize page_size) {
+                        if (pmm::Page *page = pmm::find_page(*entry & 0x000FFFFFFFFFF000 & ~(page_size - 1)))
+                            pmm::put_page(page);
+                    });
+                    if (num_swap_pages > 0) {
+                        for_each_pte<true>(range->base, range->end(), [] (uptr virt, u64 *entry, usize page_size) {
+                            swap::free_entry(*entry);
+                        });
+                    }
+                }
+                delete range; // the tree goes away with the pagemap
+            }
         }
         {
             pmm::Page *page;
@@ -111,14 +165,13 @@ namespace mem {
 
     // returns physical address
     uptr Pagemap::alloc_page_for_page_table() {
-        pmm::Page *new_page = pmm::alloc_page();
+        pmm::Page *new_page = pmm::alloc_zeroed_page();
         page_table_pages_list.add_before(&new_page->link);
         return new_page->pfn * 0x1000;
     }
 
     u64* Pagemap::create_next_page_table(u64 *current_entry) {
         uptr new_page = alloc_page_for_page_table();
-        memset((void*)(new_page + hhdm), 0, 0x1000);
         *current_entry = new_page | PAGE_PRESENT | PAGE_WRITABLE | PAGE_USER;
         return (u64*)(new_page + hhdm);
     }
@@ -128,13 +181,40 @@ namespace mem {
         u64 *entry = find_page_table_entry(virt, true);
         bool replaced = *entry != 0;
         *entry = (phy & 0x000FFFFFFFFFF000) | flags;
-        if (replaced) cpu::invlpg((void*)virt);
+        if (replaced) flush_tlb_page(virt);
     }
 
     void Pagemap::map_pages(uptr phy, uptr virt, usize size, u64 flags) {
-        usize num_pages = klib::align_up(size, 0x1000) / 0x1000;
-        for (usize i = 0; i < num_pages; i++)
-            map_page(phy + (i * 0x1000), virt + (i * 0x1000), flags);
+        klib::SpinlockGuard guard(this->lock);
+        uptr end = virt + klib::align_up(size, 0x1000);
+
+        u64 large_flags = flags | PAGE_HUGE;
+        if (flags & PAGE_ATTRIBUTE_TABLE)
+            large_flags |= PAGE_HUGE_ATTRIBUTE_TABLE;
+
+        while (virt < end) {
+            usize page_size = 0x1000;
+            u64 *entry = nullptr;
+            if (vmm->gib_pages_supported && (virt | phy) % gib_page_size == 0 && end - virt >= gib_page_size) {
+                entry = find_pdpte(virt, true);
+                page_size = gib_page_size;
+            }
+            if ((!entry || *entry) && (virt | phy) % huge_page_size == 0 && end - virt >= huge_page_size) {
+                entry = find_pde(virt, true);
+                page_size = huge_page_size;
+            }
+            if (!entry || *entry) { // already has a page table below it
+                entry = find_page_table_entry(virt, true);
+                page_size = 0x1000;
+            }
+
+            bool replaced = *entry != 0;
+            *entry = (phy & 0x000FFFFFFFFFF000) | (page_size == 0x1000 ? flags : large_flags);
+            if (replaced) flush_tlb_page(virt);
+
+            phy += page_size;
+            virt += page_size;
+        }
     }
 
     void Pagemap::map_kernel() {
@@ -143,14 +223,61 @@ namespace mem {
             pml4[i] = vmm->kernel_pagemap.pml4[i];
     }
 
+    // with pcids the entries of other pagemaps survive the switch, so nothing is flushed unless this pagemap is new or changed while inactive
     void Pagemap::activate() {
-        if (this != vmm->active_pagemap || this == &vmm->kernel_pagemap) {
-            cpu::write_cr3(uptr(pml4) - hhdm);
-            vmm->active_pagemap = this;
+        if (this == vmm->active_pagemap && this != &vmm->kernel_pagemap)
+            return;
+
+        u64 cr3 = uptr(pml4) - hhdm;
+        if (vmm->pcid_enabled && this != &vmm->kernel_pagemap) {
+            bool flush = tlb_flush_pending;
+            if (pcid_generation != vmm->pcid_generation) {
+                if (vmm->next_pcid == num_pcids) {
+                    vmm->reset_pcids();
+                    flush = true;
+                }
+                pcid = vmm->next_pcid++;
+                pcid_generation = vmm->pcid_generation;
+            }
+
+            cr3 |= pcid;
+            if (!flush)
+                cr3 |= (u64)1 << 63; // keep the entries tagged with pcid
+            tlb_flush_pending = false;
         }
+
+        cpu::write_cr3(cr3);
+        vmm->active_pagemap = this;
     }
 
-    u64* Pagemap::find_page_table_entry(uptr virt, bool create_missing) {
+    void Pagemap::flush_tlb_page(uptr virt) {
+        // kernel mappings that ever get unmapped are global, which invlpg flushes no matter the pcid
+        if (this == vmm->active_pagemap || this == &vmm->kernel_pagemap || !vmm->pcid_enabled) {
+            cpu::invlpg((void*)virt);
+            return;
+        }
+        if (pcid_generation != vmm->pcid_generation)
+            return; // gets a fresh pcid on the next activation
+        if (vmm->invpcid_supported)
+            cpu::invpcid(cpu::INVPCID::ADDRESS, pcid, virt);
+        else
+            tlb_flush_pending = true;
+    }
+
+    void Pagemap::flush_tlb() {
+        if (this == vmm->active_pagemap) {
+            cpu::write_cr3(cpu::read_cr3()); // the no flush bit always reads as 0
+            return;
+        }
+        if (!vmm->pcid_enabled || pcid_generation != vmm->pcid_generation)
+            return;
+        if (vmm->invpcid_supported)
+            cpu::invpcid(cpu::INVPCID::SINGLE_CONTEXT, pcid, 0);
+        else
+            tlb_flush_pending = true;
+    }
+
+    u64* Pagemap::find_pdpte(uptr virt, bool create_missing) {
         u64 *current_table = this->pml4;
 
         u64 *current_entry = &current_table[(virt >> 39) & 0x1FF];
@@ -158,12 +285,40 @@ namespace mem {
             current_table = (u64*)((*current_entry & 0x000FFFFFFFFFF000) + hhdm);
         else if (create_missing) current_table = create_next_page_table(current_entry);
         else return nullptr;
-        current_entry = &current_table[(virt >> 30) & 0x1FF];
+
+        return &current_table[(virt >> 30) & 0x1FF];
+    }
+
+    u64* Pagemap::find_pde(uptr virt, bool create_missing) {
+        u64 *current_entry = find_pdpte(virt, create_missing);
+        if (current_entry == nullptr)
+            return nullptr;
+
+        u64 *current_table;
+        if ((*current_entry & PAGE_PRESENT) && (*current_entry & PAGE_HUGE)) {
+            if (!create_missing)
+                return nullptr;
+            split_huge_page(virt, current_entry, gib_page_size);
+        }
         if (*current_entry & PAGE_PRESENT) 
             current_table = (u64*)((*current_entry & 0x000FFFFFFFFFF000) + hhdm);
         else if (create_missing) current_table = create_next_page_table(current_entry);
         else return nullptr;
-        current_entry = &current_table[(virt >> 21) & 0x1FF];
+
+        return &current_table[(virt >> 21) & 0x1FF];
+    }
+
+    u64* Pagemap::find_page_table_entry(uptr virt, bool create_missing) {
+        u64 *current_entry = find_pde(virt, create_missing);
+        if (current_entry == nullptr)
+            return nullptr;
+
+        u64 *current_table;
+        if ((*current_entry & PAGE_PRESENT) && (*current_entry & PAGE_HUGE)) {
+            if (!create_missing)
+                return nullptr;
+            split_huge_page(virt, current_entry);
+        }
         if (*current_entry & PAGE_PRESENT) 
             current_table = (u64*)((*current_entry & 0x000FFFFFFFFFF000) + hhdm);
         else if (create_missing) current_table = create_next_page_table(current_entry);
@@ -172,15 +327,53 @@ namespace mem {
         return &current_table[virt >> 12 & 0x1FF];
     }
 
-    isize Pagemap::get_physical_addr(uptr virt) {
-        u64 *entry = find_page_table_entry(virt);
-        if (entry && (*entry & 0x000FFFFFFFFFF000))
-            return *entry & 0x000FFFFFFFFFF000;
-        else
-            return handle_page_fault(virt);
+    // writes through the hhdm dont set the dirty bit, so it is set here for reclaim to tell modified pages apart
+    isize Pagemap::get_physical_addr(uptr virt, bool write) {
+        for (bool faulted = false; ; faulted = true) {
+            u64 *pde = find_pde(virt);
+            if (pde && (*pde & PAGE_PRESENT) && (*pde & PAGE_HUGE)) {
+                if (!(write && (*pde & PAGE_COW))) {
+                    if (write)
+                        __atomic_or_fetch(pde, PAGE_DIRTY, __ATOMIC_RELAXED);
+                    return (*pde & 0x000FFFFFFFE00000) + (virt & (huge_page_size - 1) & ~(uptr)0xFFF);
+                }
+            } else {
+                u64 *entry = find_page_table_entry(virt);
+                if (entry && (*entry & PAGE_PRESENT) && !(write && (*entry & PAGE_COW))) {
+                    if (write)
+                        __atomic_or_fetch(entry, PAGE_DIRTY, __ATOMIC_RELAXED);
+                    return *entry & 0x000FFFFFFFFFF000;
+                }
+            }
+
+            if (faulted)
+                return -EFAULT;
+            isize phy = handle_page_fault(virt, write);
+            if (phy < 0)
+                return phy;
+        }
     }
 
     isize Pagemap::access_memory(uptr virt, void *target, usize count, bool write) {
+        // the active pagemap can be copied from directly, faulting pages in as it goes
+        // if that faults the page walk below does the rest, so that the result is the same either way
+        usize copied = 0;
+        if (this == vmm->active_pagemap && access_ok((void*)virt, count)) {
+            user_access_begin();
+            usize not_copied = write ? __copy_user((void*)virt, target, count) : __copy_user(target, (void*)virt, count);
+            user_access_end();
+            if (not_copied == 0)
+                return count;
+            copied = count - not_copied;
+        }
+
+        isize ret = access_memory_slow(virt + copied, (u8*)target + copied, count - copied, write);
+        if (ret < 0)
+            return copied ? copied : ret;
+        return copied + ret;
+    }
+
+    isize Pagemap::access_memory_slow(uptr virt, void *target, usize count, bool write) {
         uptr start = virt, end = virt + count;
         uptr start_page_virt = klib::align_down(start, 0x1000);
         uptr end_page_virt = klib::align_down(end, 0x1000);
@@ -201,7 +394,7 @@ namespace mem {
             if (bytes_in_page == 0)
                 return transferred;
 
-            isize page_phy = get_physical_addr(page_virt);
+            isize page_phy = get_physical_addr(page_virt, write);
             if (page_phy == -EFAULT)
                 return transferred ? transferred : -EFAULT;
             page_ptr += page_phy;
@@ -216,46 +409,358 @@ namespace mem {
         return transferred;
     }
 
+    MappedRange* Pagemap::first_range_ending_after(uptr addr) {
+        // ranges never overlap so they are sorted by their end as well as their base
+        MappedRange *found = nullptr;
+        klib::RBNode *node = range_tree.root;
+        while (node) {
+            MappedRange *range = RB_ENTRY(node, MappedRange, range_node);
+            if (range->end() > addr) {
+                found = range;
+                node = node->left;
+            } else {
+                node = node->right;
+            }
+        }
+        return found;
+    }
+
     MappedRange* Pagemap::addr_to_range(uptr virt) {
         if (cached_range_lookup && virt >= cached_range_lookup->base && virt < cached_range_lookup->end())
             return cached_range_lookup;
 
-        MappedRange *range;
-        LIST_FOR_EACH(range, &this->range_list, range_link)
-            if (virt >= range->base && virt < range->end())
-                return cached_range_lookup = range;
+        MappedRange *range = first_range_ending_after(virt);
+        if (range && virt >= range->base)
+            return cached_range_lookup = range;
 
         if (this == &vmm->kernel_pagemap)
             return nullptr;
 
-        LIST_FOR_EACH(range, &vmm->kernel_pagemap.range_list, range_link)
-            if (virt >= range->base && virt < range->end())
-                return cached_range_lookup = range;
+        range = vmm->kernel_pagemap.first_range_ending_after(virt);
+        if (range && virt >= range->base)
+            return cached_range_lookup = range;
 
         return nullptr;
     }
 
+    // first fit from start, walking the holes between the ranges in address order
+    uptr Pagemap::find_hole(uptr start, usize length) {
+        uptr addr = start;
+        MappedRange *range = first_range_ending_after(addr);
+        while (addr + length <= user_space_end) {
+            if (range == nullptr || addr + length <= range->base)
+                return addr;
+            addr = range->end();
+            range = range->range_link.next != &range_list ? LIST_ENTRY(range->range_link.next, MappedRange, range_link) : nullptr;
+        }
+        return 0;
+    }
+
+    uptr Pagemap::find_free_area(uptr hint, usize length) {
+        if (length == 0 || length > user_space_end)
+            return 0;
+
+        hint = klib::align_down(hint, 0x1000);
+        if (hint >= mmap_min_addr && hint + length <= user_space_end) {
+            MappedRange *range = first_range_ending_after(hint);
+            if (range == nullptr || hint + length <= range->base)
+                return hint;
+        }
+
+        uptr start = klib::max(mmap_base, free_area_cache);
+        uptr addr = find_hole(start, length);
+        if (addr == 0 && start != mmap_base)
+            addr = find_hole(mmap_base, length); // there may be a hole below the cache
+        if (addr)
+            free_area_cache = addr + length;
+        return addr;
+    }
+
+    void Pagemap::insert_range(MappedRange *range) {
+        klib::RBNode *parent = nullptr, **link = &range_tree.root;
+        while (*link) {
+            parent = *link;
+            if (range->base < RB_ENTRY(parent, MappedRange, range_node)->base)
+                link = &parent->left;
+            else
+                link = &parent->right;
+        }
+        range_tree.insert(&range->range_node, parent, link);
+
+        if (klib::RBNode *prev = range->range_node.prev())
+            RB_ENTRY(prev, MappedRange, range_node)->range_link.add(&range->range_link);
+        else
+            range_list.add(&range->range_link);
+    }
+
+    // the pages stay mapped, returns the new range holding [at, end)
+    MappedRange* Pagemap::split_range(MappedRange *range, uptr at) {
+        usize offset = at - range->base;
+        MappedRange *upper = new MappedRange(at, range->length - offset, range->page_flags, range->type);
+        if (range->type == MappedRange::Type::DIRECT)
+            upper->phy_base = range->phy_base + offset;
+        if (range->file) {
+            upper->file = range->file;
+            upper->file_offset = range->file_offset + offset;
+            upper->file->increment_ref_count();
+        }
+        upper->advice = range->advice;
+        upper->huge_advice = range->huge_advice;
+        range->length = offset;
+        insert_range(upper);
+        return upper;
+    }
+
+    void Pagemap::delete_range(MappedRange *range) {
+        if (cached_range_lookup == range)
+            cached_range_lookup = nullptr;
+        range_tree.remove(&range->range_node);
+        delete range;
+    }
+
+    // breaks the sharing of a copy on write page, the last pagemap holding it gets to keep it
+    isize Pagemap::handle_cow_fault(uptr page_virt, u64 *entry) {
+        MappedRange *range = addr_to_range(page_virt);
+        if (range == nullptr || !(range->page_flags & PAGE_WRITABLE))
+            return -EFAULT;
+
+        uptr old_phy = *entry & 0x000FFFFFFFFFF000;
+        pmm::Page *old_page = pmm::find_page(old_phy);
+        ASSERT(old_page);
+
+        uptr phy = old_phy;
+        if (__atomic_load_n(&old_page->ref_count, __ATOMIC_ACQUIRE) != 1) {
+            pmm::Page *new_page;
+            if (old_page == zero_page) {
+                new_page = pmm::alloc_zeroed_page();
+                vm_stats.zero_page_copies++;
+            } else {
+                new_page = pmm::alloc_page();
+                memcpy(new_page->as<void>(), old_page->as<void>(), 0x1000);
+            }
+            pmm::put_page(old_page);
+            phy = new_page->phy();
+        }
+
+        *entry = phy | range->page_flags;
+        flush_tlb_page(page_virt);
+        return phy;
+    }
+
+    // replaces a huge page with a table mapping the same memory with pages of the next size down
+    void Pagemap::split_huge_page(uptr virt, u64 *entry, usize page_size) {
+        uptr huge_virt = klib::align_down(virt, page_size);
+        uptr huge_phy = *entry & 0x000FFFFFFFFFF000 & ~(page_size - 1);
+        usize child_size = page_size / 512;
+
+        u64 flags = *entry & (0xFFF | PAGE_NO_EXECUTE | PAGE_HUGE_ATTRIBUTE_TABLE);
+        if (child_size == 0x1000) {
+            flags &= ~(u64)(PAGE_HUGE | PAGE_HUGE_ATTRIBUTE_TABLE);
+            if (*entry & PAGE_HUGE_ATTRIBUTE_TABLE)
+                flags |= PAGE_ATTRIBUTE_TABLE;
+        }
+
+        uptr table_phy = alloc_page_for_page_table();
+        u64 *table = (u64*)(table_phy + hhdm);
+
+        // only 2 MiB pages of user pagemaps own their memory, the kernel ones map the hhdm and the kernel image
+        pmm::Page *block = nullptr;
+        if (page_size == huge_page_size && this != &vmm->kernel_pagemap)
+            block = pmm::find_page(huge_phy);
+
+        if (block && __atomic_load_n(&block->ref_count, __ATOMIC_ACQUIRE) != 1) {
+            // another pagemap still maps the block whole, this one gets copies that stay copy on write until the next write
+            for (usize i = 0; i < 512; i++) {
+                pmm::Page *page = pmm::alloc_page();
+                memcpy(page->as<void>(), (void*)(huge_phy + i * 0x1000 + hhdm), 0x1000);
+                table[i] = page->phy() | flags;
+            }
+            pmm::put_page(block);
+        } else {
+            if (block)
+                pmm::split_block(block);
+            for (usize i = 0; i < 512; i++)
+                table[i] = (huge_phy + i * child_size) | flags;
+        }
+
+        if (block) {
+            num_huge_pages--;
+            num_small_pages += 512;
+        }
+
+        *entry = table_phy | PAGE_PRESENT | PAGE_WRITABLE | PAGE_USER;
+        flush_tlb_page(huge_virt);
+    }
+
+    // backs the whole huge page around virt with one block if it lies within an anonymous user range and nothing in it is mapped yet
+    isize Pagemap::handle_huge_fault(uptr virt, u64 *pde, MappedRange *range) {
+        uptr huge_virt = klib::align_down(virt, huge_page_size);
+        if (range->type != MappedRange::Type::ANONYMOUS || !(range->page_flags & PAGE_USER))
+            return -EFAULT;
+        if (range->huge_advice == MappedRange::HugeAdvice::NEVER)
+            return -EFAULT;
+        if (huge_virt < range->base || huge_virt + huge_page_size > range->end())
+            return -EFAULT;
+
+        pmm::Page *block = pmm::alloc_block(huge_page_order);
+        if (block == nullptr)
+            return -EFAULT; // too fragmented, use small pages
+        memset(block->as<void>(), 0, huge_page_size);
+
+        *pde = block->phy() | range->page_flags | PAGE_HUGE;
+        num_huge_pages++;
+        return block->phy() + (klib::align_down(virt, 0x1000) - huge_virt);
+    }
+
+    isize Pagemap::handle_huge_cow_fault(uptr virt, u64 *pde) {
+        MappedRange *range = addr_to_range(virt);
+        if (range == nullptr || !(range->page_flags & PAGE_WRITABLE))
+            return -EFAULT;
+
+        uptr huge_virt = klib::align_down(virt, huge_page_size);
+        uptr old_phy = *pde & 0x000FFFFFFFE00000;
+        pmm::Page *old_block = pmm::find_page(old_phy);
+        ASSERT(old_block);
+
+        uptr phy = old_phy;
+        if (__atomic_load_n(&old_block->ref_count, __ATOMIC_ACQUIRE) != 1) {
+            pmm::Page *new_block = pmm::alloc_block(huge_page_order);
+            if (new_block == nullptr) {
+                // no block for a private copy, only copy the small page that was written to
+                split_huge_page(virt, pde);
+                return handle_cow_fault(klib::align_down(virt, 0x1000), find_page_table_entry(virt));
+            }
+            memcpy(new_block->as<void>(), old_block->as<void>(), huge_page_size);
+            pmm::put_page(old_block);
+            phy = new_block->phy();
+        }
+
+        *pde = phy | range->page_flags | PAGE_HUGE;
+        flush_tlb_page(huge_virt);
+        return phy + (klib::align_down(virt, 0x1000) - huge_virt);
+    }
+
+    // reads the faulting page together with the unmapped pages around it, or ahead of it if the range is read sequentially
+    // the pages come from a single block when possible so that the whole window is one read
+    isize Pagemap::handle_file_fault(uptr page_virt, u64 *entry, MappedRange *range, bool readahead) {
+        bool sequential = readahead || range->advice == MappedRange::Advice::SEQUENTIAL
+            || (range->advice == MappedRange::Advice::NORMAL && page_virt == range->readahead_next);
+
+        uptr start, end;
+        if (sequential) {
+            start = page_virt;
+            end = page_virt + readahead_pages * 0x1000;
+        } else if (range->advice == MappedRange::Advice::RANDOM) {
+            start = page_virt;
+            end = page_virt + 0x1000;
+        } else {
+            start = page_virt - (page_virt / 0x1000 % fault_around_pages) * 0x1000;
+            end = start + fault_around_pages * 0x1000;
+        }
+
+        // every entry filled has to be in the page table of the faulting one
+        uptr table_base = klib::align_down(page_virt, huge_page_size);
+        start = klib::max(start, klib::max(range->base, table_base));
+        end = klib::min(end, klib::min(range->end(), table_base + huge_page_size));
+        u64 *table = entry - (page_virt - table_base) / 0x1000;
+
+        uptr first = page_virt, last = page_virt + 0x1000;
+        while (first > start && table[(first - 0x1000 - table_base) / 0x1000] == 0)
+            first -= 0x1000;
+        while (last < end && table[(last - table_base) / 0x1000] == 0)
+            last += 0x1000;
+        usize num_pages = (last - first) / 0x1000;
+
+        pmm::Page *block = nullptr;
+        if (num_pages > 1)
+            block = pmm::alloc_block(pmm::order_for_pages(num_pages));
+        if (block) {
+            pmm::split_block(block);
+            for (usize i = num_pages; i < (1ul << pmm::order_for_pages(num_pages)); i++)
+                pmm::put_page(&block[i]);
+        } else {
+            first = page_virt;
+            num_pages = 1;
+            block = pmm::alloc_page();
+        }
+
+        void *ptr = block->as<void>();
+        usize offset = first - range->base + range->file_offset;
+        isize read = range->file->vnode->read(nullptr, ptr, num_pages * 0x1000, offset);
+        if (read < 0)
+            read = 0;
+        memset((u8*)ptr + read, 0, num_pages * 0x1000 - read);
+
+        // pages past the end of the file are only mapped if they were faulted on
+        usize fault_index = (page_virt - first) / 0x1000;
+        usize num_mapped = klib::min(num_pages, klib::max(fault_index + 1, klib::align_up((usize)read, 0x1000) / 0x1000));
+        for (usize i = 0; i < num_pages; i++) {
+            if (i < num_mapped) {
+                block[i].flags |= pmm::page_flag_file;
+                table[(first - table_base) / 0x1000 + i] = block[i].phy() | range->page_flags;
+            } else {
+                pmm::put_page(&block[i]);
+            }
+        }
+        __atomic_add_fetch(&pmm::stats.file_pages, num_mapped, __ATOMIC_RELAXED);
+
+        range->readahead_next = first + num_mapped * 0x1000;
+        num_small_pages += num_mapped;
+        num_file_faults++;
+        num_fault_around_pages += num_mapped - 1;
+        vm_stats.file_faults++;
+        vm_stats.fault_around_pages += num_mapped - 1;
+        return block[fault_index].phy();
+    }
+
     // returns EFAULT if the page fault couldnt be handled
-    isize Pagemap::handle_page_fault(uptr virt) {
+    isize Pagemap::handle_page_fault(uptr virt, bool write) {
         // klib::SpinlockGuard guard(this->lock);
+        num_faults++;
 
         uptr page_virt = klib::align_down(virt, 0x1000);
+        u64 *pde = find_pde(virt, true);
+        if (*pde & PAGE_PRESENT) {
+            if (*pde & PAGE_HUGE) {
+                if (write && (*pde & PAGE_COW))
+                    return handle_huge_cow_fault(virt, pde);
+                return -EFAULT;
+            }
+        } else if (MappedRange *range = addr_to_range(virt); range && (write || range->huge_advice == MappedRange::HugeAdvice::ALWAYS)) {
+            isize phy = handle_huge_fault(virt, pde, range);
+            if (phy >= 0)
+                return phy;
+        }
+
         u64 *entry = find_page_table_entry(virt, true);
 
-        if (!(*entry & PAGE_PRESENT)) {
+        if (*entry & PAGE_PRESENT) {
+            if (write && (*entry & PAGE_COW))
+                return handle_cow_fault(page_virt, entry);
+            return -EFAULT;
+        } else {
             MappedRange *range = addr_to_range(virt);
             if (range == nullptr)
                 return -EFAULT;
 
+            if (is_swap_entry(*entry))
+                return handle_swap_fault(page_virt, entry, range);
+
             switch (range->type) {
             case MappedRange::Type::ANONYMOUS: {
-                pmm::Page *new_page = pmm::alloc_page();
-                new_page->mapped_addr = page_virt;
-                range->page_list.add_before(&new_page->link);
+                if (!write && (range->page_flags & PAGE_USER)) {
+                    // nothing to allocate until the first write, which goes through handle_cow_fault
+                    pmm::get_page(zero_page);
+                    *entry = zero_page->phy() | (range->page_flags & ~(u64)PAGE_WRITABLE) | PAGE_COW;
+                    num_small_pages++;
+                    vm_stats.zero_page_faults++;
+                    return zero_page->phy();
+                }
 
+                pmm::Page *new_page = pmm::alloc_zeroed_page();
                 uptr phy = new_page->pfn * 0x1000;
-                memset((void*)(phy + hhdm), 0, 0x1000);
                 *entry = phy | range->page_flags;
+                num_small_pages++;
                 return phy;
             }
             case MappedRange::Type::DIRECT: {
@@ -263,21 +768,8 @@ namespace mem {
                 *entry = (phy & 0x000FFFFFFFFFF000) | range->page_flags;
                 return phy;
             }
-            case MappedRange::Type::FILE: {
-                pmm::Page *new_page = pmm::alloc_page();
-                new_page->mapped_addr = page_virt;
-                range->page_list.add_before(&new_page->link);
-
-                uptr phy = new_page->pfn * 0x1000;
-                void *ptr = (void*)(phy + hhdm);
-                usize offset = page_virt - range->base + range->file_offset;
-
-                memset(ptr, 0, 0x1000);
-                range->file->vnode->read(nullptr, ptr, 0x1000, offset);
-
-                *entry = phy | range->page_flags;
-                return phy;
-            }
+            case MappedRange::Type::FILE:
+                return handle_file_fault(page_virt, entry, range, false);
             default:
                 klib::printf("Unknown mapped range type: %#lX\n", u64(range->type));
                 return -EFAULT;
@@ -286,82 +778,78 @@ namespace mem {
         return -EFAULT;
     }
     
+    // brings back a page that reclaim swapped out, the slot stays around as long as a forked pagemap holds it too
+    isize Pagemap::handle_swap_fault(uptr page_virt, u64 *entry, MappedRange *range) {
+        u64 swap_entry = *entry;
+        pmm::Page *new_page = pmm::alloc_page();
+        if (isize err = swap::swap_in(swap_entry, new_page); err < 0) {
+            klib::printf("handle_swap_fault: failed to swap in %#lX (%ld)\n", page_virt, err);
+            pmm::put_page(new_page);
+            return err;
+        }
+
+        // reading from a device blocks, another thread may have faulted it in or unmapped it meanwhile
+        if (*entry != swap_entry) {
+            pmm::put_page(new_page);
+            return (*entry & PAGE_PRESENT) ? (isize)(*entry & 0x000FFFFFFFFFF000) : -EFAULT;
+        }
+        range = addr_to_range(page_virt); // mprotect may have replaced it
+        ASSERT(range);
+
+        *entry = new_page->phy() | range->page_flags;
+        swap::free_entry(swap_entry);
+        num_swap_pages--;
+        num_small_pages++;
+        return new_page->phy();
+    }
+
+    // private pages are shared copy on write, both sides lose write access until handle_cow_fault gives them their own copy
     Pagemap* Pagemap::fork() {
         Pagemap *forked = new Pagemap();
 
-        memcpy(forked->pml4, this->pml4, 0x1000);
+        forked->mmap_base = mmap_base;
+        forked->free_area_cache = free_area_cache;
+        forked->brk_base = brk_base;
+        forked->brk = brk;
         for (usize i = 256; i < 512; i++) // higher half
             forked->pml4[i] = this->pml4[i];
 
-        for (usize i = 0; i < 256; i++) { // lower half
-            if (!(this->pml4[i] & PAGE_PRESENT)) {
-                forked->pml4[i] = this->pml4[i];
-                continue;
-            }
-
-            u64 *pml3 = (u64*)((this->pml4[i] & 0x000FFFFFFFFFF000) + hhdm);
-
-            uptr new_page = alloc_page_for_page_table();
-            memset((void*)(new_page + hhdm), 0, 0x1000);
-            forked->pml4[i] = new_page | (pml4[i] & ~0x000FFFFFFFFFF000);
-            u64 *forked_pml3 = (u64*)(new_page + hhdm);
-
-            for (usize i = 0; i < 512; i++) {
-                if (!(pml3[i] & PAGE_PRESENT)) {
-                    forked_pml3[i] = pml3[i];
-                    continue;
-                }
-
-                u64 *pml2 = (u64*)((pml3[i] & 0x000FFFFFFFFFF000) + hhdm);
-
-                uptr new_page = alloc_page_for_page_table();
-                memset((void*)(new_page + hhdm), 0, 0x1000);
-                forked_pml3[i] = new_page | (pml3[i] & ~0x000FFFFFFFFFF000);
-                u64 *forked_pml2 = (u64*)(new_page + hhdm);
-
-                for (usize i = 0; i < 512; i++) {
-                    if (!(pml2[i] & PAGE_PRESENT)) {
-                        forked_pml2[i] = pml2[i];
-                        continue;
-                    }
-
-                    u64 *pml1 = (u64*)((pml2[i] & 0x000FFFFFFFFFF000) + hhdm);
-
-                    uptr new_page = alloc_page_for_page_table();
-                    memset((void*)(new_page + hhdm), 0, 0x1000);
-                    forked_pml2[i] = new_page | (pml2[i] & ~0x000FFFFFFFFFF000);
-                    u64 *forked_pml1 = (u64*)(new_page + hhdm);
-
-                    for (usize i = 0; i < 512; i++)
-                        if (!(pml1[i] & PAGE_PRESENT))
-                            forked_pml1[i] = pml1[i];
-                }
-            }
-        }
-
         MappedRange *old_range;
         LIST_FOR_EACH(old_range, &range_list, range_link) {
-            auto *new_range = forked->add_range(old_range->base, old_range->length, old_range->page_flags, old_range->type, old_range->phy_base, old_range->file, old_range->file_offset, false, false);
-
-            if (new_range->type == MappedRange::Type::ANONYMOUS || new_range->type == MappedRange::Type::FILE) {
-                pmm::Page *old_page;
-                LIST_FOR_EACH(old_page, &old_range->page_list, link) {
-                    pmm::Page *new_page = pmm::alloc_page();
-                    new_page->mapped_addr = old_page->mapped_addr;
-                    new_range->page_list.add_before(&new_page->link);
-
-                    uptr new_phy = new_page->pfn * 0x1000;
-                    uptr old_phy = old_page->pfn * 0x1000;
-
-                    // klib::printf("%#lX\n", old_page->mapped_addr);
-                    forked->map_page(new_phy, new_page->mapped_addr, new_range->page_flags);
-                    memcpy((void*)(new_phy + hhdm), (void*)(old_phy + hhdm), 0x1000);
+            MappedRange *forked_range = forked->add_range(old_range->base, old_range->length, old_range->page_flags, old_range->type, old_range->phy_base, old_range->file, old_range->file_offset, false, false);
+            forked_range->advice = old_range->advice;
+            forked_range->huge_advice = old_range->huge_advice;
+
+            if (old_range->type == MappedRange::Type::DIRECT)
+                continue; // faulted in again on demand
+
+            for_each_pte(old_range->base, old_range->end(), [forked] (uptr virt, u64 *entry, usize page_size) {
+                pmm::Page *page = pmm::find_page(*entry & 0x000FFFFFFFFFF000 & ~(page_size - 1));
+                ASSERT(page);
+                pmm::get_page(page);
+
+                *entry = (*entry & ~(u64)PAGE_WRITABLE) | PAGE_COW;
+                if (page_size == huge_page_size) {
+                    *forked->find_pde(virt, true) = *entry;
+                    forked->num_huge_pages++;
+                } else {
+                    *forked->find_page_table_entry(virt, true) = *entry;
+                    forked->num_small_pages++;
                 }
-            } else {
-                ASSERT(new_range->type == MappedRange::Type::DIRECT);
+            });
+
+            if (num_swap_pages > 0) {
+                for_each_pte<true>(old_range->base, old_range->end(), [forked] (uptr virt, u64 *entry, usize page_size) {
+                    swap::dup_entry(*entry);
+                    *forked->find_page_table_entry(virt, true) = *entry;
+                    forked->num_swap_pages++;
+                });
             }
         }
 
+        // the parent lost write access to its private pages
+        flush_tlb();
+
         return forked;
     }
 
@@ -384,13 +872,13 @@ namespace mem {
         cached_range_lookup = nullptr;
 
         bool had_overlap = false;
-        bool need_to_resolve_overlap = resolve_overlap;
-        while (need_to_resolve_overlap) { // loop until all overlaps are resolved
-            need_to_resolve_overlap = false;
-            MappedRange *existing;
-            LIST_FOR_EACH_SAFE(existing, &this->range_list, range_link) {
-                if (base >= existing->end() || end <= existing->base)
-                    continue; // no overlap
+        if (resolve_overlap) {
+            // only the ranges from the first one ending after base up to end can overlap
+            MappedRange *existing = first_range_ending_after(base);
+            while (existing && existing->base < end) {
+                MappedRange *next = nullptr;
+                if (existing->range_link.next != &range_list)
+                    next = LIST_ENTRY(existing->range_link.next, MappedRange, range_link);
 
                 if (base <= existing->base) {
                     if (end >= existing->end()) {
@@ -399,11 +887,12 @@ namespace mem {
                                 existing->page_flags = page_flags;
                                 invalidate_pages(existing);
                             }
-                            break;
+                            return existing;
                         } else {
-                            delete existing;
+                            delete_range(existing);
                         }
                     } else {
+                        // the start moves up but stays below the base of the next range, so the tree stays sorted
                         usize overlap = end - existing->base;
                         existing->base += overlap;
                         existing->length -= overlap;
@@ -421,28 +910,55 @@ namespace mem {
                         auto *split = add_range(base2, length2, existing->page_flags, existing->type, existing->phy_base, existing->file, existing->file_offset, false, false);
                         if (split)
                             invalidate_pages(split);
+                        next = nullptr; // nothing else can overlap
                     }
                 }
                 had_overlap = true;
-                need_to_resolve_overlap = true;
+                existing = next;
             }
         }
 
+        if (type == MappedRange::Type::NONE) {
+            invalidate_pages(base, length);
+            return nullptr;
+        }
+
         if (merge && type == MappedRange::Type::ANONYMOUS) {
-            MappedRange *existing;
-            LIST_FOR_EACH_SAFE(existing, &this->range_list, range_link) {
-                if (type == existing->type && page_flags == existing->page_flags) {
-                    if (base == existing->end()) {
-                        existing->length += length;
-                    } else if (end == existing->base) {
-                        existing->base -= length;
-                        existing->length += length;
-                    } else {
-                        continue;
+            // after resolving overlaps only the ranges right before and after can be adjacent
+            MappedRange *after = first_range_ending_after(base);
+            MappedRange *before = nullptr;
+            if (after && after->range_link.prev != &range_list)
+                before = LIST_ENTRY(after->range_link.prev, MappedRange, range_link);
+            else if (!after && !range_list.is_empty())
+                before = LIST_TAIL(&range_list, MappedRange, range_link);
+
+            // new ranges have no advice, so only ranges without any can take them in
+            bool merges_before = before && before->type == type && before->page_flags == page_flags && before->end() == base
+                && before->has_default_advice();
+            bool merges_after = after && after->type == type && after->page_flags == page_flags && after->base == end
+                && after->has_default_advice();
+            if (merges_before || merges_after) {
+                MappedRange *merged;
+                if (merges_before) {
+                    merged = before;
+                    merged->length += length;
+                    if (merges_after) {
+                        merged->length += after->length;
+                        delete_range(after);
                     }
-                    // invalidate_pages(existing); // FIXME: unsure if this is necessary
-                    return nullptr;
+                } else {
+                    merged = after;
+                    merged->base -= length; // still above the end of the previous range
+                    merged->length += length;
                 }
+
+                if (had_overlap) {
+                    if (keep_pages)
+                        invalidate_pages(base, length, merged);
+                    else
+                        invalidate_pages(base, length);
+                }
+                return nullptr;
             }
         }
 
@@ -456,29 +972,20 @@ namespace mem {
         assert_consistency();
 #endif
 
-        if (type == MappedRange::Type::NONE) {
-            invalidate_pages(base, length);
-            return nullptr;
-        }
-
         MappedRange *new_range = new MappedRange(base, length, page_flags, type);
         new_range->phy_base = phy_base;
         new_range->file = file;
         new_range->file_offset = file_offset;
         if (new_range->file)
             new_range->file->increment_ref_count();
+        insert_range(new_range);
 
-        MappedRange *previous = nullptr;
-        LIST_FOR_EACH_SAFE(previous, &this->range_list, range_link) {
-            if (&next->range_link == &this->range_list)
-                break;
-            if (next->base > base)
-                break;
+        if (had_overlap) {
+            if (keep_pages)
+                invalidate_pages(new_range); // apply the new flags to the pages that are already there
+            else
+                invalidate_pages(base, length); // the new mapping starts out empty
         }
-        previous->range_link.add(&new_range->range_link);
-
-        if (had_overlap)
-            invalidate_pages(new_range);
         return new_range;
     }
 
@@ -497,45 +1004,449 @@ namespace mem {
         add_range(base, length, page_flags, MappedRange::Type::FILE, 0, file, file_offset);
     }
 
-    void Pagemap::invalidate_page(uptr virt, MappedRange *range) {
-        u64 *entry = find_page_table_entry(virt);
-        if (!entry || !(*entry & PAGE_PRESENT)) return;
-
-        u64 phy = (*entry & 0x000FFFFFFFFFF000);
-        pmm::Page *page = pmm::find_page(phy);
-        if (page->free) // FIXME
-            page = nullptr;
-        if (page)
-            page->link.remove();
+    // moves the ptes of [from, from + length) to [to, to + length), whole page tables and huge pages are moved with their pde if they line up
+    void Pagemap::move_pages(uptr from, uptr to, usize length) {
+        bool moved_table = false;
+        uptr offset = 0;
+        while (offset < length) {
+            uptr src = from + offset, dst = to + offset;
+            u64 *src_pde = find_pde(src);
+            if (src_pde == nullptr || !(*src_pde & PAGE_PRESENT)) {
+                offset = klib::min(length, klib::align_down(src, huge_page_size) + huge_page_size - from);
+                continue;
+            }
+
+            if (src % huge_page_size == 0 && dst % huge_page_size == 0 && length - offset >= huge_page_size) {
+                u64 *dst_pde = find_pde(dst, true);
+                if (*dst_pde == 0) {
+                    *dst_pde = *src_pde;
+                    *src_pde = 0;
+                    if (*dst_pde & PAGE_HUGE)
+                        flush_tlb_page(src);
+                    else
+                        moved_table = true;
+                    offset += huge_page_size;
+                    continue;
+                }
+            }
+
+            if (*src_pde & PAGE_HUGE)
+                split_huge_page(src, src_pde);
+
+            u64 *entry = find_page_table_entry(src);
+            if (entry && *entry != 0) { // swap entries move along with the present ones
+                *find_page_table_entry(dst, true) = *entry;
+                bool was_present = *entry & PAGE_PRESENT;
+                *entry = 0;
+                if (was_present)
+                    flush_tlb_page(src);
+            }
+            offset += 0x1000;
+        }
 
+        if (moved_table)
+            flush_tlb();
+    }
+
+    isize Pagemap::remap(uptr old_base, usize old_length, usize new_length, int flags, uptr new_base) {
+        klib::InterruptLock interrupt_guard;
+
+        MappedRange *range = addr_to_range(old_base);
+        if (range == nullptr || old_base + old_length > range->end())
+            return -EFAULT;
+        if (old_base + new_length > user_space_end && !(flags & MREMAP_MAYMOVE))
+            return -ENOMEM;
+
+        MappedRange::Type type = range->type;
+        u64 page_flags = range->page_flags;
+        uptr phy_base = range->phy_base + (old_base - range->base);
+        vfs::FileDescription *file = range->file;
+        usize file_offset = range->file_offset + (old_base - range->base);
+
+        if (!(flags & MREMAP_FIXED)) {
+            if (new_length <= old_length) {
+                if (new_length < old_length)
+                    add_range(old_base + new_length, old_length - new_length, 0, MappedRange::Type::NONE, 0, nullptr, 0, false, true, false);
+                return old_base;
+            }
+
+            // grow in place if nothing is mapped right after
+            uptr old_end = old_base + old_length, new_end = old_base + new_length;
+            MappedRange *next = first_range_ending_after(old_end);
+            if (new_end <= user_space_end && (next == nullptr || next->base >= new_end)) {
+                add_range(old_end, new_end - old_end, page_flags, type, phy_base + old_length, file, file_offset + old_length);
+                return old_base;
+            }
+
+            if (!(flags & MREMAP_MAYMOVE))
+                return -ENOMEM;
+
+            // keep the new base congruent to the old one modulo a huge page so that whole page tables can be moved
+            usize slack = new_length >= huge_page_size ? huge_page_size : 0;
+            uptr area = find_free_area(0, new_length + slack);
+            if (area == 0)
+                return -ENOMEM;
+            new_base = slack ? area + ((old_base - area) & (slack - 1)) : area;
+        } else {
+            if (new_base % 0x1000 != 0 || new_base + new_length > user_space_end)
+                return -EINVAL;
+            if (new_base < old_base + old_length && old_base < new_base + new_length)
+                return -EINVAL;
+        }
+
+        if (file)
+            file->increment_ref_count(); // the old range may be the last one holding it
+        add_range(new_base, new_length, page_flags, type, phy_base, file, file_offset);
+        move_pages(old_base, new_base, klib::min(old_length, new_length));
+        add_range(old_base, old_length, 0, MappedRange::Type::NONE, 0, nullptr, 0, false, true, false);
+        if (file)
+            file->decrement_ref_count();
+        return new_base;
+    }
+
+    isize Pagemap::set_advice(uptr base, usize length, int advice) {
+        klib::InterruptLock interrupt_guard;
+        uptr end = base + length;
+        isize err = 0;
+
+        uptr covered = base;
+        MappedRange *range = first_range_ending_after(base);
+        while (range && range->base < end) {
+            if (range->base > covered)
+                err = -ENOMEM;
+            if (range->base < base)
+                range = split_range(range, base);
+            if (range->end() > end)
+                split_range(range, end);
+
+            switch (advice) {
+            case MADV_NORMAL: range->advice = MappedRange::Advice::NORMAL; break;
+            case MADV_RANDOM: range->advice = MappedRange::Advice::RANDOM; break;
+            case MADV_SEQUENTIAL: range->advice = MappedRange::Advice::SEQUENTIAL; break;
+            case MADV_HUGEPAGE: range->huge_advice = MappedRange::HugeAdvice::ALWAYS; break;
+            case MADV_NOHUGEPAGE: range->huge_advice = MappedRange::HugeAdvice::NEVER; break;
+            }
+            range->readahead_next = 0;
+            covered = range->end();
+
+            if (range->range_link.next == &range_list)
+                break;
+            range = LIST_ENTRY(range->range_link.next, MappedRange, range_link);
+        }
+
+        if (covered < end)
+            err = -ENOMEM;
+        return err;
+    }
+
+    void Pagemap::prefetch(uptr base, usize length) {
+        uptr end = base + length;
+        uptr virt = base;
+        while (virt < end) {
+            // pages that are only read ahead must not push free memory below the low watermark, the rest is left to faults
+            if (pmm::num_free_pages() < pmm::low_watermark() + readahead_pages)
+                return;
+
+            // interrupts are enabled between the reads, so the range is looked up again each time
+            klib::InterruptLock interrupt_guard;
+            MappedRange *range = first_range_ending_after(virt);
+            if (range == nullptr || range->base >= end)
+                return;
+            virt = klib::max(virt, range->base);
+            if (range->type != MappedRange::Type::FILE) {
+                virt = range->end();
+                continue;
+            }
+
+            u64 *entry = find_page_table_entry(virt, true);
+            if (*entry == 0)
+                handle_file_fault(virt, entry, range, true);
+            virt += 0x1000;
+        }
+    }
+
+    isize Pagemap::lazy_free(uptr base, usize length) {
+        klib::InterruptLock interrupt_guard;
+        uptr end = base + length;
+
+        for (MappedRange *range = first_range_ending_after(base); range && range->base < end; ) {
+            if (range->type != MappedRange::Type::ANONYMOUS)
+                return -EINVAL;
+            if (range->range_link.next == &range_list)
+                break;
+            range = LIST_ENTRY(range->range_link.next, MappedRange, range_link);
+        }
+
+        split_huge_pages_at_edges(base, end);
+
+        // the dirty bit is cleared so that a write before reclaim can be told apart from the data that was given up
+        usize num_marked = 0;
+        for_each_pte(base, end, [this, &num_marked] (uptr virt, u64 *entry, usize page_size) {
+            if (*entry & PAGE_COW)
+                return; // shared with another pagemap or the zero page
+            pmm::Page *page = pmm::find_page(*entry & 0x000FFFFFFFFFF000 & ~(page_size - 1));
+            if (page == nullptr || __atomic_load_n(&page->ref_count, __ATOMIC_ACQUIRE) != 1)
+                return;
+            if (!(*entry & PAGE_LAZYFREE))
+                num_marked += page_size / 0x1000;
+            *entry = (*entry & ~(u64)PAGE_DIRTY) | PAGE_LAZYFREE;
+            flush_tlb_page(virt);
+        });
+
+        num_lazyfree_pages += num_marked;
+        vm_stats.lazyfree_marked += num_marked;
+
+        // swapped out pages are given up right away, they read back as zeroes
+        if (num_swap_pages > 0) {
+            for_each_pte<true>(base, end, [this] (uptr virt, u64 *entry, usize page_size) {
+                swap::free_entry(*entry);
+                *entry = 0;
+                num_swap_pages--;
+            });
+        }
+        return 0;
+    }
+
+    usize Pagemap::reclaim(usize target, uptr *cursor, usize *budget) {
+        usize num_freed = 0;
+        MappedRange *range = first_range_ending_after(*cursor);
+        while (range && num_freed < target && *budget > 0) {
+            if (range->type == MappedRange::Type::ANONYMOUS || range->type == MappedRange::Type::FILE) {
+                // a chunk never goes past a huge page boundary so that huge pages are looked at whole
+                uptr chunk_start = klib::max(*cursor, range->base);
+                uptr chunk_end = klib::min(range->end(), klib::align_down(chunk_start, huge_page_size) + huge_page_size);
+                bool is_file = range->type == MappedRange::Type::FILE;
+                bool can_swap = !is_file && swap::num_areas > 0;
+
+                for_each_pte(chunk_start, chunk_end, [&] (uptr virt, u64 *entry, usize page_size) {
+                    bool lazyfree = *entry & PAGE_LAZYFREE;
+                    if (!lazyfree && (!(is_file || can_swap) || page_size != 0x1000))
+                        return;
+                    vm_stats.pages_scanned++;
+                    bool swap_out = !is_file && !lazyfree; // anonymous data has to be kept, dirty or not
+
+                    pmm::Page *page = pmm::find_page(*entry & 0x000FFFFFFFFFF000 & ~(page_size - 1));
+                    bool shared = (*entry & PAGE_COW) || page == nullptr || __atomic_load_n(&page->ref_count, __ATOMIC_ACQUIRE) != 1;
+                    if (shared || (!swap_out && (*entry & PAGE_DIRTY))) {
+                        if (lazyfree) {
+                            __atomic_and_fetch(entry, ~(u64)PAGE_LAZYFREE, __ATOMIC_RELAXED); // reused, keep it
+                            num_lazyfree_pages -= klib::min(num_lazyfree_pages, page_size / 0x1000);
+                        }
+                        return;
+                    }
+                    if (!lazyfree && (*entry & PAGE_ACCESSED)) {
+                        // second chance, dropped if it is still unused when the hand comes around again
+                        __atomic_and_fetch(entry, ~(u64)PAGE_ACCESSED, __ATOMIC_RELAXED);
+                        flush_tlb_page(virt);
+                        return;
+                    }
+
+                    // the entry is taken away before looking at the bits again, an access that gets in first keeps the page
+                    u64 old = __atomic_exchange_n(entry, 0, __ATOMIC_ACQ_REL);
+                    if ((!swap_out && (old & PAGE_DIRTY)) || (!lazyfree && (old & PAGE_ACCESSED))) {
+                        *entry = old;
+                        return;
+                    }
+                    flush_tlb_page(virt);
+                    if (swap_out) {
+                        u64 swap_entry = swap::swap_out(page);
+                        if (swap_entry == 0) {
+                            *entry = old;
+                            return;
+                        }
+                        *entry = swap_entry;
+                        num_swap_pages++;
+                    }
+                    pmm::put_page(page);
+                    if (page_size == 0x1000)
+                        num_small_pages--;
+                    else
+                        num_huge_pages--;
+
+                    usize num_pages = page_size / 0x1000;
+                    num_freed += num_pages;
+                    if (lazyfree) {
+                        num_lazyfree_pages -= klib::min(num_lazyfree_pages, num_pages);
+                        vm_stats.lazyfree_reclaimed += num_pages;
+                    } else if (is_file) {
+                        vm_stats.file_pages_reclaimed += num_pages;
+                    }
+                });
+
+                *budget -= klib::min(*budget, (chunk_end - chunk_start) / 0x1000);
+                *cursor = chunk_end;
+                if (chunk_end < range->end())
+                    continue;
+            }
+
+            if (range->range_link.next == &range_list) {
+                *cursor = 0; // went past the last range
+                return num_freed;
+            }
+            range = LIST_ENTRY(range->range_link.next, MappedRange, range_link);
+            *cursor = range->base;
+        }
+
+        if (range == nullptr)
+            *cursor = 0;
+        return num_freed;
+    }
+
+    void Pagemap::invalidate_entry(uptr virt, u64 *entry, usize page_size, MappedRange *range) {
+        u64 phy = *entry & 0x000FFFFFFFFFF000 & ~(page_size - 1);
+        u64 huge = page_size != 0x1000 ? PAGE_HUGE : 0;
         if (range) {
             ASSERT(range->page_flags & PAGE_PRESENT);
-            if (!page)
-                page = pmm::alloc_page();
-            page->mapped_addr = virt;
-            range->page_list.add_before(&page->link);
-            *entry = phy | range->page_flags;
+            if (*entry & PAGE_COW) // stays read only until the sharing is broken
+                *entry = phy | (range->page_flags & ~(u64)PAGE_WRITABLE) | PAGE_COW | huge;
+            else
+                *entry = phy | range->page_flags | huge;
         } else {
             *entry = 0;
-            if (page)
-                pmm::free_page(page);
+            if (pmm::Page *page = pmm::find_page(phy)) {
+                pmm::put_page(page);
+                if (huge)
+                    num_huge_pages--;
+                else
+                    num_small_pages--;
+            }
         }
 
-        cpu::invlpg((void*)virt);
+        flush_tlb_page(virt);
+    }
+
+    void Pagemap::invalidate_page(uptr virt, MappedRange *range) {
+        invalidate_pages(virt, 0x1000, range);
+    }
+
+    // huge pages that stick out of either end are split so that only the part inside is affected by what follows
+    void Pagemap::split_huge_pages_at_edges(uptr base, uptr end) {
+        uptr edges[] = { base, end };
+        for (uptr edge : edges) {
+            if (edge % huge_page_size == 0)
+                continue;
+            u64 *pde = find_pde(edge);
+            if (pde && (*pde & PAGE_PRESENT) && (*pde & PAGE_HUGE))
+                split_huge_page(edge, pde);
+        }
     }
 
     void Pagemap::invalidate_pages(uptr base, usize length, MappedRange *range) {
-        usize num_pages = klib::align_up(length, 0x1000) / 0x1000;
-        for (usize i = 0; i < num_pages; i++) {
-            uptr virt = base + (i * 0x1000);
-            invalidate_page(virt, range);
+        uptr end = base + klib::align_up(length, 0x1000);
+        split_huge_pages_at_edges(base, end);
+
+        for_each_pte(base, end, [this, range] (uptr virt, u64 *entry, usize page_size) {
+            invalidate_entry(virt, entry, page_size, range);
+        });
+
+        if (range == nullptr && num_swap_pages > 0) {
+            for_each_pte<true>(base, end, [this] (uptr virt, u64 *entry, usize page_size) {
+                swap::free_entry(*entry);
+                *entry = 0;
+                num_swap_pages--;
+            });
         }
     }
 
+    // toggling global pages flushes every entry of every pcid
+    static void flush_all_tlb_entries() {
+        u64 cr4 = cpu::read_cr4();
+        cpu::write_cr4(cr4 ^ ((u64)1 << 7));
+        cpu::write_cr4(cr4);
+    }
+
+    void VMM::reset_pcids() {
+        pcid_generation++;
+        next_pcid = 1;
+        if (invpcid_supported)
+            cpu::invpcid(cpu::INVPCID::ALL_CONTEXTS, 0, 0);
+        else
+            flush_all_tlb_entries();
+    }
+
     uptr VMM::virt_alloc(usize length) {
-        uptr base = kernel_virt_alloc_base;
-        kernel_virt_alloc_base += klib::align_up(length, 0x1000);
-        return base;
+        return kernel_va_arena.alloc(klib::align_up(length, 0x1000));
+    }
+
+    void VMM::virt_free(uptr base, usize length) {
+        kernel_va_arena.free(base, klib::align_up(length, 0x1000));
+    }
+
+    usize VMM::virt_alloc_size(uptr base) {
+        return kernel_va_arena.allocated_size(base);
+    }
+
+    uptr VMM::map_mmio(uptr phy, usize length, u64 page_flags) {
+        if (length == 0) // an unimplemented bar has no size
+            return 0;
+        usize offset = phy % 0x1000;
+        usize mapped_length = klib::align_up(offset + length, 0x1000);
+        uptr base = virt_alloc(mapped_length);
+        if (base == 0) [[unlikely]]
+            panic("Out of kernel virtual address space for %#lX bytes of mmio", length);
+        // global like the rest of the kernel mappings
+        kernel_pagemap.map_direct(base, mapped_length, page_flags | PAGE_GLOBAL, phy - offset);
+        return base + offset;
+    }
+
+    // kernel mappings are global, invlpg flushes them no matter the pcid
+    void VMM::flush_kernel_tlb(uptr base, usize length) {
+        usize num_pages = klib::align_up(length, 0x1000) / 0x1000;
+        if (num_pages > tlb_flush_ceiling) {
+            flush_all_tlb_entries();
+            return;
+        }
+        for (usize i = 0; i < num_pages; i++)
+            cpu::invlpg((void*)(base + i * 0x1000));
+    }
+
+    void* vmalloc(usize size) {
+        usize length = klib::align_up(size, 0x1000);
+        uptr base = vmm->virt_alloc(length + 0x1000);
+        if (base == 0)
+            return nullptr;
+
+        for (uptr offset = 0; offset < length; offset += 0x1000)
+            vmm->kernel_pagemap.map_page(pmm::alloc_page()->phy(), base + offset, PAGE_PRESENT | PAGE_WRITABLE | PAGE_NO_EXECUTE | PAGE_GLOBAL);
+        __atomic_add_fetch(&vm_stats.vmalloc_pages, length / 0x1000, __ATOMIC_RELAXED);
+        return (void*)base;
+    }
+
+    // the pages are only freed once no tlb can still reach them through the old ptes
+    void VMM::unmap_kernel_pages(uptr base, usize length) {
+        klib::ListHead freed_pages;
+        freed_pages.init();
+        {
+            klib::SpinlockGuard guard(kernel_pagemap.lock);
+            kernel_pagemap.for_each_pte(base, base + length, [&freed_pages] (uptr virt, u64 *entry, usize page_size) {
+                ASSERT(page_size == 0x1000);
+                pmm::Page *page = pmm::find_page(*entry & 0x000FFFFFFFFFF000);
+                ASSERT(page);
+                freed_pages.add_before(&page->link);
+                *entry = 0;
+            });
+            flush_kernel_tlb(base, length);
+        }
+
+        pmm::Page *page;
+        LIST_FOR_EACH_SAFE(page, &freed_pages, link) {
+            page->link.remove();
+            pmm::free_page(page);
+        }
+    }
+
+    void vfree(void *ptr) {
+        if (ptr == nullptr)
+            return;
+        uptr base = (uptr)ptr;
+        usize size = vmm->virt_alloc_size(base);
+        if (size == 0) [[unlikely]]
+            panic("Bad vfree of %#lX", base);
+        usize length = size - 0x1000; // without the guard page
+
+        vmm->unmap_kernel_pages(base, length);
+        __atomic_sub_fetch(&vm_stats.vmalloc_pages, length / 0x1000, __ATOMIC_RELAXED);
+        vmm->virt_free(base, size);
     }
 
     u64 mmap_prot_to_page_flags(int prot) {
@@ -557,11 +1468,13 @@ namespace mem {
         uptr base;
         usize aligned_size = klib::align_up(length, 0x1000);
         if (flags & MAP_FIXED) {
+            if ((uptr)addr % 0x1000 != 0)
+                return -EINVAL;
             base = (uptr)addr;
-            process->mmap_anon_base = klib::align_up(klib::max(process->mmap_anon_base, base + aligned_size), 0x1000);
         } else {
-            base = process->mmap_anon_base;
-            process->mmap_anon_base += aligned_size;
+            base = process->pagemap->find_free_area((uptr)addr, aligned_size);
+            if (base == 0)
+                return -ENOMEM;
         }
 
         if (flags & MAP_ANONYMOUS) {
@@ -594,8 +1507,8 @@ namespace mem {
 
         process->pagemap->add_range((uptr)addr, length, 0, MappedRange::Type::NONE, 0, nullptr, 0, false, true, false);
 
-        if (process->mmap_anon_base == (uptr)addr + length)
-            process->mmap_anon_base = (uptr)addr;
+        if ((uptr)addr < process->pagemap->free_area_cache)
+            process->pagemap->free_area_cache = (uptr)addr;
         return 0;
     }
 
@@ -635,6 +1548,47 @@ namespace mem {
         return 0;
     }
 
+    isize syscall_mremap(void *old_address, usize old_size, usize new_size, int flags, void *new_address) {
+        log_syscall("mremap(%#lX, %#lX, %#lX, %d, %#lX)\n", (uptr)old_address, old_size, new_size, flags, (uptr)new_address);
+        sched::Process *process = cpu::get_current_thread()->process;
+
+        if ((uptr)old_address % 0x1000 != 0 || new_size == 0)
+            return -EINVAL;
+        if (flags & ~(MREMAP_MAYMOVE | MREMAP_FIXED))
+            return -EINVAL;
+        if ((flags & MREMAP_FIXED) && !(flags & MREMAP_MAYMOVE))
+            return -EINVAL;
+        if (old_size == 0)
+            return -EINVAL; // duplicating shared mappings is not supported
+
+        return process->pagemap->remap((uptr)old_address, klib::align_up(old_size, 0x1000), klib::align_up(new_size, 0x1000), flags, (uptr)new_address);
+    }
+
+    isize syscall_brk(void *addr) {
+        log_syscall("brk(%#lX)\n", (uptr)addr);
+        Pagemap *pagemap = cpu::get_current_thread()->process->pagemap;
+
+        klib::InterruptLock interrupt_guard;
+
+        // failures are reported by returning the old break
+        if ((uptr)addr < pagemap->brk_base || (uptr)addr > user_space_end)
+            return pagemap->brk;
+
+        uptr old_end = klib::align_up(pagemap->brk, 0x1000);
+        uptr new_end = klib::align_up((uptr)addr, 0x1000);
+        if (new_end > old_end) {
+            MappedRange *next = pagemap->first_range_ending_after(old_end);
+            if (next && next->base < new_end)
+                return pagemap->brk;
+            pagemap->map_anonymous(old_end, new_end - old_end, PAGE_PRESENT | PAGE_USER | PAGE_WRITABLE | PAGE_NO_EXECUTE); // merges into the heap range
+        } else if (new_end < old_end) {
+            pagemap->add_range(new_end, old_end - new_end, 0, MappedRange::Type::NONE, 0, nullptr, 0, false, true, false); // frees the tail pages
+        }
+
+        pagemap->brk = (uptr)addr;
+        return pagemap->brk;
+    }
+
     isize syscall_madvise(void *addr, usize length, int advice) {
         log_syscall("madvise(%#lX, %#lX, %d)\n", (uptr)addr, length, advice);
         sched::Process *process = cpu::get_current_thread()->process;
@@ -643,23 +1597,28 @@ namespace mem {
             return -EINVAL;
         length = klib::align_up(length, 0x1000);
 
+        // reads one window at a time and takes the interrupt lock itself
+        if (advice == MADV_WILLNEED) {
+            process->pagemap->prefetch((uptr)addr, length);
+            return 0;
+        }
+
         klib::InterruptLock interrupt_guard;
 
         switch (advice) {
         case MADV_NORMAL:
         case MADV_RANDOM:
         case MADV_SEQUENTIAL:
-        case MADV_WILLNEED:
+        case MADV_HUGEPAGE:
+        case MADV_NOHUGEPAGE:
+            return process->pagemap->set_advice((uptr)addr, length, advice);
         case MADV_DONTDUMP:
         case MADV_DODUMP:
             return 0; // these operations are safe to ignore
-        case MADV_FREE: // FIXME: not actually equivalent
+        case MADV_FREE:
+            return process->pagemap->lazy_free((uptr)addr, length);
         case MADV_DONTNEED: {
-            usize num_pages = length / 0x1000;
-            for (usize i = 0; i < num_pages; i++) {
-                uptr page = (uptr)addr + i * 0x1000;
-                process->pagemap->invalidate_page(page);
-            }
+            process->pagemap->invalidate_pages((uptr)addr, length);
         } return 0;
         default:
             klib::printf("madvise: unsupported advice %d\n", advice);
@@ -6,6 +6,7 @@
 #include <klib/common.hpp>
 #include <klib/lock.hpp>
 #include <klib/list.hpp>
+#include <klib/rbtree.hpp>
 #include <klib/cstdio.hpp>
 #include <limine.hpp>
 
@@ -17,11 +18,32 @@
 #define PAGE_ACCESSED (1 << 5)
 #define PAGE_DIRTY (1 << 6)
 #define PAGE_ATTRIBUTE_TABLE (1 << 7)
+#define PAGE_HUGE (1 << 7) // in a pde or pdpte, maps a 2 MiB or 1 GiB page instead of pointing to the next table
 #define PAGE_GLOBAL (1 << 8)
+#define PAGE_COW (1 << 9) // available to software, set on private pages shared with another pagemap after fork
+#define PAGE_LAZYFREE (1 << 10) // available to software, set by MADV_FREE, the page can be dropped under memory pressure unless it is dirtied again
+#define PAGE_HUGE_ATTRIBUTE_TABLE (1 << 12) // where the pat bit goes in a pde or pdpte
 #define PAGE_WRITE_COMBINING (PAGE_ATTRIBUTE_TABLE | PAGE_CACHE_DISABLE)
 #define PAGE_NO_EXECUTE ((u64)1 << 63)
 
 namespace mem {
+    constexpr usize huge_page_size = 0x200000;
+    constexpr usize huge_page_order = 9; // buddy order of the block backing a huge page
+    constexpr usize gib_page_size = 0x40000000;
+    constexpr u16 num_pcids = 4096; // pcid 0 belongs to the kernel pagemap
+    constexpr uptr mmap_min_addr = 0x10000; // lowest address an mmap hint is honoured at
+    constexpr uptr user_space_end = 0x7FFFFFFFF000;
+    constexpr usize max_fault_around_pages = 512; // a fault only ever fills entries of its own page table
+    constexpr usize kernel_va_size = (usize)64 * 1024 * 1024 * 1024; // after the heap, for mmio mappings and vmalloc
+    constexpr usize kernel_va_qcache_max = 0x8000; // kernel va allocations up to this size are cached for reuse
+    constexpr usize tlb_flush_ceiling = 33; // flushing more kernel pages than this one by one is slower than flushing everything
+
+    // a pte that is not present but not zero either holds a swap entry, the swap area and the slot in it that has the page
+    inline u64 make_swap_entry(usize area, usize slot) { return (slot << 12) | (area << 2) | (1 << 1); }
+    inline bool is_swap_entry(u64 entry) { return entry != 0 && !(entry & PAGE_PRESENT); }
+    inline usize swap_entry_area(u64 entry) { return (entry >> 2) & 0x3FF; }
+    inline usize swap_entry_slot(u64 entry) { return entry >> 12; }
+
     struct Pagemap;
 
     struct MappedRange {
@@ -33,13 +55,31 @@ namespace mem {
         };
 
         klib::ListHead range_link;
-        klib::ListHead page_list;
+        klib::RBNode range_node; // range_tree of the pagemap, keyed by base
 
         uptr base;
         usize length;
         u64 page_flags;
         Type type;
 
+        // access pattern hint from madvise
+        enum class Advice : u8 {
+            NORMAL,
+            RANDOM, // only the faulting page is read
+            SEQUENTIAL // faults read ahead instead of around
+        };
+        Advice advice = Advice::NORMAL;
+        uptr readahead_next = 0; // a fault here continues a sequential stream of faults
+
+        enum class HugeAdvice : u8 {
+            DEFAULT, // write faults of anonymous ranges try huge pages
+            ALWAYS, // read faults too
+            NEVER
+        };
+        HugeAdvice huge_advice = HugeAdvice::DEFAULT;
+
+        inline bool has_default_advice() { return advice == Advice::NORMAL && huge_advice == HugeAdvice::DEFAULT; }
+
         // used for direct mapping
         uptr phy_base = 0;
 
@@ -75,42 +115,133 @@ namespace mem {
     };
 
     struct Pagemap {
+        klib::ListHead pagemap_link; // pagemap_list of the vmm, not linked for the kernel pagemap
         u64 *pml4;
         klib::Spinlock lock;
         klib::ListHead page_table_pages_list;
-        klib::ListHead range_list;
+        klib::ListHead range_list; // sorted by base
+        klib::RBTree range_tree; // the same ranges as range_list, for lookups
         MappedRange *cached_range_lookup = nullptr; // cache for addr_to_range
+        u32 ref_count = 1; // processes using this pagemap, a vfork child borrows the pagemap of its parent
+        usize num_small_pages = 0; // resident pages of non direct ranges
+        usize num_huge_pages = 0; // resident 2 MiB pages of anonymous ranges
+        usize num_swap_pages = 0; // ptes holding swap entries
+        u16 pcid = 0; // only valid while pcid_generation matches the one of the vmm
+        u64 pcid_generation = 0;
+        bool tlb_flush_pending = false; // the tlb may hold stale entries tagged with pcid
+        uptr mmap_base = 0; // mmap without a usable hint searches for a hole above this
+        uptr free_area_cache = 0; // where the next search starts, everything between mmap_base and here is likely taken
+        uptr brk_base = 0; // end of the executable, the heap of brk grows up from here as a single anonymous range
+        uptr brk = 0;
+        usize num_faults = 0; // page faults taken, including the ones that read a file
+        usize num_file_faults = 0; // faults that had to read a file
+        usize num_fault_around_pages = 0; // pages mapped by file faults in addition to the faulting one
+        usize num_lazyfree_pages = 0; // pages marked by MADV_FREE since the last reclaim scan, some may have been reused or unmapped since
 
         Pagemap();
         ~Pagemap();
 
+        inline void get() { __atomic_add_fetch(&ref_count, 1, __ATOMIC_RELAXED); }
+        inline void put() {
+            if (__atomic_sub_fetch(&ref_count, 1, __ATOMIC_ACQ_REL) == 0)
+                delete this;
+        }
+
         void activate();
-        u64* find_page_table_entry(uptr virt, bool create_missing = false);
-        isize get_physical_addr(uptr virt);
+        void flush_tlb_page(uptr virt);
+        void flush_tlb();
+        u64* find_pdpte(uptr virt, bool create_missing = false);
+        u64* find_pde(uptr virt, bool create_missing = false); // splits a 1 GiB page in the way if create_missing
+        u64* find_page_table_entry(uptr virt, bool create_missing = false); // splits a huge page in the way if create_missing
+        isize get_physical_addr(uptr virt, bool write = false);
         isize access_memory(uptr virt, void *target, usize count, bool write);
+        isize access_memory_slow(uptr virt, void *target, usize count, bool write); // one page at a time through get_physical_addr
 
         void map_page(uptr phy, uptr virt, u64 flags);
-        void map_pages(uptr phy, uptr virt, usize size, u64 flags);
+        void map_pages(uptr phy, uptr virt, usize size, u64 flags); // uses the largest pages that fit
         void map_kernel(); // for user pagemaps
 
         void map_anonymous(uptr base, usize length, u64 page_flags);
         void map_direct(uptr base, usize length, u64 page_flags, uptr phy_base);
         void map_file(uptr base, usize length, u64 page_flags, vfs::FileDescription *file, usize file_offset);
 
+        // resizes the part of a single range at old_base, moving its ptes instead of the data if it cant grow in place
+        // takes MREMAP_* flags, returns the new base or an errno
+        isize remap(uptr old_base, usize old_length, usize new_length, int flags, uptr new_base);
+
         MappedRange* add_range(uptr base, usize length, u64 page_flags, MappedRange::Type type, uptr phy_base, vfs::FileDescription *file,
             usize file_offset, bool merge = true, bool resolve_overlap = true, bool keep_pages = false);
 
-        void invalidate_page(uptr virt, MappedRange *range = nullptr); // frees page if range is nullptr
-        void invalidate_pages(uptr base, usize length, MappedRange *range = nullptr); // frees pages if range is nullptr
+        // reapplies the flags of range, or unmaps and drops the reference to the page if range is nullptr
+        void invalidate_page(uptr virt, MappedRange *range = nullptr);
+        void invalidate_pages(uptr base, usize length, MappedRange *range = nullptr);
         void invalidate_pages(MappedRange *range) { return invalidate_pages(range->base, range->length, range); }
 
+        // applies an MADV_* hint to every range in [base, base + length), splitting the ones that stick out
+        // returns ENOMEM if part of it is not mapped
+        isize set_advice(uptr base, usize length, int advice);
+
+        // marks the private anonymous pages in [base, base + length) to be dropped under memory pressure, see MADV_FREE
+        isize lazy_free(uptr base, usize length);
+
+        // advances the clock hand at *cursor over the ranges, dropping clean pages that can be brought back, see mem::reclaim
+        // accessed file pages get a second chance, lazily freed anonymous pages go as soon as they are found clean
+        // stops once target pages are freed or *budget pages were looked at, *cursor is 0 once the hand went past the last range
+        usize reclaim(usize target, uptr *cursor, usize *budget);
+
+        // reads the unmapped pages of the file ranges in [base, base + length) ahead of their first access
+        // one readahead window at a time with interrupts enabled in between, stops once free memory nears the low watermark
+        void prefetch(uptr base, usize length);
+
         MappedRange* addr_to_range(uptr virt);
-        isize handle_page_fault(uptr virt);
+        MappedRange* first_range_ending_after(uptr addr); // only searches this pagemap
+
+        // returns the base of an unmapped area of length bytes, hint if it is free, or 0 if there is no hole big enough
+        uptr find_free_area(uptr hint, usize length);
+        isize handle_page_fault(uptr virt, bool write = false);
 
         Pagemap* fork();
 
         void assert_consistency();
 
+        // calls f(virt, entry, page_size) for every present pte in [base, end), skipping over missing page tables
+        // a huge page is passed as its pde with the virt of its start, even if it only partially overlaps [base, end)
+        // with swap_entries, it visits the ptes holding swap entries instead, which are always 4 KiB
+        template<bool swap_entries = false, typename F>
+        void for_each_pte(uptr base, uptr end, F f) {
+            uptr virt = base;
+            while (virt < end) {
+                u64 *table = pml4;
+                usize skip_size = 0;
+                for (usize shift = 39; shift > 12; shift -= 9) {
+                    u64 *entry = &table[(virt >> shift) & 0x1FF];
+                    if (!(*entry & PAGE_PRESENT)) {
+                        skip_size = (u64)1 << shift;
+                        break;
+                    }
+                    if (*entry & PAGE_HUGE) {
+                        skip_size = (u64)1 << shift;
+                        if (!swap_entries)
+                            f(virt & ~(skip_size - 1), entry, skip_size);
+                        break;
+                    }
+                    table = (u64*)((*entry & 0x000FFFFFFFFFF000) + hhdm);
+                }
+
+                if (skip_size) {
+                    uptr next = (virt & ~(skip_size - 1)) + skip_size;
+                    if (next <= virt) // wrapped around
+                        return;
+                    virt = next;
+                    continue;
+                }
+
+                for (usize i = (virt >> 12) & 0x1FF; i < 512 && virt < end; i++, virt += 0x1000)
+                    if (swap_entries ? is_swap_entry(table[i]) : (table[i] & PAGE_PRESENT))
+                        f(virt, &table[i], (usize)0x1000);
+            }
+        }
+
         template<klib::Putchar Put>
         void print(Put put) {
             MappedRange *range;
@@ -121,6 +252,21 @@ namespace mem {
     private:
         uptr alloc_page_for_page_table();
         u64* create_next_page_table(u64 *current_entry);
+        void invalidate_entry(uptr virt, u64 *entry, usize page_size, MappedRange *range);
+        isize handle_cow_fault(uptr page_virt, u64 *entry);
+        isize handle_huge_fault(uptr virt, u64 *pde, MappedRange *range);
+        isize handle_huge_cow_fault(uptr virt, u64 *pde);
+        isize handle_file_fault(uptr page_virt, u64 *entry, MappedRange *range, bool readahead);
+        isize handle_swap_fault(uptr page_virt, u64 *entry, MappedRange *range);
+        void split_huge_page(uptr virt, u64 *entry, usize page_size = huge_page_size);
+        void split_huge_pages_at_edges(uptr base, uptr end);
+        uptr find_hole(uptr start, usize length);
+        void move_pages(uptr from, uptr to, usize length);
+        void insert_range(MappedRange *range);
+        MappedRange* split_range(MappedRange *range, uptr at);
+        void delete_range(MappedRange *range);
+
+        friend struct VMM;
     };
 
     struct VMM {
@@ -129,22 +275,68 @@ namespace mem {
 
         Pagemap kernel_pagemap;
         Pagemap *active_pagemap = nullptr;
+        bool gib_pages_supported = false;
+        bool pcid_enabled = false;
+        bool invpcid_supported = false;
+        u16 next_pcid = 1;
+        u64 pcid_generation = 1;
+        klib::ListHead pagemap_list; // every user pagemap
+        Pagemap *reclaim_hand = nullptr; // where the clock of reclaim is, nullptr to start over at the first pagemap
+        uptr reclaim_hand_virt = 0;
 
         void init(uptr hhdm_base, limine_memmap_response *memmap_res, limine_kernel_address_response *kernel_addr_res);
 
+        // kernel virtual address space that is not backed by anything yet, 0 if there is none left
         uptr virt_alloc(usize length);
+        void virt_free(uptr base, usize length);
+        usize virt_alloc_size(uptr base);
+
+        // maps length bytes of mmio at phy into kernel virtual address space, phy does not need to be page aligned
+        // returns 0 if length is 0
+        uptr map_mmio(uptr phy, usize length, u64 page_flags);
+
+        // invalidates the kernel mappings in [base, base + length) on this cpu, global ones included
+        void flush_kernel_tlb(uptr base, usize length);
+        // clears the 4 KiB ptes of pages mapped with map_page in [base, base + length) and frees the pages
+        void unmap_kernel_pages(uptr base, usize length);
+
+        // starts handing out pcids from the beginning again, flushing every entry tagged with one
+        void reset_pcids();
 
     private:
         uptr hhdm_end;
         uptr kernel_phy_base;
         uptr kernel_virt_base;
-        uptr kernel_virt_alloc_base;
+        vmem::Arena kernel_va_arena;
         MappedRange kernel_hhdm_range;
         MappedRange kernel_heap_range;
     };
 
+    struct VMStats {
+        usize zero_page_faults = 0; // anonymous read faults that mapped the zero page
+        usize zero_page_copies = 0; // writes that replaced the zero page with a page of their own
+        usize file_faults = 0;
+        usize fault_around_pages = 0; // pages mapped by file faults in addition to the faulting one
+        usize lazyfree_marked = 0; // pages marked by MADV_FREE
+        usize lazyfree_reclaimed = 0; // marked pages that were dropped while still clean
+        usize pages_scanned = 0; // ptes looked at by reclaim
+        usize file_pages_reclaimed = 0;
+        usize vmalloc_pages = 0; // pages backing vmalloc allocations
+    };
+
     extern VMM *vmm;
     extern uptr hhdm;
+    extern VMStats vm_stats;
+    extern pmm::Page *zero_page; // mapped copy on write by anonymous read faults, never freed
+
+    // tunable through /proc/sys/vm
+    extern usize fault_around_pages; // window of pages around a file fault that are read with it, 1 disables fault around
+    extern usize readahead_pages; // pages read ahead of a fault in a file range that is accessed sequentially
+
+    // virtually contiguous kernel memory backed by separate pages that are mapped up front, followed by an unmapped guard page
+    // the contents are not zeroed, nullptr if there is no kernel virtual address space left
+    void* vmalloc(usize size);
+    void vfree(void *ptr);
 
     u64 mmap_prot_to_page_flags(int prot);
 
@@ -153,4 +345,6 @@ namespace mem {
     isize syscall_mprotect(void *addr, usize length, int prot);
     isize syscall_mincore(void *addr, usize length, u8 *vec);
     isize syscall_madvise(void *addr, usize length, int advice);
+    isize syscall_mremap(void *old_address, usize old_size, usize new_size, int flags, void *new_address);
+    isize syscall_brk(void *addr);
 }
@@ -0,0 +1,202 @@
+#include <mem/zram.hpp>
+#include <mem/vmm.hpp>
+#include <klib/cstring.hpp>
+#include <klib/cstdio.hpp>
+#include <klib/lock.hpp>
+#include <errno.h>
+
+namespace mem::zram {
+    Device *device = nullptr;
+
+    Device::Device(usize num_slots, usize max_pool_pages) : max_pool_pages(max_pool_pages) {
+        name = "/dev/zram0";
+        type = "partition";
+        priority = 100;
+        this->num_slots = num_slots;
+        slots = (Slot*)vmalloc(num_slots * sizeof(Slot));
+        zspages = (Zspage*)vmalloc(max_pool_pages * sizeof(Zspage));
+        ASSERT(slots && zspages);
+        free_zspages.init();
+
+        for (usize i = 0; i < num_size_classes; i++) {
+            SizeClass *size_class = &classes[i];
+            size_class->object_size = (i + 1) * size_class_step;
+            usize least_waste = ~(usize)0;
+            for (usize order = 0; order <= max_zspage_order; order++) {
+                // compared as if the biggest zspage was split into zspages of this order
+                usize waste = ((0x1000ul << order) % size_class->object_size) << (max_zspage_order - order);
+                if (waste < least_waste) {
+                    least_waste = waste;
+                    size_class->order = order;
+                }
+            }
+            size_class->objects_per_zspage = (0x1000ul << size_class->order) / size_class->object_size;
+            size_class->partial_list.init();
+            size_class->full_list.init();
+        }
+    }
+
+    Zspage* Device::alloc_object(usize size_class_index, u16 *index) {
+        SizeClass *size_class = &classes[size_class_index];
+        if (size_class->partial_list.is_empty()) {
+            if (stats.pool_pages + (1ul << size_class->order) > max_pool_pages) {
+                stats.pool_limit_hits++;
+                return nullptr;
+            }
+            pmm::Page *block = pmm::alloc_block(size_class->order);
+            if (block == nullptr)
+                return nullptr;
+
+            Zspage *zspage;
+            if (!free_zspages.is_empty()) {
+                zspage = LIST_HEAD(&free_zspages, Zspage, link);
+                zspage->link.remove();
+            } else {
+                ASSERT(num_zspages_touched < max_pool_pages);
+                zspage = &zspages[num_zspages_touched++];
+            }
+            zspage->block = block;
+            zspage->size_class = size_class_index;
+            zspage->num_used = 0;
+            zspage->num_fresh = size_class->objects_per_zspage;
+            zspage->freelist = no_object;
+            size_class->partial_list.add(&zspage->link);
+            stats.pool_pages += 1ul << size_class->order;
+        }
+
+        Zspage *zspage = LIST_HEAD(&size_class->partial_list, Zspage, link);
+        if (zspage->freelist != no_object) {
+            *index = zspage->freelist;
+            memcpy(&zspage->freelist, object_ptr(zspage, *index), sizeof(u16));
+        } else {
+            *index = size_class->objects_per_zspage - zspage->num_fresh;
+            zspage->num_fresh--;
+        }
+
+        zspage->num_used++;
+        if (zspage->num_used == size_class->objects_per_zspage) {
+            zspage->link.remove();
+            size_class->full_list.add(&zspage->link);
+        }
+        return zspage;
+    }
+
+    void Device::free_object(Zspage *zspage, u16 index) {
+        SizeClass *size_class = &classes[zspage->size_class];
+        memcpy(object_ptr(zspage, index), &zspage->freelist, sizeof(u16));
+        zspage->freelist = index;
+
+        if (zspage->num_used == size_class->objects_per_zspage) {
+            zspage->link.remove();
+            size_class->partial_list.add(&zspage->link);
+        }
+        zspage->num_used--;
+
+        if (zspage->num_used == 0) {
+            zspage->link.remove();
+            pmm::free_block(zspage->block);
+            stats.pool_pages -= 1ul << size_class->order;
+            free_zspages.add(&zspage->link);
+        }
+    }
+
+    isize Device::write(pmm::Page *page) {
+        klib::InterruptLock interrupt_guard;
+
+        if (free_slot == no_slot && num_slots_touched == num_slots)
+            return -ENOSPC;
+
+        const u64 *words = page->as<u64>();
+        bool is_zero = true;
+        for (usize i = 0; i < 0x1000 / sizeof(u64); i++) {
+            if (words[i] != 0) {
+                is_zero = false;
+                break;
+            }
+        }
+
+        Zspage *zspage = nullptr;
+        u16 index = 0;
+        usize length = 0;
+        if (!is_zero) {
+            length = klib::lz4::compress(page->as<void>(), 0x1000, buffer, max_object_size, hash_table);
+            if (length == 0) {
+                stats.incompressible_pages++;
+                return -ENOSPC;
+            }
+            zspage = alloc_object((length + size_class_step - 1) / size_class_step - 1, &index);
+            if (zspage == nullptr)
+                return -ENOSPC;
+            memcpy(object_ptr(zspage, index), buffer, length);
+        }
+
+        usize slot_index;
+        if (free_slot != no_slot) {
+            slot_index = free_slot;
+            free_slot = slots[slot_index].next_free;
+        } else {
+            slot_index = num_slots_touched++;
+        }
+
+        Slot *slot = &slots[slot_index];
+        slot->zspage = zspage;
+        slot->index = index;
+        slot->length = length;
+        slot->ref_count = 1;
+
+        num_used++;
+        stats.pages_stored++;
+        stats.compressed_bytes += length;
+        if (is_zero)
+            stats.zero_pages++;
+        return slot_index;
+    }
+
+    isize Device::read(usize slot_index, pmm::Page *page) {
+        klib::InterruptLock interrupt_guard;
+        Slot *slot = &slots[slot_index];
+        ASSERT(slot->ref_count > 0);
+
+        if (slot->length == 0) {
+            memset(page->as<void>(), 0, 0x1000);
+            return 0;
+        }
+        if (klib::lz4::decompress(object_ptr(slot->zspage, slot->index), slot->length, page->as<void>(), 0x1000) != 0x1000)
+            return -EIO;
+        return 0;
+    }
+
+    void Device::dup(usize slot_index) {
+        klib::InterruptLock interrupt_guard;
+        Slot *slot = &slots[slot_index];
+        ASSERT(slot->ref_count > 0);
+        slot->ref_count++;
+    }
+
+    void Device::free(usize slot_index) {
+        klib::InterruptLock interrupt_guard;
+        Slot *slot = &slots[slot_index];
+        ASSERT(slot->ref_count > 0);
+        if (--slot->ref_count > 0)
+            return;
+
+        if (slot->length == 0)
+            stats.zero_pages--;
+        else
+            free_object(slot->zspage, slot->index);
+        stats.pages_stored--;
+        stats.compressed_bytes -= slot->length;
+        num_used--;
+
+        slot->next_free = free_slot;
+        free_slot = slot_index;
+    }
+
+    void init() {
+        // like the usual zram setup, room for half of memory that may take up to a quarter of it once compressed
+        usize total_pages = pmm::stats.total_pages_usable;
+        device = new Device(total_pages / 2, total_pages / 4);
+        swap::add_area(device);
+        klib::printf("zram: %lu KiB device, pool limited to %lu KiB\n", device->num_slots * 4, device->max_pool_pages * 4);
+    }
+}
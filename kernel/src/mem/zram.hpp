@@ -0,0 +1,92 @@
+#pragma once
+
+#include <mem/swap.hpp>
+#include <klib/list.hpp>
+#include <klib/lz4.hpp>
+
+// swap area that keeps pages lz4 compressed in memory, see https://docs.kernel.org/admin-guide/blockdev/zram.html
+// compressed pages are packed into zspages, blocks of up to 4 pages holding objects of a single size class, like zsmalloc
+// objects can straddle the pages of a zspage since the block is contiguous in the hhdm
+namespace mem::zram {
+    constexpr usize size_class_step = 64;
+    constexpr usize max_object_size = 3072; // pages that dont compress below this are left to the next swap area
+    constexpr usize num_size_classes = max_object_size / size_class_step;
+    constexpr usize max_zspage_order = 2;
+    constexpr u16 no_object = 0xFFFF;
+
+    struct Zspage {
+        klib::ListHead link; // partial_list or full_list of its size class, free_zspages while unused
+        pmm::Page *block;
+        u16 size_class;
+        u16 num_used;
+        u16 num_fresh; // objects at the end that were never handed out
+        u16 freelist; // linked through the first u16 of each free object
+    };
+
+    struct SizeClass {
+        usize object_size;
+        usize order; // of the blocks of its zspages, the one that wastes the least space
+        usize objects_per_zspage;
+        klib::ListHead partial_list, full_list;
+    };
+
+    struct Slot {
+        union {
+            Zspage *zspage; // nullptr for a page of zeroes
+            usize next_free; // while the slot is free
+        };
+        u16 index; // of the object in the zspage
+        u16 length; // compressed length, 0 for a page of zeroes
+        u32 ref_count; // ptes holding the slot, 0 if it is free
+    };
+    static_assert(sizeof(Slot) == 16);
+
+    struct Stats {
+        usize pages_stored = 0;
+        usize zero_pages = 0; // stored without any memory
+        usize compressed_bytes = 0; // of the pages stored
+        usize pool_pages = 0; // held by zspages
+        usize incompressible_pages = 0; // refused for not compressing below max_object_size
+        usize pool_limit_hits = 0; // refused because the pool reached max_pool_pages
+    };
+
+    struct Device final : public swap::Area {
+        Stats stats;
+        usize max_pool_pages;
+
+        Device(usize num_slots, usize max_pool_pages);
+
+        isize write(pmm::Page *page) override;
+        isize read(usize slot, pmm::Page *page) override;
+        void dup(usize slot) override;
+        void free(usize slot) override;
+
+    private:
+        static constexpr usize no_slot = ~(usize)0;
+
+        SizeClass classes[num_size_classes];
+
+        // both tables are allocated up front, writes happen during reclaim when memory is already short
+        Slot *slots; // num_slots of them
+        usize num_slots_touched = 0; // slots past this were never handed out
+        usize free_slot = no_slot; // head of the free slots, linked through Slot::next_free
+        Zspage *zspages; // max_pool_pages of them, every zspage holds at least one page
+        usize num_zspages_touched = 0;
+        klib::ListHead free_zspages;
+
+        u16 hash_table[4096];
+        u8 buffer[max_object_size];
+
+        inline u8* object_ptr(Zspage *zspage, u16 index) {
+            return zspage->block->as<u8>() + index * classes[zspage->size_class].object_size;
+        }
+
+        Zspage* alloc_object(usize size_class, u16 *index);
+        void free_object(Zspage *zspage, u16 index);
+    };
+
+    extern Device *device;
+
+    // sizes the device after the memory there is and adds it as a swap area
+    void init();
+}
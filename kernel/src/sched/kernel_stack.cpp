@@ -0,0 +1,75 @@
+#include <sched/kernel_stack.hpp>
+#include <mem/vmm.hpp>
+#include <mem/pmm.hpp>
+#include <cpu/cpu.hpp>
+#include <klib/lock.hpp>
+#include <panic.hpp>
+
+namespace sched {
+    KernelStackStats kernel_stack_stats;
+
+    KernelStackPool* create_kernel_stack_pool() {
+        return new KernelStackPool();
+    }
+
+    uptr alloc_kernel_stack() {
+        {
+            klib::InterruptLock interrupt_guard;
+            kernel_stack_stats.num_stacks++;
+            KernelStackPool *pool = cpu::get_current_cpu()->kernel_stack_pool;
+            if (pool && pool->num_stacks > 0) {
+                kernel_stack_stats.pool_hits++;
+                return pool->stacks[--pool->num_stacks];
+            }
+            kernel_stack_stats.pool_misses++;
+            kernel_stack_stats.num_mapped++;
+        }
+
+        uptr base = mem::vmm->virt_alloc(kernel_stack_guard_size + kernel_stack_size);
+        if (base == 0) [[unlikely]]
+            panic("Out of kernel virtual address space for kernel stacks");
+
+        uptr bottom = base + kernel_stack_guard_size;
+        for (uptr offset = 0; offset < kernel_stack_size; offset += 0x1000)
+            mem::vmm->kernel_pagemap.map_page(pmm::alloc_page()->phy(), bottom + offset, PAGE_PRESENT | PAGE_WRITABLE | PAGE_NO_EXECUTE | PAGE_GLOBAL);
+        return bottom + kernel_stack_size;
+    }
+
+    // the dirty bits start over for the next thread, only the pages that were touched need their tlb entries flushed
+    static void reset_high_water(uptr top) {
+        for (uptr virt = top - kernel_stack_size; virt < top; virt += 0x1000) {
+            u64 *entry = mem::vmm->kernel_pagemap.find_page_table_entry(virt);
+            if (*entry & (PAGE_ACCESSED | PAGE_DIRTY)) {
+                *entry &= ~(u64)(PAGE_ACCESSED | PAGE_DIRTY);
+                cpu::invlpg((void*)virt);
+            }
+        }
+    }
+
+    void free_kernel_stack(uptr top) {
+        {
+            klib::InterruptLock interrupt_guard;
+            kernel_stack_stats.num_stacks--;
+            KernelStackPool *pool = cpu::get_current_cpu()->kernel_stack_pool;
+            if (pool && pool->num_stacks < kernel_stack_pool_size) {
+                reset_high_water(top);
+                pool->stacks[pool->num_stacks++] = top;
+                return;
+            }
+            kernel_stack_stats.num_mapped--;
+        }
+
+        uptr bottom = top - kernel_stack_size;
+        mem::vmm->unmap_kernel_pages(bottom, kernel_stack_size);
+        mem::vmm->virt_free(bottom - kernel_stack_guard_size, kernel_stack_guard_size + kernel_stack_size);
+    }
+
+    usize kernel_stack_high_water(uptr top) {
+        for (uptr virt = top - kernel_stack_size; virt < top; virt += 0x1000) {
+            u64 *entry = mem::vmm->kernel_pagemap.find_page_table_entry(virt);
+            if (entry && (*entry & PAGE_DIRTY))
+                return top - virt;
+        }
+        return 0;
+    }
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <klib/common.hpp>
+
+// kernel stacks live in kernel virtual address space with an unmapped guard page below each of them, so an overflow faults instead of running into whatever is next
+// freed stacks go to a small pool on the cpu that frees them and are handed out again as they are, without being cleared
+namespace sched {
+    constexpr usize kernel_stack_size = 64 * 1024;
+    constexpr usize kernel_stack_guard_size = 0x1000;
+    constexpr usize kernel_stack_pool_size = 16; // free stacks kept per cpu, the rest are unmapped
+
+    // only touched by its own cpu with interrupts disabled
+    struct KernelStackPool {
+        uptr stacks[kernel_stack_pool_size]; // tops of the free stacks
+        usize num_stacks = 0;
+    };
+
+    struct KernelStackStats {
+        usize num_stacks = 0; // handed out and not freed yet
+        usize num_mapped = 0; // including the ones in pools
+        usize pool_hits = 0;
+        usize pool_misses = 0;
+    };
+
+    extern KernelStackStats kernel_stack_stats;
+
+    KernelStackPool* create_kernel_stack_pool();
+
+    // returns the top of a stack of kernel_stack_size bytes
+    uptr alloc_kernel_stack();
+    void free_kernel_stack(uptr top);
+
+    // how deep the stack has been written to since it was handed out, from the dirty bits of its ptes so only to the page
+    usize kernel_stack_high_water(uptr top);
+}
@@ -23,7 +23,6 @@
 
 namespace sched {
     constexpr usize sched_freq = 200; // Hz
-    constexpr usize kernel_stack_size = 64 * 1024;
     constexpr usize user_stack_size = 8 * 1024 * 1024;
     constexpr usize user_binary_base = 0x560000000000;
     constexpr usize user_linker_base = 0x7e0000000000;
@@ -97,6 +96,8 @@ namespace sched {
         clear_listeners();
         if (extended_state)
             klib::free(extended_state);
+        if (stack_top)
+            free_kernel_stack(stack_top);
         procfs_dir->remove();
     }
 
@@ -125,6 +126,30 @@ namespace sched {
         procfs_dir->remove();
     }
 
+    Process* find_largest_process() {
+        klib::InterruptLock guard;
+        Process *largest = nullptr;
+        usize largest_rss = 0;
+        auto &thread_table = get_thread_table();
+        for (usize i = 0; i < thread_table.size(); i++) {
+            Thread *thread = thread_table[i];
+            if (thread == nullptr || thread->tid != thread->process->pid)
+                continue;
+            Process *process = thread->process;
+            if (process == kernel_process || process == init_process || process->is_zombie || process->pagemap == nullptr)
+                continue;
+            if (process->vfork_parent_thread)
+                continue; // the pagemap belongs to the parent
+
+            usize rss = process->pagemap->num_small_pages + process->pagemap->num_huge_pages * (mem::huge_page_size / 0x1000);
+            if (rss > largest_rss) {
+                largest = process;
+                largest_rss = rss;
+            }
+        }
+        return largest;
+    }
+
     Thread* Thread::get_from_tid(int tid) {
         auto &thread_table = get_thread_table();
         if (tid <= 0 || tid >= (int)thread_table.size())
@@ -204,13 +229,25 @@ namespace sched {
             if (file_descriptors[i].get_description() != nullptr)
                 file_descriptors[i].close(this, i);
 
-        delete pagemap;
+        release_vfork_parent();
+        pagemap->put();
         pagemap = nullptr;
 
         zombie_event.trigger();
         parent->send_signal(SIGCHLD);
     }
 
+    // wakes up the thread that called vfork, its pagemap now only belongs to it again
+    void Process::release_vfork_parent() {
+        klib::InterruptLock interrupt_guard;
+        Thread *parent_thread = vfork_parent_thread;
+        if (parent_thread == nullptr)
+            return;
+        vfork_parent_thread = nullptr;
+        parent_thread->vfork_child = nullptr;
+        enqueue_thread(parent_thread);
+    }
+
     // FIXME: send to any thread that has the signal unblocked
     void Process::send_signal(int signal) {
         return get_main_thread()->send_signal(signal);
@@ -234,9 +271,8 @@ namespace sched {
     Thread* new_kernel_thread(void (*func)(), bool enqueue, const char *name) {
         Thread *thread = new Thread(kernel_process, allocate_tid());
 
-        void *kernel_stack = klib::malloc(kernel_stack_size);
-        memset(kernel_stack, 0, kernel_stack_size);
-        thread->user_stack = (uptr)kernel_stack + kernel_stack_size;
+        thread->stack_top = alloc_kernel_stack();
+        thread->user_stack = thread->stack_top;
         thread->saved_user_stack = thread->user_stack;
 
         thread->running_on = 0;
@@ -260,9 +296,8 @@ namespace sched {
 
     void Thread::init_user(uptr entry, uptr new_stack) {
         if (!kernel_stack) {
-            void *new_kernel_stack = klib::malloc(kernel_stack_size);
-            memset(new_kernel_stack, 0, kernel_stack_size);
-            kernel_stack = (uptr)new_kernel_stack + kernel_stack_size;
+            stack_top = alloc_kernel_stack();
+            kernel_stack = stack_top;
             saved_kernel_stack = kernel_stack;
         }
 
@@ -323,11 +358,9 @@ namespace sched {
 
         isize err = 0;
         auto *old_pagemap = process->pagemap;
-        auto old_mmap_anon_base = process->mmap_anon_base;
         defer {
             if (err < 0 && process->pid != 1) {
                 process->pagemap = old_pagemap;
-                process->mmap_anon_base = old_mmap_anon_base;
                 old_pagemap->activate();
                 klib::strncpy(thread->name, old_name, sizeof(thread->name));
             }
@@ -336,7 +369,7 @@ namespace sched {
         process->pagemap = new mem::Pagemap();
         memset(process->pagemap->pml4, 0, 0x1000);
         process->pagemap->map_kernel();
-        process->mmap_anon_base = 0;
+        uptr image_end = 0, ld_image_end = 0;
 
         process->pagemap->activate();
 
@@ -348,7 +381,7 @@ namespace sched {
         char *interpreter_arg = nullptr;
         defer { if (interpreter_arg) delete[] interpreter_arg; };
 
-        if (err = elf::load(process->pagemap, executable->vnode, user_binary_base, &ld_path, &auxv, &process->mmap_anon_base); err < 0) {
+        if (err = elf::load(process->pagemap, executable->vnode, user_binary_base, &ld_path, &auxv, &image_end); err < 0) {
             // parse shebang
             char buf[256] = {};
             executable->vnode->read(nullptr, buf, sizeof(buf), 0);
@@ -393,7 +426,7 @@ namespace sched {
             if (entry->vnode->node_type != vfs::NodeType::REGULAR) return err = -EACCES;
             executable = entry;
 
-            if (err = elf::load(process->pagemap, executable->vnode, user_binary_base, &ld_path, &auxv, &process->mmap_anon_base); err < 0)
+            if (err = elf::load(process->pagemap, executable->vnode, user_binary_base, &ld_path, &auxv, &image_end); err < 0)
                 return err;
         }
 
@@ -409,19 +442,19 @@ namespace sched {
                 ld_file = entry->vnode;
             }
 
-            if (err = elf::load(process->pagemap, ld_file, user_linker_base, nullptr, &ld_auxv, &process->mmap_anon_base); err < 0) {
+            if (err = elf::load(process->pagemap, ld_file, user_linker_base, nullptr, &ld_auxv, &ld_image_end); err < 0) {
                 if (err == -ENOEXEC)
                     err = -ELIBBAD;
                 return err;
             }
         }
 
-        process->mmap_anon_base = user_mmap_base;
-
-        process->pagemap->map_anonymous(process->mmap_anon_base, user_stack_size, PAGE_PRESENT | PAGE_USER | PAGE_WRITABLE | PAGE_NO_EXECUTE);
-        process->mmap_anon_base += user_stack_size;
-        thread->user_stack = process->mmap_anon_base;
-        process->mmap_anon_base += 0x10000; // guard
+        process->pagemap->map_anonymous(user_mmap_base, user_stack_size, PAGE_PRESENT | PAGE_USER | PAGE_WRITABLE | PAGE_NO_EXECUTE);
+        thread->user_stack = user_mmap_base + user_stack_size;
+        process->pagemap->mmap_base = thread->user_stack + 0x10000; // guard
+        process->pagemap->free_area_cache = process->pagemap->mmap_base;
+        process->pagemap->brk_base = image_end;
+        process->pagemap->brk = image_end;
 
         process->exe = executable;
 
@@ -539,7 +572,8 @@ namespace sched {
 
         process->has_performed_execve = true;
 
-        delete old_pagemap;
+        process->release_vfork_parent();
+        old_pagemap->put();
 
         return 0;
     }
@@ -558,9 +592,8 @@ namespace sched {
         Thread *thread = new Thread(init_process, init_process->pid);
 
         if (!thread->kernel_stack) {
-            void *kernel_stack = klib::malloc(kernel_stack_size);
-            memset(kernel_stack, 0, kernel_stack_size);
-            thread->kernel_stack = (uptr)kernel_stack + kernel_stack_size;
+            thread->stack_top = alloc_kernel_stack();
+            thread->kernel_stack = thread->stack_top;
             thread->saved_kernel_stack = thread->kernel_stack;
         }
 
@@ -597,9 +630,11 @@ namespace sched {
         kernel_process = new Process();
         kernel_process->pagemap = &mem::vmm->kernel_pagemap;
 
+        // the idle thread only runs when nothing else can, so it finishes the page structs left out at boot and then zeroes pages ahead of the faults that need them
         idle_thread = new_kernel_thread([] {
             while (true)
-                asm volatile("hlt");
+                if (!pmm::init_deferred_pages() && !pmm::fill_zeroed_pool())
+                    asm volatile("hlt");
         }, false, "Idle thread");
         idle_thread->state = Thread::READY;
     }
@@ -644,6 +679,11 @@ namespace sched {
             thread->sched_link.remove();
         thread->state = Thread::ZOMBIE;
 
+        if (thread->vfork_child) {
+            thread->vfork_child->vfork_parent_thread = nullptr;
+            thread->vfork_child = nullptr;
+        }
+
         thread->process->num_living_threads--;
         if (thread->process->num_living_threads == 0) {
             thread->process->zombify(terminate_signal);
@@ -809,10 +849,12 @@ namespace sched {
         usize flags = clone_args->flags;
         if ((flags & CLONE_SIGHAND) && (flags & CLONE_CLEAR_SIGHAND))
             return -EINVAL;
-        if ((flags & CLONE_VM) && (flags & CLONE_VFORK)) {
-            klib::printf("clone: vfork is implemented as fork which may be incorrect\n");
-            flags &= ~(CLONE_VM | CLONE_VFORK);
-        }
+
+        // the vfork child either borrows the pagemap (CLONE_VM) or gets a copy of it, the parent sleeps until the child execs or exits
+        bool is_vfork = flags & CLONE_VFORK;
+        bool borrows_pagemap = is_vfork && (flags & CLONE_VM);
+        if (is_vfork)
+            flags &= ~(borrows_pagemap ? CLONE_VM | CLONE_VFORK : CLONE_VFORK);
 
         bool is_spawning_thread = false;
         if (flags & thread_clone_flags) {
@@ -868,9 +910,8 @@ namespace sched {
             new_thread->saved_user_stack = cpu->user_stack;
         }
 
-        void *kernel_stack = klib::malloc(kernel_stack_size);
-        memset(kernel_stack, 0, kernel_stack_size);
-        new_thread->kernel_stack = (uptr)kernel_stack + kernel_stack_size;
+        new_thread->stack_top = alloc_kernel_stack();
+        new_thread->kernel_stack = new_thread->stack_top;
         new_thread->saved_kernel_stack = new_thread->kernel_stack;
 
         new_thread->signal_mask = old_thread->signal_mask;
@@ -879,8 +920,12 @@ namespace sched {
         new_thread->cred = old_thread->cred;
 
         if (new_process) {
-            new_process->pagemap = old_process->pagemap->fork();
-            new_process->mmap_anon_base = old_process->mmap_anon_base;
+            if (borrows_pagemap) {
+                new_process->pagemap = old_process->pagemap;
+                new_process->pagemap->get();
+            } else {
+                new_process->pagemap = old_process->pagemap->fork();
+            }
 
             new_process->exe = old_process->exe;
             new_process->cwd = old_process->cwd;
@@ -922,6 +967,17 @@ namespace sched {
         new_thread->state = Thread::READY;
         sched_list_head.add_before(&new_thread->sched_link);
 
+        if (is_vfork && new_process) {
+            new_process->vfork_parent_thread = old_thread;
+            old_thread->vfork_child = new_process;
+
+            // signals are left pending until the child is done with our stack
+            while (old_thread->vfork_child) {
+                dequeue_thread(old_thread);
+                yield();
+            }
+        }
+
         return new_thread->tid;
     }
 
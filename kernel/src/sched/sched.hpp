@@ -9,6 +9,7 @@
 #include <sched/event.hpp>
 #include <sched/context.hpp>
 #include <sched/time.hpp>
+#include <sched/kernel_stack.hpp>
 #include <userland/signal.hpp>
 #include <userland/cred.hpp>
 #include <cpu/syscall/syscall.hpp>
@@ -32,6 +33,7 @@ namespace sched {
         uptr kernel_stack;
         uptr saved_user_stack;
         uptr saved_kernel_stack;
+        uptr stack_top = 0; // of the stack from alloc_kernel_stack, kernel_stack or the stack a kernel thread runs on, freed with the thread
         usize running_on;
         cpu::syscall::SyscallState *syscall_state = nullptr; // only valid while inside a syscall
 
@@ -60,6 +62,9 @@ namespace sched {
         // userspace ptrs, see set_tid_address(2)
         uptr set_child_tid = 0, clear_child_tid = 0;
 
+        Process *vfork_child = nullptr; // set while this thread is suspended in vfork
+        bool reclaiming = false; // kswapd or in direct reclaim, the allocations made there must not reclaim again
+
         enum State {
             READY,
             RUNNING,
@@ -129,7 +134,7 @@ namespace sched {
         mode_t umask = S_IWGRP | S_IWOTH;
         bool dumpable = true;
 
-        uptr mmap_anon_base = 0; // used for mmap bump allocator
+        Thread *vfork_parent_thread = nullptr; // set while this process runs on the borrowed pagemap of its parent
         uptr arg_start = 0, arg_end = 0;
         uptr env_start = 0, env_end = 0;
 
@@ -163,6 +168,7 @@ namespace sched {
         int allocate_fdnum(int min_fdnum = 0);
         void set_parent(Process *new_parent);
         void zombify(int terminate_signal);
+        void release_vfork_parent();
         void send_signal(int signal);
 
         void print_file_descriptors();
@@ -186,6 +192,9 @@ namespace sched {
 
     void debug_print_threads();
 
+    // the user process with the most resident memory, for the oom killer
+    Process* find_largest_process();
+
     [[noreturn]] void syscall_exit(int status);
     [[noreturn]] void syscall_exit_group(int status);
     isize syscall_fork();
@@ -19,6 +19,12 @@ namespace sched::timer::hpet {
         return regs.read<u64>(MAIN_COUNTER) * (period / 1'000'000) / 1'000;
     }
 
+    u64 monotonic_time_ns() {
+        // split the counter so that counter * period cant overflow
+        u64 counter = regs.read<u64>(MAIN_COUNTER);
+        return (counter / 1'000'000) * period + (counter % 1'000'000) * period / 1'000'000;
+    }
+
     void stall_ns(usize ns) {
         usize fs = ns * 1'000'000; // convert to femtoseconds
         usize target = regs.read<u64>(MAIN_COUNTER) + (fs / period);
@@ -8,6 +8,7 @@ namespace sched::timer::hpet {
     bool is_initialized();
 
     u64 monotonic_time_µs();
+    u64 monotonic_time_ns();
 
     void stall_ns(usize ns);
     inline void stall_µs(usize µs) { stall_ns(µs * 1'000); }
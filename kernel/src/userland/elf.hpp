@@ -41,6 +41,6 @@ namespace elf {
         u64 at_phnum;
     };
 
-    // first_free_virt will hold the first virtual address that is free (used for anon mmap)
+    // first_free_virt will hold the first virtual address after the loaded image (used for brk)
     isize load(mem::Pagemap *pagemap, vfs::VNode *file, uptr load_base, char **ld_path, Auxval *auxv, uptr *first_free_virt);
 }
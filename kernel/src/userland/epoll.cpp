@@ -4,6 +4,7 @@
 #include <sched/sched.hpp>
 #include <sched/time.hpp>
 #include <klib/cstdio.hpp>
+#include <mem/uaccess.hpp>
 
 namespace userland {
     EPoll::EPoll() : key_to_events_index(16) {
@@ -88,9 +89,13 @@ namespace userland {
         if (!target_description) return -EBADF;
         u64 fd_key = calculate_key(fd, target_description);
 
-        if (op == EPOLL_CTL_ADD || op == EPOLL_CTL_MOD)
-            if ((user_event->events & EPOLLONESHOT) || (user_event->events & EPOLLWAKEUP) || (user_event->events & EPOLLEXCLUSIVE))
-                klib::printf("epoll: unsupported event flags %#X\n", user_event->events);
+        epoll_event event = {};
+        if (op == EPOLL_CTL_ADD || op == EPOLL_CTL_MOD) {
+            if (mem::get_user(&event, user_event) < 0)
+                return -EFAULT;
+            if ((event.events & EPOLLONESHOT) || (event.events & EPOLLWAKEUP) || (event.events & EPOLLEXCLUSIVE))
+                klib::printf("epoll: unsupported event flags %#X\n", event.events);
+        }
 
         klib::InterruptLock interrupt_guard;
 
@@ -102,7 +107,7 @@ namespace userland {
             epoll->events[index] = {
                 .description = target_description,
                 .old_revents = 0,
-                .user_events = *user_event,
+                .user_events = event,
             };
             epoll->wait_events[index + 1] = target_description->vnode->event;
             epoll->key_to_events_index.emplace(fd_key, index);
@@ -110,7 +115,7 @@ namespace userland {
         case EPOLL_CTL_MOD: {
             if (!index_ptr) return -ENOENT;
             usize index = *index_ptr;
-            epoll->events[index].user_events = *user_event;
+            epoll->events[index].user_events = event;
         } break;
         case EPOLL_CTL_DEL: {
             if (!index_ptr) return -ENOENT;
@@ -131,6 +136,7 @@ namespace userland {
         return 0;
     }
 
+    // events is a user pointer, timeout and sigmask are in kernel memory
     isize epoll_pwait2_impl(int epfd, epoll_event *events, int maxevents, const klib::TimeSpec *timeout, const u64 *sigmask) {
         if (maxevents <= 0) return -EINVAL;
         auto *epoll_description = vfs::get_file_description(epfd);
@@ -177,8 +183,9 @@ namespace userland {
                 event.old_revents = new_revents;
 
                 if (revents) {
-                    events[num_ready].events = revents;
-                    events[num_ready].data = event.user_events.data;
+                    epoll_event ready_event = { .events = (u32)revents, .data = event.user_events.data };
+                    if (mem::put_user(&events[num_ready], ready_event) < 0)
+                        return num_ready ? num_ready : -EFAULT;
                     num_ready++;
                     if (num_ready >= maxevents)
                         break;
@@ -209,17 +216,26 @@ namespace userland {
 
     isize syscall_epoll_pwait(int epfd, epoll_event *events, int maxevents, int timeout, const u64 *sigmask) {
         log_syscall("epoll_pwait(%d, %#lX, %d, %d, %#lX)\n", epfd, (uptr)events, maxevents, timeout, (uptr)sigmask);
+        u64 kernel_sigmask;
+        if (sigmask && mem::get_user(&kernel_sigmask, sigmask) < 0)
+            return -EFAULT;
         if (timeout >= 0) {
             klib::TimeSpec ts;
             ts.seconds = timeout / 1000;
             ts.nanoseconds = (timeout % 1000) * 1000000;
-            return epoll_pwait2_impl(epfd, events, maxevents, &ts, sigmask);
+            return epoll_pwait2_impl(epfd, events, maxevents, &ts, sigmask ? &kernel_sigmask : nullptr);
         }
-        return epoll_pwait2_impl(epfd, events, maxevents, nullptr, sigmask);
+        return epoll_pwait2_impl(epfd, events, maxevents, nullptr, sigmask ? &kernel_sigmask : nullptr);
     }
 
     isize syscall_epoll_pwait2(int epfd, epoll_event *events, int maxevents, const klib::TimeSpec *timeout, const u64 *sigmask) {
         log_syscall("epoll_pwait2(%d, %#lX, %d, %#lX, %#lX)\n", epfd, (uptr)events, maxevents, (uptr)timeout, (uptr)sigmask);
-        return epoll_pwait2_impl(epfd, events, maxevents, timeout, sigmask);
+        klib::TimeSpec kernel_timeout;
+        u64 kernel_sigmask;
+        if (timeout && mem::get_user(&kernel_timeout, timeout) < 0)
+            return -EFAULT;
+        if (sigmask && mem::get_user(&kernel_sigmask, sigmask) < 0)
+            return -EFAULT;
+        return epoll_pwait2_impl(epfd, events, maxevents, timeout ? &kernel_timeout : nullptr, sigmask ? &kernel_sigmask : nullptr);
     }
 }
@@ -17,7 +17,7 @@ namespace userland {
             return -EAGAIN;
 
         sched::Process *process = cpu::get_current_thread()->process;
-        isize phy_addr = process->pagemap->get_physical_addr((uptr)uaddr);
+        isize phy_addr = process->pagemap->get_physical_addr((uptr)uaddr, true); // a shared zero or copy on write page would change on the next write
         if (phy_addr < 0) // errno
             return phy_addr;
 
@@ -47,7 +47,7 @@ namespace userland {
         __atomic_load_n(uaddr, __ATOMIC_SEQ_CST); // ensure page is not lazily mapped
 
         sched::Process *process = cpu::get_current_thread()->process;
-        isize phy_addr = process->pagemap->get_physical_addr((uptr)uaddr);
+        isize phy_addr = process->pagemap->get_physical_addr((uptr)uaddr, true); // a shared zero or copy on write page would change on the next write
         if (phy_addr < 0) // errno
             return phy_addr;
 
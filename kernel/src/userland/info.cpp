@@ -34,7 +34,7 @@ namespace userland {
         info->loads[1] = 0;
         info->loads[2] = 0;
         info->totalram = pmm::stats.total_pages_usable;
-        info->freeram = pmm::stats.total_free_pages;
+        info->freeram = pmm::num_free_pages();
         info->sharedram = 0;
         info->bufferram = 0;
         info->totalswap = 0;
@@ -35,9 +35,11 @@ namespace userland {
             if (pipe_event.wait() == -EINTR)
                 return -EINTR;
         }
-        count = ring_buffer.read((u8*)buf, count);
+        isize ret = ring_buffer.read_to_user((u8*)buf, count);
+        if (ret < 0)
+            return ret;
         pipe_event.trigger();
-        return count;
+        return ret;
     }
 
     isize Pipe::write(vfs::FileDescription *fd, const void *buf, usize count, usize offset) {
@@ -51,9 +53,11 @@ namespace userland {
             if (pipe_event.wait() == -EINTR)
                 return -EINTR;
         }
-        count = ring_buffer.write((const u8*)buf, count);
+        isize ret = ring_buffer.write_from_user((const u8*)buf, count);
+        if (ret < 0)
+            return ret;
         pipe_event.trigger();
-        return count;
+        return ret;
     }
 
     isize Pipe::poll(vfs::FileDescription *fd, isize events) {
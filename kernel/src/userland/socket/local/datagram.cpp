@@ -3,6 +3,7 @@
 #include <cpu/cpu.hpp>
 #include <sched/sched.hpp>
 #include <klib/cstdio.hpp>
+#include <mem/uaccess.hpp>
 #include <sys/un.h>
 #include <errno.h>
 
@@ -125,7 +126,8 @@ namespace socket {
             struct iovec *iov = &hdr->msg_iov[i];
             if (iov->iov_len == 0) continue;
             usize count = klib::min(datagram->length - transferred, iov->iov_len);
-            memcpy(iov->iov_base, datagram->data + transferred, count);
+            if (mem::copy_to_user(iov->iov_base, datagram->data + transferred, count) < 0)
+                return -EFAULT;
             transferred += count;
             if (count < iov->iov_len)
                 break;
@@ -180,7 +182,10 @@ namespace socket {
         for (usize i = 0; i < hdr->msg_iovlen; i++) {
             struct iovec *iov = &hdr->msg_iov[i];
             if (iov->iov_len == 0) continue;
-            memcpy(datagram->data + copied, iov->iov_base, iov->iov_len);
+            if (mem::copy_from_user(datagram->data + copied, iov->iov_base, iov->iov_len) < 0) {
+                klib::free(datagram);
+                return -EFAULT;
+            }
             copied += iov->iov_len;
         }
 
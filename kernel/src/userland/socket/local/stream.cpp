@@ -218,7 +218,13 @@ namespace socket {
                     break;
             }
 
-            transferred += ring_buffer->read((u8*)iov->iov_base, amount_to_read);
+            isize count = ring_buffer->read_to_user((u8*)iov->iov_base, amount_to_read);
+            if (count < 0) {
+                if (is_seqpacket)
+                    ring_buffer->truncate(packet_length - transferred);
+                return transferred ? transferred : count;
+            }
+            transferred += count;
             if (ring_buffer->is_empty())
                 break;
         }
@@ -278,7 +284,13 @@ namespace socket {
         for (usize i = 0; i < hdr->msg_iovlen; i++) {
             struct iovec *iov = &hdr->msg_iov[i];
             if (iov->iov_len == 0) continue;
-            transferred += peer->ring_buffer->write((u8*)iov->iov_base, iov->iov_len);
+            isize count = peer->ring_buffer->write_from_user((u8*)iov->iov_base, iov->iov_len);
+            if (count < 0) {
+                if (transferred)
+                    break;
+                return count;
+            }
+            transferred += count;
             if (peer->ring_buffer->is_full())
                 break;
         }
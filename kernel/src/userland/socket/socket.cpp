@@ -7,6 +7,7 @@
 #include <cpu/cpu.hpp>
 #include <sched/sched.hpp>
 #include <klib/cstdio.hpp>
+#include <mem/uaccess.hpp>
 #include <errno.h>
 
 #define SHUT_RD 0
@@ -14,6 +15,97 @@
 #define SHUT_RDWR 2
 
 namespace socket {
+    constexpr usize max_iovecs = 1024;
+    constexpr usize max_control_length = 0x4000;
+
+    // a user msghdr with its iovec array, name and control copied into kernel memory, the iov_base pointers stay user pointers
+    struct KernelMsghdr {
+        msghdr hdr = {};
+        sockaddr_storage name = {};
+
+        KernelMsghdr() {}
+        KernelMsghdr(const KernelMsghdr &other) = delete;
+        ~KernelMsghdr() {
+            delete[] hdr.msg_iov;
+            delete[] (u8*)hdr.msg_control;
+        }
+
+        // for sending the control data is copied as well, for receiving only room is made for it
+        isize copy_from_user(const msghdr *user_hdr, bool sending) {
+            if (mem::get_user(&hdr, user_hdr) < 0)
+                return -EFAULT;
+            const iovec *user_iovs = hdr.msg_iov;
+            void *user_name = hdr.msg_name;
+            void *user_control = hdr.msg_control;
+            hdr.msg_iov = nullptr;
+            hdr.msg_control = nullptr;
+
+            if (hdr.msg_iovlen > max_iovecs)
+                return -EMSGSIZE;
+            hdr.msg_iov = new iovec[hdr.msg_iovlen];
+            if (mem::copy_from_user(hdr.msg_iov, user_iovs, hdr.msg_iovlen * sizeof(iovec)) < 0)
+                return -EFAULT;
+
+            if (user_name) {
+                hdr.msg_name = &name;
+                hdr.msg_namelen = klib::min(hdr.msg_namelen, sizeof(sockaddr_storage));
+                if (sending && mem::copy_from_user(&name, user_name, hdr.msg_namelen) < 0)
+                    return -EFAULT;
+            } else {
+                hdr.msg_namelen = 0;
+            }
+
+            if (user_control && hdr.msg_controllen > 0) {
+                if (sending && hdr.msg_controllen > max_control_length)
+                    return -ENOBUFS;
+                hdr.msg_controllen = klib::min(hdr.msg_controllen, max_control_length);
+                hdr.msg_control = new u8[hdr.msg_controllen]();
+                if (sending && mem::copy_from_user(hdr.msg_control, user_control, hdr.msg_controllen) < 0)
+                    return -EFAULT;
+            } else {
+                hdr.msg_controllen = 0;
+            }
+            return 0;
+        }
+
+        // writes back what recvmsg filled in
+        isize copy_to_user(msghdr *user_hdr) {
+            msghdr user_copy;
+            if (mem::get_user(&user_copy, user_hdr) < 0)
+                return -EFAULT;
+            if (user_copy.msg_name && mem::copy_to_user(user_copy.msg_name, &name, klib::min(hdr.msg_namelen, user_copy.msg_namelen)) < 0)
+                return -EFAULT;
+            if (user_copy.msg_control && mem::copy_to_user(user_copy.msg_control, hdr.msg_control, klib::min(hdr.msg_controllen, user_copy.msg_controllen)) < 0)
+                return -EFAULT;
+            if (mem::put_user(&user_hdr->msg_namelen, hdr.msg_namelen) < 0
+                || mem::put_user(&user_hdr->msg_controllen, hdr.msg_controllen) < 0
+                || mem::put_user(&user_hdr->msg_flags, hdr.msg_flags) < 0)
+                return -EFAULT;
+            return 0;
+        }
+    };
+
+    // copies a user sockaddr into storage, which stays zero terminated for the sun_path of a local address
+    static isize copy_sockaddr_from_user(sockaddr_storage *storage, const sockaddr *user_addr, socklen_t addr_length) {
+        if (addr_length > sizeof(sockaddr_storage))
+            return -EINVAL;
+        *storage = {};
+        return mem::copy_from_user(storage, user_addr, addr_length);
+    }
+
+    // for the sockaddr and length that accept, getsockname and getpeername fill in
+    static isize copy_sockaddr_to_user(sockaddr *user_addr, socklen_t *user_addr_length, const sockaddr_storage *storage, socklen_t addr_length, socklen_t room) {
+        if (mem::copy_to_user(user_addr, storage, klib::min(addr_length, room)) < 0)
+            return -EFAULT;
+        return mem::put_user(user_addr_length, addr_length);
+    }
+
+    // undoes create_socket_fd when the fd cannot be handed to the user after all
+    static void close_socket_fd(int fd) {
+        sched::Process *process = cpu::get_current_thread()->process;
+        process->file_descriptors[fd].close(process, fd);
+    }
+
     Socket::Socket() {
         node_type = vfs::NodeType::SOCKET;
     }
@@ -40,13 +132,25 @@ namespace socket {
     }
 
     isize Socket::readv(vfs::FileDescription *fd, const iovec *iovs, int iovc, usize offset) {
-        msghdr hdr = { .msg_iov = (iovec*)iovs, .msg_iovlen = (usize)iovc };
-        return this->recvmsg(fd, &hdr, 0);
+        if (iovc < 0 || (usize)iovc > max_iovecs)
+            return -EINVAL;
+        KernelMsghdr kernel_hdr;
+        kernel_hdr.hdr.msg_iov = new iovec[iovc];
+        kernel_hdr.hdr.msg_iovlen = iovc;
+        if (mem::copy_from_user(kernel_hdr.hdr.msg_iov, iovs, iovc * sizeof(iovec)) < 0)
+            return -EFAULT;
+        return this->recvmsg(fd, &kernel_hdr.hdr, 0);
     }
 
     isize Socket::writev(vfs::FileDescription *fd, const iovec *iovs, int iovc, usize offset) {
-        msghdr hdr = { .msg_iov = (iovec*)iovs, .msg_iovlen = (usize)iovc };
-        return this->sendmsg(fd, &hdr, 0);
+        if (iovc < 0 || (usize)iovc > max_iovecs)
+            return -EINVAL;
+        KernelMsghdr kernel_hdr;
+        kernel_hdr.hdr.msg_iov = new iovec[iovc];
+        kernel_hdr.hdr.msg_iovlen = iovc;
+        if (mem::copy_from_user(kernel_hdr.hdr.msg_iov, iovs, iovc * sizeof(iovec)) < 0)
+            return -EFAULT;
+        return this->sendmsg(fd, &kernel_hdr.hdr, 0);
     }
 
     isize syscall_socket(int family, int type, int protocol) {
@@ -82,6 +186,7 @@ namespace socket {
 
         sched::Thread *thread = cpu::get_current_thread();
         sched::Process *process = thread->process;
+        int kernel_fds[2];
         ucred credentials;
         credentials.pid = process->pid;
         credentials.uid = thread->cred.uids.eid;
@@ -98,8 +203,8 @@ namespace socket {
             socket1->credentials = credentials;
             socket2->credentials = credentials;
 
-            fds[0] = socket1->create_socket_fd(flags);
-            fds[1] = socket2->create_socket_fd(flags);
+            kernel_fds[0] = socket1->create_socket_fd(flags);
+            kernel_fds[1] = socket2->create_socket_fd(flags);
         } else if (type == SOCK_DGRAM) {
             auto *socket1 = new LocalDatagramSocket();
             auto *socket2 = new LocalDatagramSocket();
@@ -107,11 +212,16 @@ namespace socket {
             socket1->connected = socket2;
             socket2->connected = socket1;
 
-            fds[0] = socket1->create_socket_fd(flags);
-            fds[1] = socket2->create_socket_fd(flags);
+            kernel_fds[0] = socket1->create_socket_fd(flags);
+            kernel_fds[1] = socket2->create_socket_fd(flags);
         } else {
             return -EINVAL;
         }
+        if (mem::copy_to_user(fds, kernel_fds, sizeof(kernel_fds)) < 0) {
+            close_socket_fd(kernel_fds[0]);
+            close_socket_fd(kernel_fds[1]);
+            return -EFAULT;
+        }
         return 0;
     }
 
@@ -126,17 +236,23 @@ namespace socket {
     isize syscall_bind(int fd, const sockaddr *addr_ptr, socklen_t addr_length) {
         log_syscall("bind(%d, %#lX, %u)\n", fd, (uptr)addr_ptr, addr_length);
         get_socket(fd);
-        if (addr_ptr->sa_family != socket->socket_family)
+        sockaddr_storage addr;
+        if (isize err = copy_sockaddr_from_user(&addr, addr_ptr, addr_length); err < 0)
+            return err;
+        if (addr.ss_family != socket->socket_family)
             return -EINVAL;
-        return socket->bind(description, addr_ptr, addr_length);
+        return socket->bind(description, (sockaddr*)&addr, addr_length);
     }
 
     isize syscall_connect(int fd, const sockaddr *addr_ptr, socklen_t addr_length) {
         log_syscall("connect(%d, %#lX, %u)\n", fd, (uptr)addr_ptr, addr_length);
         get_socket(fd);
-        if (addr_ptr->sa_family != socket->socket_family)
+        sockaddr_storage addr;
+        if (isize err = copy_sockaddr_from_user(&addr, addr_ptr, addr_length); err < 0)
+            return err;
+        if (addr.ss_family != socket->socket_family)
             return -EAFNOSUPPORT;
-        return socket->connect(description, addr_ptr, addr_length);
+        return socket->connect(description, (sockaddr*)&addr, addr_length);
     }
 
     isize syscall_listen(int fd, int backlog) {
@@ -145,50 +261,94 @@ namespace socket {
         return socket->listen(description, backlog);
     }
 
+    static isize accept_impl(Socket *socket, vfs::FileDescription *description, sockaddr *addr_ptr, socklen_t *addr_length, int flags) {
+        if (!addr_ptr || !addr_length)
+            return socket->accept(description, nullptr, nullptr, flags);
+
+        socklen_t room;
+        if (mem::get_user(&room, addr_length) < 0)
+            return -EFAULT;
+        sockaddr_storage addr = {};
+        socklen_t length = sizeof(sockaddr_storage);
+        isize new_fd = socket->accept(description, (sockaddr*)&addr, &length, flags);
+        if (new_fd < 0)
+            return new_fd;
+        if (copy_sockaddr_to_user(addr_ptr, addr_length, &addr, length, room) < 0) {
+            close_socket_fd(new_fd);
+            return -EFAULT;
+        }
+        return new_fd;
+    }
+
     isize syscall_accept4(int fd, sockaddr *addr_ptr, socklen_t *addr_length, int flags) {
         log_syscall("accept4(%d, %#lX, %#lX, %d)\n", fd, (uptr)addr_ptr, (uptr)addr_length, flags);
         get_socket(fd);
         if (flags & ~(SOCK_NONBLOCK | SOCK_CLOEXEC))
             return -EINVAL;
-        return socket->accept(description, addr_ptr, addr_length, flags);
+        return accept_impl(socket, description, addr_ptr, addr_length, flags);
     }
 
     isize syscall_accept(int fd, sockaddr *addr_ptr, socklen_t *addr_length) {
         log_syscall("accept(%d, %#lX, %#lX)\n", fd, (uptr)addr_ptr, (uptr)addr_length);
         get_socket(fd);
-        return socket->accept(description, addr_ptr, addr_length, 0);
+        return accept_impl(socket, description, addr_ptr, addr_length, 0);
     }
 
     isize syscall_recvfrom(int fd, void *buf, usize size, int flags, sockaddr *src_addr, socklen_t *addrlen) {
         log_syscall("recvfrom(%d, %#lX, %#lX, %d, %#lX, %#lX)\n", fd, (uptr)buf, size, flags, (uptr)src_addr, (uptr)addrlen);
         get_socket(fd);
+        socklen_t room = 0;
+        if (src_addr && addrlen && mem::get_user(&room, addrlen) < 0)
+            return -EFAULT;
+        sockaddr_storage addr = {};
         iovec iov = { .iov_base = buf, .iov_len = size };
-        msghdr hdr = { .msg_name = src_addr, .msg_iov = &iov, .msg_iovlen = 1 };
-        if (addrlen) hdr.msg_namelen = *addrlen;
+        msghdr hdr = { .msg_iov = &iov, .msg_iovlen = 1 };
+        if (src_addr && addrlen) {
+            hdr.msg_name = &addr;
+            hdr.msg_namelen = klib::min(room, sizeof(sockaddr_storage));
+        }
         isize ret = socket->recvmsg(description, &hdr, flags);
         if (ret < 0) return ret;
-        if (addrlen) *addrlen = hdr.msg_namelen;
+        if (src_addr && addrlen && copy_sockaddr_to_user(src_addr, addrlen, &addr, hdr.msg_namelen, room) < 0)
+            return -EFAULT;
         return ret;
     }
 
     isize syscall_recvmsg(int fd, msghdr *hdr, int flags) {
         log_syscall("recvmsg(%d, %#lX, %d)\n", fd, (uptr)hdr, flags);
         get_socket(fd);
-        return socket->recvmsg(description, hdr, flags);
+        KernelMsghdr kernel_hdr;
+        if (isize err = kernel_hdr.copy_from_user(hdr, false); err < 0)
+            return err;
+        isize ret = socket->recvmsg(description, &kernel_hdr.hdr, flags);
+        if (ret < 0) return ret;
+        if (kernel_hdr.copy_to_user(hdr) < 0)
+            return -EFAULT;
+        return ret;
     }
 
     isize syscall_sendto(int fd, void *buf, usize size, int flags, const sockaddr *dest_addr, socklen_t addrlen) {
         log_syscall("sendto(%d, %#lX, %#lX, %d, %#lX, %#lX)\n", fd, (uptr)buf, size, flags, (uptr)dest_addr, (uptr)addrlen);
         get_socket(fd);
+        sockaddr_storage addr;
         iovec iov = { .iov_base = buf, .iov_len = size };
-        msghdr hdr = { .msg_name = (void*)dest_addr, .msg_namelen = addrlen, .msg_iov = &iov, .msg_iovlen = 1 };
+        msghdr hdr = { .msg_iov = &iov, .msg_iovlen = 1 };
+        if (dest_addr) {
+            if (isize err = copy_sockaddr_from_user(&addr, dest_addr, addrlen); err < 0)
+                return err;
+            hdr.msg_name = &addr;
+            hdr.msg_namelen = addrlen;
+        }
         return socket->sendmsg(description, &hdr, flags);
     }
 
     isize syscall_sendmsg(int fd, const msghdr *hdr, int flags) {
         log_syscall("sendmsg(%d, %#lX, %d)\n", fd, (uptr)hdr, flags);
         get_socket(fd);
-        return socket->sendmsg(description, hdr, flags);
+        KernelMsghdr kernel_hdr;
+        if (isize err = kernel_hdr.copy_from_user(hdr, true); err < 0)
+            return err;
+        return socket->sendmsg(description, &kernel_hdr.hdr, flags);
     }
 
     isize syscall_shutdown(int fd, int how) {
@@ -202,36 +362,64 @@ namespace socket {
     isize syscall_getsockopt(int fd, int layer, int number, void *buffer, socklen_t *size) {
         log_syscall("getsockopt(%d, %d, %d, %#lX, %#lX)\n", fd, layer, number, (uptr)buffer, (uptr)size);
         get_socket(fd);
-        if (layer == SOL_SOCKET) {
-            switch (number) {
-            case SO_TYPE:
-                *(int*)buffer = socket->socket_type;
-                *size = sizeof(int);
-                return 0;
-            case SO_DOMAIN:
-                *(int*)buffer = socket->socket_family;
-                *size = sizeof(int);
-                return 0;
-            }
+        socklen_t room;
+        if (mem::get_user(&room, size) < 0)
+            return -EFAULT;
+
+        // every option fits in this, the implementations write it without looking at the size
+        u8 value[64] = {};
+        socklen_t value_size = 0;
+        if (layer == SOL_SOCKET && number == SO_TYPE) {
+            *(int*)value = socket->socket_type;
+            value_size = sizeof(int);
+        } else if (layer == SOL_SOCKET && number == SO_DOMAIN) {
+            *(int*)value = socket->socket_family;
+            value_size = sizeof(int);
+        } else {
+            value_size = sizeof(value);
+            if (isize err = socket->getsockopt(description, layer, number, value, &value_size); err < 0)
+                return err;
         }
-        return socket->getsockopt(description, layer, number, buffer, size);
+
+        if (mem::copy_to_user(buffer, value, klib::min(value_size, room)) < 0)
+            return -EFAULT;
+        return mem::put_user(size, klib::min(value_size, room));
     }
 
     isize syscall_setsockopt(int fd, int layer, int number, const void *buffer, socklen_t size) {
         log_syscall("setsockopt(%d, %d, %d, %#lX, %#X)\n", fd, layer, number, (uptr)buffer, size);
         get_socket(fd);
-        return socket->setsockopt(description, layer, number, buffer, size);
+        u8 value[64] = {};
+        if (size > sizeof(value))
+            size = sizeof(value); // no option is bigger, the rest would be ignored anyway
+        if (mem::copy_from_user(value, buffer, size) < 0)
+            return -EFAULT;
+        return socket->setsockopt(description, layer, number, value, size);
     }
 
     isize syscall_getsockname(int fd, sockaddr *addr_ptr, socklen_t *addr_length) {
         log_syscall("getsockname(%d, %#lX, %#lX)\n", fd, (uptr)addr_ptr, (uptr)addr_length);
         get_socket(fd);
-        return socket->getsockname(description, addr_ptr, addr_length);
+        socklen_t room;
+        if (mem::get_user(&room, addr_length) < 0)
+            return -EFAULT;
+        sockaddr_storage addr = {};
+        socklen_t length = sizeof(sockaddr_storage);
+        if (isize err = socket->getsockname(description, (sockaddr*)&addr, &length); err < 0)
+            return err;
+        return copy_sockaddr_to_user(addr_ptr, addr_length, &addr, length, room);
     }
 
     isize syscall_getpeername(int fd, sockaddr *addr_ptr, socklen_t *addr_length) {
         log_syscall("getpeername(%d, %#lX, %#lX)\n", fd, (uptr)addr_ptr, (uptr)addr_length);
         get_socket(fd);
-        return socket->getpeername(description, addr_ptr, addr_length);
+        socklen_t room;
+        if (mem::get_user(&room, addr_length) < 0)
+            return -EFAULT;
+        sockaddr_storage addr = {};
+        socklen_t length = sizeof(sockaddr_storage);
+        if (isize err = socket->getpeername(description, (sockaddr*)&addr, &length); err < 0)
+            return err;
+        return copy_sockaddr_to_user(addr_ptr, addr_length, &addr, length, room);
     }
 }
@@ -135,7 +135,10 @@ namespace socket {
         for (usize i = 0; i < hdr->msg_iovlen; i++) {
             struct iovec *iov = &hdr->msg_iov[i];
             if (iov->iov_len == 0) continue;
-            transferred += recv_ring_buffer->read((u8*)iov->iov_base, iov->iov_len);
+            isize count = recv_ring_buffer->read_to_user((u8*)iov->iov_base, iov->iov_len);
+            if (count < 0)
+                return transferred ? transferred : count;
+            transferred += count;
             if (recv_ring_buffer->is_empty())
                 break;
         }
@@ -177,7 +180,10 @@ namespace socket {
         for (usize i = 0; i < hdr->msg_iovlen; i++) {
             struct iovec *iov = &hdr->msg_iov[i];
             if (iov->iov_len == 0) continue;
-            transferred += send_ring_buffer->write((u8*)iov->iov_base, iov->iov_len);
+            isize count = send_ring_buffer->write_from_user((u8*)iov->iov_base, iov->iov_len);
+            if (count < 0)
+                return transferred ? transferred : count;
+            transferred += count;
             if (send_ring_buffer->is_full())
                 break;
         }